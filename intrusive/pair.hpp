@@ -1,15 +1,86 @@
 #pragma once
 
+#include <cstddef> // size_t
+#include <cstdint> // uint32_t, uintptr_t
+#include <cstring> // memcpy
+#include <new> // placement new
 #include <tuple> // forward_as_tuple, make_from_tuple, tuple
-#include <utility> // forward, move, pair, piecewise_construct, piecewise_construct_t, swap
+#include <type_traits> // is_same_v, is_trivially_copyable_v
+#include <utility> // forward, move, pair, piecewise_construct,
+                   // piecewise_construct_t, swap
 
 #include "pair_fwd.hpp"
 
 namespace intrusive {
 
-template <typename A, typename B> class pair {
+// Link policies say how a pair finds its partner. If L::RELINKS, L::link<T>
+// holds a link to a T, which is null when default constructed, and pairs keep
+// their partners linked to them as they move. The link converts to whether it
+// is not null, get() is the T of a link that is not null, set(T*) links to a
+// T that is not null and reset() makes the link null.
+
+// The partner's address
+struct pointer_link {
+  inline static constexpr bool RELINKS = true;
+  template <typename T> class link {
+   public:
+    constexpr T* get() const { return p_; }
+    constexpr void set(T* p) { p_ = p; }
+    constexpr void reset() { p_ = nullptr; }
+    constexpr explicit operator bool() const { return p_; }
+
+   private:
+    T* p_ = nullptr;
+  };
+};
+
+// The partner's distance from the link, so that pairs stay linked when the
+// memory holding both is mapped at another address, as when a file of them
+// is mapped by another process. Unlike index_link it needs no owner to do the
+// linking, so it suits pairs outside a container that manages their indices,
+// and it reaches across the whole address space.
+struct offset_link {
+  inline static constexpr bool RELINKS = true;
+  template <typename T> class link {
+   public:
+    T* get() const { return reinterpret_cast<T*>(address() + d_); }
+    void set(T* p) { d_ = reinterpret_cast<std::uintptr_t>(p) - address(); }
+    void reset() { d_ = 0; }
+    explicit operator bool() const { return d_; }
+
+   private:
+    std::uintptr_t address() const {
+      return reinterpret_cast<std::uintptr_t>(this);
+    }
+
+    // 0 is null, since the partner is not where the link is
+    std::uintptr_t d_ = 0;
+  };
+};
+
+// A 32-bit index of the partner, half the size of a pointer on 64-bit
+// targets. Only the owner of the arrays holding the pairs knows what the index
+// is relative to, so it does the linking: pairs with index links move their
+// index with them and do not relink their partners, make() leaves them
+// unlinked, and index() and set_index() replace other() and partner().
+struct index_link {
+  inline static constexpr bool RELINKS = false;
+  template <typename T> class link {
+   public:
+    constexpr std::uint32_t get() const { return i_; }
+    constexpr void set(std::uint32_t i) { i_ = i; }
+
+   private:
+    std::uint32_t i_ = 0;
+  };
+};
+
+template <typename A, typename B, typename L> class pair {
   struct private_construct_t {};
-  friend class pair<B, A>;
+  friend class pair<B, A, L>;
+  template <typename AA, typename BB, typename LL, typename F>
+  friend pair<AA, BB, LL>* relocate_range(pair<AA, BB, LL>*, pair<AA, BB, LL>*,
+                                          std::size_t, F);
 
  public:
   // (47) TODO: is_constructible_v
@@ -27,11 +98,11 @@ template <typename A, typename B> class pair {
   constexpr void swap(pair&);
 
   template <typename AA = A, typename BB = B>
-  static constexpr std::pair<pair, pair<B, A>> make(AA&& = AA(), BB&& = BB());
+  static constexpr std::pair<pair, pair<B, A, L>> make(AA&& = AA(),
+                                                       BB&& = BB());
   template <typename... AARGS, typename... BARGS>
-  static constexpr std::pair<pair, pair<B, A>> make(std::piecewise_construct_t,
-                                                    std::tuple<AARGS...>,
-                                                    std::tuple<BARGS...>);
+  static constexpr std::pair<pair, pair<B, A, L>>
+  make(std::piecewise_construct_t, std::tuple<AARGS...>, std::tuple<BARGS...>);
 
   constexpr bool operator==(const pair&) const;
   constexpr bool operator!=(const pair& o) const { return !(*this == o); }
@@ -52,94 +123,201 @@ template <typename A, typename B> class pair {
   constexpr A* operator->() { return &a_; }
   constexpr const A* operator->() const { return &a_; }
 
-  constexpr pair<B, A>* other() { return other_; }
-  constexpr const pair<B, A>* other() const { return other_; }
+  // The partner, or null
+  constexpr pair<B, A, L>* other() { return other_ ? other_.get() : nullptr; }
+  constexpr const pair<B, A, L>* other() const {
+    return other_ ? other_.get() : nullptr;
+  }
+  // The partner of a pair that has one, without checking
+  constexpr pair<B, A, L>& partner() { return *other_.get(); }
+  constexpr const pair<B, A, L>& partner() const { return *other_.get(); }
+
+  // The partner's index, with index links
+  constexpr std::uint32_t index() const {
+    static_assert(!L::RELINKS);
+    return other_.get();
+  }
+  constexpr void set_index(std::uint32_t i) {
+    static_assert(!L::RELINKS);
+    other_.set(i);
+  }
 
  private:
   // (1)
   template <typename... ARGS>
-  constexpr explicit pair(ARGS... args)
-      : a_(std::forward<ARGS>(args)...), other_(nullptr) {}
+  constexpr explicit pair(ARGS... args) : a_(std::forward<ARGS>(args)...) {}
 
   [[no_unique_address]] A a_;
-  pair<B, A>* other_;
+  typename L::template link<pair<B, A, L>> other_;
 };
 
 // (58)
-template <typename A, typename B>
-constexpr pair<A, B>::pair(pair&& p) : a_(std::move(p.a_)), other_(p.other_) {
-  if (other_) {
-    p.other_ = nullptr;
-    other_->other_ = this;
+template <typename A, typename B, typename L>
+constexpr pair<A, B, L>::pair(pair&& p) : a_(std::move(p.a_)) {
+  if constexpr (!L::RELINKS) {
+    other_ = p.other_;
+  } else if (p.other_) {
+    auto* o = p.other_.get();
+    p.other_.reset();
+    other_.set(o);
+    o->other_.set(this);
   }
 }
 
-template <typename A, typename B> pair<A, B>::~pair() {
-  if (other_) { other_->other_ = nullptr; }
+template <typename A, typename B, typename L> pair<A, B, L>::~pair() {
+  if constexpr (L::RELINKS) {
+    if (other_) { other_.get()->other_.reset(); }
+  }
 }
 
 // =(34)
-template <typename A, typename B>
-constexpr pair<A, B>& pair<A, B>::operator=(pair&& p) {
+template <typename A, typename B, typename L>
+constexpr pair<A, B, L>& pair<A, B, L>::operator=(pair&& p) {
   if (&p == this) { return *this; }
-  if constexpr (std::is_same_v<A, B>) {
-    if (p.other_ == this) { other_ = p.other_ = nullptr; }
-  }
-  if (other_) { other_->other_ = nullptr; }
-  other_ = p.other_;
-  a_ = std::move(p.a_);
-  if (other_) {
-    p.other_ = nullptr;
-    other_->other_ = this;
+  if constexpr (!L::RELINKS) {
+    a_ = std::move(p.a_);
+    other_ = p.other_;
+  } else {
+    if constexpr (std::is_same_v<A, B>) {
+      if (p.other() == this) {
+        other_.reset();
+        p.other_.reset();
+      }
+    }
+    if (other_) { other_.get()->other_.reset(); }
+    a_ = std::move(p.a_);
+    if (p.other_) {
+      auto* o = p.other_.get();
+      p.other_.reset();
+      other_.set(o);
+      o->other_.set(this);
+    } else {
+      other_.reset();
+    }
   }
   return *this;
 }
 
-template <typename A, typename B> constexpr void pair<A, B>::swap(pair& p) {
+template <typename A, typename B, typename L>
+constexpr void pair<A, B, L>::swap(pair& p) {
   if (&p == this) { return; }
   using std::swap;
   swap(a_, p.a_);
-  if (&p == other_) { return; }
-  swap(other_, p.other_);
-  if (other_) { other_->other_ = this; }
-  if (p.other_) { p.other_->other_ = &p; }
+  if constexpr (!L::RELINKS) {
+    swap(other_, p.other_);
+  } else {
+    if constexpr (std::is_same_v<A, B>) {
+      if (&p == other()) { return; }
+    }
+    auto* o = other();
+    auto* po = p.other();
+    if (po) {
+      other_.set(po);
+      po->other_.set(this);
+    } else {
+      other_.reset();
+    }
+    if (o) {
+      p.other_.set(o);
+      o->other_.set(&p);
+    } else {
+      p.other_.reset();
+    }
+  }
 }
 
-template <typename A, typename B>
+template <typename A, typename B, typename L>
 template <typename AA, typename BB>
-constexpr std::pair<pair<A, B>, pair<B, A>> pair<A, B>::make(AA&& a, BB&& b) {
-  auto lhs = pair<A, B>(std::forward<AA>(a));
-  auto rhs = pair<B, A>(std::forward<BB>(b));
-  lhs.other_ = &rhs;
-  rhs.other_ = &lhs;
+constexpr std::pair<pair<A, B, L>, pair<B, A, L>>
+pair<A, B, L>::make(AA&& a, BB&& b) {
+  auto lhs = pair<A, B, L>(std::forward<AA>(a));
+  auto rhs = pair<B, A, L>(std::forward<BB>(b));
+  if constexpr (L::RELINKS) {
+    lhs.other_.set(&rhs);
+    rhs.other_.set(&lhs);
+  }
   return std::make_pair(std::move(lhs), std::move(rhs));
 }
 
-template <typename A, typename B>
+template <typename A, typename B, typename L>
 template <typename... AARGS, typename... BARGS>
-constexpr std::pair<pair<A, B>, pair<B, A>>
-pair<A, B>::make(std::piecewise_construct_t, std::tuple<AARGS...> a,
-                 std::tuple<BARGS...> b) {
-  auto lhs = pair<A, B>(std::make_from_tuple<A>(a));
-  auto rhs = pair<B, A>(std::make_from_tuple<B>(b));
-  lhs.other_ = &rhs;
-  rhs.other_ = &lhs;
+constexpr std::pair<pair<A, B, L>, pair<B, A, L>>
+pair<A, B, L>::make(std::piecewise_construct_t, std::tuple<AARGS...> a,
+                    std::tuple<BARGS...> b) {
+  auto lhs = pair<A, B, L>(std::make_from_tuple<A>(a));
+  auto rhs = pair<B, A, L>(std::make_from_tuple<B>(b));
+  if constexpr (L::RELINKS) {
+    lhs.other_.set(&rhs);
+    rhs.other_.set(&lhs);
+  }
   return std::make_pair(std::move(lhs), std::move(rhs));
 }
 
-template <typename A, typename B>
-constexpr bool pair<A, B>::operator==(const pair<A, B>& o) const {
+template <typename A, typename B, typename L>
+constexpr bool pair<A, B, L>::operator==(const pair& o) const {
   if (this == &o) { return true; }
   if (!(a_ == o.a_)) { return false; }
-  if (other_ == o.other_) { return true; }
-  return other_ && o.other_ && other_->a_ == o.other_->a_;
+  if constexpr (!L::RELINKS) {
+    return index() == o.index();
+  } else {
+    if (other() == o.other()) { return true; }
+    return other() && o.other() && other()->a_ == o.other()->a_;
+  }
 }
 
-template <typename A, typename B>
-constexpr bool pair<A, B>::operator<(const pair<A, B>& o) const {
+template <typename A, typename B, typename L>
+constexpr bool pair<A, B, L>::operator<(const pair& o) const {
   if (a_ < o.a_) { return true; }
   if (o.a_ < a_) { return false; }
-  if (!other_ && !o.other_) { return false; }
-  return !other_ || (o.other_ && other_->b < o.other_->b);
+  if constexpr (!L::RELINKS) {
+    return index() < o.index();
+  } else {
+    if (!other() && !o.other()) { return false; }
+    return !other() || (o.other() && other()->a_ < o.other()->a_);
+  }
+}
+
+// The partner_fixup of relocate_range that does nothing
+struct no_fixup {
+  template <typename P> constexpr void operator()(P&, std::size_t) const {}
+};
+
+// Relocates the n pairs at src to the uninitialized memory at dst, which does
+// not overlap it: the pairs at dst are linked as those at src were, and those
+// at src are gone without being destroyed. Pairs of trivially copyable values
+// are copied as bytes in one pass and their partners relinked in a second,
+// sequential one; others are moved one at a time. partner_fixup(dst[i], i) is
+// called on each pair once it is relocated, which lets the owner of pairs with
+// index links relink them. Returns dst + n.
+template <typename A, typename B, typename L, typename F>
+pair<A, B, L>* relocate_range(pair<A, B, L>* src, pair<A, B, L>* dst,
+                              std::size_t n, F partner_fixup) {
+  if constexpr (std::is_trivially_copyable_v<A>) {
+    if (n) {
+      std::memcpy(static_cast<void*>(dst), static_cast<const void*>(src),
+                  n * sizeof(pair<A, B, L>));
+    }
+    for (std::size_t i = 0; i < n; ++i) {
+      if constexpr (L::RELINKS) {
+        if (src[i].other_) {
+          auto* o = src[i].other_.get();
+          if constexpr (std::is_same_v<A, B>) {
+            // A partner in the range moves too
+            if (o >= src && o < src + n) { o = dst + (o - src); }
+          }
+          dst[i].other_.set(o);
+          o->other_.set(dst + i);
+        }
+      }
+      partner_fixup(dst[i], i);
+    }
+  } else {
+    for (std::size_t i = 0; i < n; ++i) {
+      new (dst + i) pair<A, B, L>(std::move(src[i]));
+      src[i].~pair<A, B, L>();
+      partner_fixup(dst[i], i);
+    }
+  }
+  return dst + n;
 }
 } // namespace intrusive
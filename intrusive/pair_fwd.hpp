@@ -1,12 +1,22 @@
 #pragma once
 
+#include <cstddef> // size_t
 #include <utility> // pair
 
 namespace intrusive {
 
-template <typename A, typename B> class pair;
+struct pointer_link;
+struct offset_link;
+struct index_link;
+
+template <typename A, typename B, typename L = pointer_link> class pair;
 
 template <typename A, typename B>
 constexpr std::pair<pair<A, B>, pair<B, A>> make_pair(const A&, const B&);
 
+struct no_fixup;
+template <typename A, typename B, typename L, typename F = no_fixup>
+pair<A, B, L>* relocate_range(pair<A, B, L>* src, pair<A, B, L>* dst,
+                              std::size_t n, F partner_fixup = F());
+
 } // namespace intrusive
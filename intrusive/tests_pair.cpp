@@ -1,6 +1,10 @@
 #include "pair.hpp"
 #include <catch2/catch.hpp>
+#include <cstdint>
+#include <cstring>
+#include <string>
 #include <variant>
+#include <vector>
 
 using namespace intrusive;
 
@@ -68,3 +72,119 @@ TEST_CASE("moving", "[intrusive::pair]") {
   REQUIRE(q == 4);
   REQUIRE(s == 6);
 }
+
+TEST_CASE("offset links", "[intrusive::pair]") {
+  using offset_pair = pair<int, std::string, offset_link>;
+  REQUIRE(sizeof(pair<std::monostate, int, offset_link>) == sizeof(size_t));
+  auto [p, q] = offset_pair::make(3, "three");
+  REQUIRE(p.other() == &q);
+  REQUIRE(q.other() == &p);
+  REQUIRE(p.other()->get() == "three");
+  auto [r, s] = offset_pair::make(5, "five");
+  swap(p, r);
+  REQUIRE(p.other() == &s);
+  REQUIRE(s.other() == &p);
+  REQUIRE(q.other() == &r);
+  REQUIRE(r.other()->get() == "three");
+  REQUIRE(&r.partner() == &q);
+
+  // Copying both pairs to places at the same distance from each other keeps
+  // them linked
+  using int_pair = pair<int, int, offset_link>;
+  alignas(int_pair) unsigned char left[2][sizeof(int_pair)];
+  auto [t, u] = int_pair::make(7, 8);
+  int_pair* a = new (left[0]) int_pair(std::move(t));
+  int_pair* b = new (left[1]) int_pair(std::move(u));
+  REQUIRE(a->other() == b);
+  alignas(int_pair) unsigned char right[2][sizeof(int_pair)];
+  std::memcpy(right, left, sizeof(left));
+  auto* c = reinterpret_cast<int_pair*>(right[0]);
+  REQUIRE(static_cast<void*>(c->other()) == right[1]);
+  REQUIRE(c->other()->get() == 8);
+  a->~int_pair();
+  REQUIRE(b->other() == nullptr);
+  b->~int_pair();
+}
+
+TEST_CASE("index links", "[intrusive::pair]") {
+  using index_pair = pair<std::monostate, int, index_link>;
+  REQUIRE(sizeof(index_pair) == sizeof(std::uint32_t));
+  // The owner links the pairs, and moving one moves only its index
+  auto [p, q] = index_pair::make({}, 4);
+  p.set_index(7);
+  q.set_index(2);
+  index_pair r(std::move(p));
+  REQUIRE(r.index() == 7);
+  auto [s, t] = index_pair::make();
+  s.set_index(1);
+  swap(r, s);
+  REQUIRE(r.index() == 1);
+  REQUIRE(s.index() == 7);
+  REQUIRE(q.index() == 2);
+  q = std::move(t);
+  REQUIRE(q.index() == 0);
+  REQUIRE(*q == 0);
+}
+
+// Relocates the left halves of three pairs and checks that the right halves
+// follow them
+template <typename L, typename A, typename B> void check_relocate(A a, B b) {
+  using P = pair<A, B, L>;
+  std::vector<std::pair<P, pair<B, A, L>>> pairs;
+  pairs.reserve(3);
+  for (int i = 0; i < 3; ++i) { pairs.push_back(P::make(a, b)); }
+  alignas(P) unsigned char src[3 * sizeof(P)], dst[3 * sizeof(P)];
+  P* s = reinterpret_cast<P*>(src);
+  P* d = reinterpret_cast<P*>(dst);
+  for (int i = 0; i < 3; ++i) { new (s + i) P(std::move(pairs[i].first)); }
+  std::size_t fixed = 0;
+  REQUIRE(relocate_range(s, d, 3, [&](P& p, std::size_t i) {
+            REQUIRE(&p == d + i);
+            ++fixed;
+          }) == d + 3);
+  REQUIRE(fixed == 3);
+  for (int i = 0; i < 3; ++i) {
+    REQUIRE(pairs[i].second.other() == d + i);
+    REQUIRE(d[i].other() == &pairs[i].second);
+    REQUIRE(*d[i] == a);
+    d[i].~P();
+    REQUIRE(!pairs[i].second.other());
+  }
+}
+
+TEST_CASE("relocating ranges", "[intrusive::pair]") {
+  check_relocate<pointer_link>(3, 4);
+  check_relocate<offset_link>(3, 4);
+  check_relocate<pointer_link>(std::string("left"), std::string("right"));
+
+  // Partners in the same range stay linked to each other
+  using P = pair<int, int>;
+  alignas(P) unsigned char src[2 * sizeof(P)], dst[2 * sizeof(P)];
+  P* s = reinterpret_cast<P*>(src);
+  P* d = reinterpret_cast<P*>(dst);
+  auto [p, q] = P::make(1, 2);
+  new (s) P(std::move(p));
+  new (s + 1) P(std::move(q));
+  relocate_range(s, d, 2);
+  REQUIRE(d[0].other() == d + 1);
+  REQUIRE(d[1].other() == d);
+  REQUIRE(*d[1].other() == 1);
+  d[0].~P();
+  d[1].~P();
+
+  // The owner relinks pairs with index links
+  using index_pair = pair<std::monostate, int, index_link>;
+  alignas(index_pair) unsigned char isrc[2 * sizeof(index_pair)],
+      idst[2 * sizeof(index_pair)];
+  auto* is = reinterpret_cast<index_pair*>(isrc);
+  auto* id = reinterpret_cast<index_pair*>(idst);
+  for (std::uint32_t i = 0; i < 2; ++i) {
+    new (is + i) index_pair(std::move(index_pair::make().first));
+    is[i].set_index(10 + i);
+  }
+  relocate_range(is, id, 2, [](index_pair& e, std::size_t) {
+    e.set_index(e.index() + 10);
+  });
+  REQUIRE(id[0].index() == 20);
+  REQUIRE(id[1].index() == 21);
+}
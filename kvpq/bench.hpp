@@ -0,0 +1,196 @@
+// Workloads shared by the kvpq benchmarks
+#pragma once
+
+#include <array>         // array
+#include <cmath>         // pow
+#include <cstddef>       // size_t
+#include <cstdint>       // uint64_t
+#include <functional>    // equal_to, hash, less
+#include <queue>         // priority_queue
+#include <random>        // mt19937_64, uniform_real_distribution
+#include <unordered_map> // unordered_map
+#include <utility>       // move, pair
+#include <vector>        // vector
+
+#include <linux/perf_event.h> // perf_event_attr, PERF_*
+#include <sys/ioctl.h>        // ioctl
+#include <sys/syscall.h>      // SYS_perf_event_open
+#include <unistd.h>           // close, read, syscall
+
+namespace bench {
+
+// A key or value of N bytes
+template <std::size_t N> struct blob {
+  static_assert(N % sizeof(std::uint64_t) == 0);
+  blob() = default;
+  explicit blob(std::uint64_t x) { w.fill(x); }
+  bool operator==(const blob& o) const { return w == o.w; }
+  bool operator!=(const blob& o) const { return w != o.w; }
+  bool operator<(const blob& o) const { return w < o.w; }
+  std::array<std::uint64_t, N / sizeof(std::uint64_t)> w{};
+};
+
+template <typename T> T make(std::uint64_t x) { return T(x); }
+
+// splitmix64: a bijection, so distinct ranks give distinct keys
+inline std::uint64_t mix(std::uint64_t x) {
+  x += 0x9e3779b97f4a7c15;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+  return x ^ (x >> 31);
+}
+
+// Ranks in [0, n) following Zipf's law with exponent theta, from Gray et al.,
+// "Quickly Generating Billion-Record Synthetic Databases"
+class zipf {
+ public:
+  explicit zipf(std::uint64_t n, double theta = 0.99)
+      : n_(n), theta_(theta), alpha_(1. / (1. - theta)), zetan_(zeta(n)),
+        eta_((1. - std::pow(2. / n, 1. - theta)) / (1. - zeta(2) / zetan_)) {}
+
+  template <typename G> std::uint64_t operator()(G& gen) {
+    double u = std::uniform_real_distribution<double>()(gen);
+    double uz = u * zetan_;
+    if (uz < 1.) { return 0; }
+    if (uz < 1. + std::pow(.5, theta_)) { return 1; }
+    return n_ * std::pow(eta_ * u - eta_ + 1., alpha_);
+  }
+
+ private:
+  double zeta(std::uint64_t n) const {
+    double sum = 0;
+    for (std::uint64_t i = 1; i <= n; ++i) { sum += std::pow(1. / i, theta_); }
+    return sum;
+  }
+
+  std::uint64_t n_;
+  double theta_, alpha_, zetan_, eta_;
+};
+
+enum distribution { UNIFORM, ZIPFIAN };
+inline const char* name(distribution d) {
+  return d == UNIFORM ? "uniform" : "zipfian";
+}
+
+// len ranks in [0, n) drawn from d. The most popular Zipfian ranks map to
+// scattered keys through mix().
+inline std::vector<std::uint64_t> ranks(distribution d, std::uint64_t n,
+                                        std::size_t len,
+                                        std::uint64_t seed = 1) {
+  std::mt19937_64 gen(seed);
+  std::vector<std::uint64_t> r(len);
+  if (d == UNIFORM) {
+    for (auto& x : r) { x = gen() % n; }
+  } else {
+    zipf z(n);
+    for (auto& x : r) { x = z(gen); }
+  }
+  return r;
+}
+
+// An event of the calling thread counted through perf_event_open. Virtual
+// machines often expose no hardware events, and then it counts nothing.
+class perf_counter {
+ public:
+  perf_counter(std::uint32_t type, std::uint64_t config) {
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_hv = 1;
+    fd_ = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+  perf_counter(const perf_counter&) = delete;
+  perf_counter& operator=(const perf_counter&) = delete;
+  ~perf_counter() {
+    if (fd_ >= 0) { close(fd_); }
+  }
+
+  explicit operator bool() const { return fd_ >= 0; }
+  void start() {
+    ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  std::uint64_t stop() {
+    std::uint64_t count = 0;
+    ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd_, &count, sizeof(count)) != sizeof(count)) { return 0; }
+    return count;
+  }
+
+ private:
+  int fd_;
+};
+
+// Data TLB misses of loads, and page faults, which are counted in software
+struct tlb_counters {
+  perf_counter misses{PERF_TYPE_HW_CACHE,
+                      PERF_COUNT_HW_CACHE_DTLB |
+                          PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                          PERF_COUNT_HW_CACHE_RESULT_MISS << 16};
+  perf_counter faults{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS};
+};
+
+// The usual pairing of a hash map with a binary heap: erase only removes the
+// map entry and heap entries whose key is no longer mapped are skipped when
+// they reach the top. The heap is rebuilt once dead entries outnumber live
+// ones.
+template <typename K, typename V, typename H = std::hash<K>,
+          typename EQ = std::equal_to<K>, typename C = std::less<K>>
+class map_pq {
+ public:
+  using map_type = std::unordered_map<K, V, H, EQ>;
+  using iterator = typename map_type::iterator;
+
+  std::pair<iterator, bool> insert(const std::pair<K, V>& p) {
+    auto r = map_.insert(p);
+    if (r.second) {
+      heap_.push(p.first);
+      compact();
+    }
+    return r;
+  }
+  std::size_t erase(const K& k) { return map_.erase(k); }
+  iterator find(const K& k) { return map_.find(k); }
+  iterator end() { return map_.end(); }
+  std::pair<const K, V>& top() {
+    skip();
+    return *map_.find(heap_.top());
+  }
+  void pop() {
+    skip();
+    map_.erase(heap_.top());
+    heap_.pop();
+  }
+  std::size_t size() const { return map_.size(); }
+  bool empty() const { return map_.empty(); }
+  void reserve(std::size_t n) { map_.reserve(n); }
+
+ private:
+  void skip() {
+    while (!map_.count(heap_.top())) { heap_.pop(); }
+  }
+  void compact() {
+    if (heap_.size() < 2 * map_.size() + 16) { return; }
+    std::vector<K> live;
+    live.reserve(map_.size());
+    for (const auto& p : map_) { live.push_back(p.first); }
+    heap_ = std::priority_queue<K, std::vector<K>, C>(C(), std::move(live));
+  }
+
+  map_type map_;
+  std::priority_queue<K, std::vector<K>, C> heap_;
+};
+
+} // namespace bench
+
+namespace std {
+template <std::size_t N> struct hash<bench::blob<N>> {
+  std::size_t operator()(const bench::blob<N>& b) const {
+    std::uint64_t h = 0;
+    for (std::uint64_t x : b.w) { h = bench::mix(h ^ x); }
+    return h;
+  }
+};
+} // namespace std
@@ -0,0 +1,680 @@
+// kvpq against std::unordered_map + std::priority_queue with lazy deletion
+#include <benchmark/benchmark.h>
+#include <cstdint>
+#include <filesystem>
+#include <span>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "bench.hpp"
+#include "bounded_kvpq.hpp"
+#include "huge_page_allocator.hpp"
+#include "kvpq.hpp"
+
+#ifndef BENCH_MAX_N
+#define BENCH_MAX_N 1000000
+#endif
+
+using bench::blob;
+using bench::distribution;
+using bench::make;
+using bench::mix;
+using std::uint64_t;
+
+namespace {
+constexpr std::size_t QUERIES = 1 << 20;
+
+// The n keys of a benchmark, inserted in random order
+template <typename Q> struct workload {
+  using K = typename std::remove_reference_t<
+      decltype(std::declval<Q&>().top())>::first_type;
+  using V = typename std::remove_reference_t<
+      decltype(std::declval<Q&>().top())>::second_type;
+
+  workload(distribution d, uint64_t n)
+      : n(n), keys(n), queries(bench::ranks(d, n, QUERIES)) {
+    for (uint64_t r = 0; r < n; ++r) { keys[r] = mix(r); }
+  }
+  void fill(Q& q) const {
+    q.reserve(n);
+    for (uint64_t k : keys) { q.insert({make<K>(k), make<V>(k)}); }
+  }
+  // A key not yet in the universe
+  uint64_t fresh() { return mix(n + next++); }
+
+  uint64_t n, next = 0;
+  std::vector<uint64_t> keys;
+  std::vector<uint64_t> queries;
+};
+
+// Reports the TLB misses and page faults of a benchmark per iteration, if
+// they can be counted
+struct counted {
+  explicit counted(benchmark::State& state) : state(state) {
+    for (auto* c : {&tlb.misses, &tlb.faults}) {
+      if (*c) { c->start(); }
+    }
+  }
+  ~counted() {
+    for (auto [name, c] : {std::pair{"dTLB_misses", &tlb.misses},
+                           std::pair{"page_faults", &tlb.faults}}) {
+      if (*c) {
+        state.counters[name] = benchmark::Counter(
+            c->stop(), benchmark::Counter::kAvgIterations);
+      }
+    }
+  }
+  benchmark::State& state;
+  bench::tlb_counters tlb;
+};
+
+template <typename Q> void push(benchmark::State& state, distribution d) {
+  workload<Q> w(d, state.range(0));
+  auto stream = bench::ranks(d, w.n, w.n, 2);
+  counted c(state);
+  for (auto _ : state) {
+    Q q;
+    for (uint64_t r : stream) {
+      q.insert({make<typename workload<Q>::K>(w.keys[r]),
+                make<typename workload<Q>::V>(r)});
+    }
+    benchmark::DoNotOptimize(q.size());
+    state.PauseTiming();
+    { Q done = std::move(q); }
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * w.n);
+}
+
+// push's stream through the range constructor
+template <typename Q> void build(benchmark::State& state, distribution d) {
+  using K = typename workload<Q>::K;
+  using V = typename workload<Q>::V;
+  workload<Q> w(d, state.range(0));
+  std::vector<std::pair<K, V>> items;
+  for (uint64_t r : bench::ranks(d, w.n, w.n, 2)) {
+    items.push_back({make<K>(w.keys[r]), make<V>(r)});
+  }
+  for (auto _ : state) {
+    Q q(items.begin(), items.end());
+    benchmark::DoNotOptimize(q.size());
+    state.PauseTiming();
+    { Q done = std::move(q); }
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * w.n);
+}
+
+// Makes room for n more entries in a queue of n and finishes the migration to
+// the new table, so that the time is all of the growth: relocating the heap
+// and rehashing the table. Items are the entries that move.
+template <typename Q> void grow(benchmark::State& state, distribution d) {
+  workload<Q> w(d, state.range(0));
+  for (auto _ : state) {
+    state.PauseTiming();
+    Q q;
+    w.fill(q);
+    state.ResumeTiming();
+    q.reserve(2 * w.n);
+    q.rehash(q.capacity());
+    benchmark::DoNotOptimize(q.size());
+    state.PauseTiming();
+    { Q done = std::move(q); }
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * w.n);
+}
+
+// Copies a queue of n entries. Items are the entries copied.
+template <typename Q> void copy(benchmark::State& state, distribution d) {
+  workload<Q> w(d, state.range(0));
+  Q q;
+  w.fill(q);
+  for (auto _ : state) {
+    Q c = q;
+    benchmark::DoNotOptimize(c.size());
+    state.PauseTiming();
+    { Q done = std::move(c); }
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * w.n);
+}
+
+// Compares a queue of n entries with one filled in the reverse order, as a
+// replica built on its own would be. Items are the entries compared.
+template <typename Q> void equal(benchmark::State& state, distribution d) {
+  workload<Q> w(d, state.range(0));
+  Q q, r;
+  w.fill(q);
+  r.reserve(w.n);
+  for (auto it = w.keys.rbegin(); it != w.keys.rend(); ++it) {
+    r.insert({make<typename workload<Q>::K>(*it),
+              make<typename workload<Q>::V>(*it)});
+  }
+  for (auto _ : state) { benchmark::DoNotOptimize(q == r); }
+  state.SetItemsProcessed(state.iterations() * w.n);
+}
+
+// Opens an image of the queue that build makes and finds 1000 of its keys,
+// which reads the pages they are on. Items are the entries of the queue, as in
+// build.
+template <typename Q>
+void open_mapped(benchmark::State& state, distribution d) {
+  workload<Q> w(d, state.range(0));
+  auto path = std::filesystem::temp_directory_path() / "bench_kvpq.image";
+  {
+    Q q;
+    w.fill(q);
+    q.save(path);
+  }
+  std::size_t i = 0;
+  for (auto _ : state) {
+    Q q = Q::open_mapped(path);
+    for (int j = 0; j < 1000; ++j) {
+      auto k = make<typename workload<Q>::K>(w.keys[w.queries[i++ % QUERIES]]);
+      benchmark::DoNotOptimize(q.find(k) != q.end());
+    }
+  }
+  std::filesystem::remove(path);
+  state.SetItemsProcessed(state.iterations() * w.n);
+}
+
+template <typename Q> void pop(benchmark::State& state, distribution d) {
+  workload<Q> w(d, state.range(0));
+  for (auto _ : state) {
+    state.PauseTiming();
+    Q q;
+    w.fill(q);
+    state.ResumeTiming();
+    while (!q.empty()) {
+      benchmark::DoNotOptimize(q.top().second);
+      q.pop();
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * w.n);
+}
+
+// pop's drain in batches of B entries with pop_k
+template <typename Q, std::size_t B>
+void pop_k(benchmark::State& state, distribution d) {
+  workload<Q> w(d, state.range(0));
+  std::vector<std::pair<typename workload<Q>::K, typename workload<Q>::V>>
+      batch(B);
+  for (auto _ : state) {
+    state.PauseTiming();
+    Q q;
+    w.fill(q);
+    state.ResumeTiming();
+    while (!q.empty()) {
+      benchmark::DoNotOptimize(q.pop_k(B, batch.begin()));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * w.n);
+}
+
+template <typename Q> void find(benchmark::State& state, distribution d) {
+  workload<Q> w(d, state.range(0));
+  Q q;
+  w.fill(q);
+  std::size_t i = 0;
+  counted c(state);
+  for (auto _ : state) {
+    auto k = make<typename workload<Q>::K>(w.keys[w.queries[i++ % QUERIES]]);
+    benchmark::DoNotOptimize(q.find(k) != q.end());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// find over batches of B keys with find_batch
+template <typename Q, std::size_t B>
+void find_batch(benchmark::State& state, distribution d) {
+  using K = typename workload<Q>::K;
+  workload<Q> w(d, state.range(0));
+  Q q;
+  w.fill(q);
+  std::vector<K> keys;
+  for (uint64_t r : w.queries) { keys.push_back(make<K>(w.keys[r])); }
+  std::vector<typename Q::iterator> found(B, q.end());
+  std::size_t i = 0;
+  counted c(state);
+  for (auto _ : state) {
+    q.find_batch(std::span<const K>(keys.data() + i, B), found);
+    benchmark::DoNotOptimize(found.data());
+    i = (i + B) % QUERIES;
+  }
+  state.SetItemsProcessed(state.iterations() * B);
+}
+
+// Looks up keys that were never inserted
+template <typename Q> void find_miss(benchmark::State& state, distribution d) {
+  workload<Q> w(d, state.range(0));
+  Q q;
+  w.fill(q);
+  std::size_t i = 0;
+  counted c(state);
+  for (auto _ : state) {
+    auto k = make<typename workload<Q>::K>(mix(w.n + w.queries[i++ % QUERIES]));
+    benchmark::DoNotOptimize(q.find(k) != q.end());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Erases n keys drawn from d, so Zipfian streams mostly miss after the
+// popular keys are gone
+template <typename Q> void erase(benchmark::State& state, distribution d) {
+  workload<Q> w(d, state.range(0));
+  auto stream = bench::ranks(d, w.n, w.n, 3);
+  for (auto _ : state) {
+    state.PauseTiming();
+    Q q;
+    w.fill(q);
+    state.ResumeTiming();
+    for (uint64_t r : stream) {
+      benchmark::DoNotOptimize(
+          q.erase(make<typename workload<Q>::K>(w.keys[r])));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * w.n);
+}
+
+// Moves the entry with key old to key k, in place or by erase and insert
+template <bool IN_PLACE, bool DECREASE = false, typename Q>
+void rekey(Q& q, uint64_t old, uint64_t k) {
+  using K = typename workload<Q>::K;
+  using V = typename workload<Q>::V;
+  if constexpr (IN_PLACE && DECREASE) {
+    q.decrease_key(q.find(make<K>(old)), make<K>(k));
+  } else if constexpr (IN_PLACE) {
+    q.update(make<K>(old), make<K>(k));
+  } else {
+    q.erase(make<K>(old));
+    q.insert({make<K>(k), make<V>(k)});
+  }
+}
+
+// The key is the priority, so updating it moves the entry to a fresh key
+template <typename Q, bool IN_PLACE = false>
+void update(benchmark::State& state, distribution d) {
+  workload<Q> w(d, state.range(0));
+  Q q;
+  w.fill(q);
+  std::size_t i = 0;
+  for (auto _ : state) {
+    uint64_t& k = w.keys[w.queries[i++ % QUERIES]];
+    uint64_t f = w.fresh();
+    rekey<IN_PLACE>(q, k, f);
+    k = f;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Small decreases, as in Dijkstra's algorithm or when a timer is brought
+// forward
+template <typename Q, bool IN_PLACE = false>
+void decrease(benchmark::State& state, distribution d) {
+  workload<Q> w(d, state.range(0));
+  Q q;
+  w.fill(q);
+  std::size_t i = 0;
+  for (auto _ : state) {
+    uint64_t& k = w.keys[w.queries[i % QUERIES]];
+    uint64_t f = k - 1 - mix(i++) % 1024;
+    rekey<IN_PLACE, true>(q, k, f);
+    k = f;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// 50% find, 15% push, 15% pop, 10% erase, 10% update
+template <typename Q> void mixed(benchmark::State& state, distribution d) {
+  using K = typename workload<Q>::K;
+  using V = typename workload<Q>::V;
+  workload<Q> w(d, state.range(0));
+  Q q;
+  w.fill(q);
+  std::size_t i = 0;
+  for (auto _ : state) {
+    uint64_t r = w.queries[i % QUERIES];
+    uint64_t& k = w.keys[r];
+    switch (mix(i++) % 20) {
+    case 0:
+    case 1:
+    case 2: {
+      uint64_t f = w.fresh();
+      q.insert({make<K>(f), make<V>(f)});
+      break;
+    }
+    case 3:
+    case 4:
+    case 5:
+      if (!q.empty()) { q.pop(); }
+      break;
+    case 6:
+    case 7: benchmark::DoNotOptimize(q.erase(make<K>(k))); break;
+    case 8:
+    case 9: {
+      uint64_t f = w.fresh();
+      rekey<false>(q, k, f);
+      k = f;
+      break;
+    }
+    default: benchmark::DoNotOptimize(q.find(make<K>(k)) != q.end());
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Timers keyed by deadline, earliest first, as in an event loop. Each event
+// takes the earliest timer and either schedules another after a delay of a
+// rank drawn from d, or one time in four reschedules it as a periodic timer
+// would. The low bits of a key keep keys with the same deadline apart.
+// Deadlines never precede the last one taken, which is the workload radix
+// heaps are built for.
+template <typename Q>
+void event_loop(benchmark::State& state, distribution d) {
+  constexpr int SEQ = 22;
+  uint64_t n = state.range(0), seq = 0;
+  auto delays = bench::ranks(d, n, QUERIES);
+  Q q;
+  q.reserve(n);
+  for (uint64_t i = 0; i < n; ++i) {
+    q.insert({delays[i % QUERIES] << SEQ | seq++ % (1 << SEQ), i});
+  }
+  std::size_t i = 0;
+  for (auto _ : state) {
+    uint64_t now = q.top().first >> SEQ;
+    uint64_t k = (now + delays[i % QUERIES]) << SEQ | seq++ % (1 << SEQ);
+    if (mix(i++) % 4) {
+      uint64_t v = q.top().second;
+      q.pop();
+      q.insert({k, v});
+    } else {
+      q.update(q.begin(), k);
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// What cancel keeps to cancel a timer by
+template <typename Q, bool HANDLES> struct timer_of {
+  using type = uint64_t;
+};
+template <typename Q> struct timer_of<Q, true> {
+  using type = typename Q::handle;
+};
+
+// n timers of which two in five are cancelled before they fire, as when most
+// requests finish before their timeouts: each iteration cancels the timer set
+// n / 2 iterations ago, or fires the earliest if that one is gone or two
+// times in five, and sets a new timer at a delay drawn from d. With HANDLES
+// timers are cancelled by a handle rather than by their key.
+template <typename Q, bool HANDLES = false>
+void cancel(benchmark::State& state, distribution d) {
+  constexpr int SEQ = 22;
+  uint64_t n = state.range(0), now = 0, i = 0;
+  auto delays = bench::ranks(d, n, QUERIES);
+  using timer = typename timer_of<Q, HANDLES>::type;
+  std::vector<timer> set;
+  set.reserve(n);
+  Q q;
+  q.reserve(n);
+  auto schedule = [&] {
+    uint64_t k = (now + delays[i % QUERIES]) << SEQ | i % (1 << SEQ);
+    auto it = q.insert({k, i}).first;
+    timer t = [&] {
+      if constexpr (HANDLES) {
+        return q.handle_of(it);
+      } else {
+        return k;
+      }
+    }();
+    if (set.size() < n) {
+      set.push_back(t);
+    } else {
+      set[i % n] = t;
+    }
+    ++i;
+  };
+  while (i < n) { schedule(); }
+  for (auto _ : state) {
+    if (mix(i) % 5 >= 2 || !q.erase(set[(i + n / 2) % n])) {
+      now = q.top().first >> SEQ;
+      q.pop();
+    }
+    schedule();
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// A cache of the n keys of highest priority that a consumer takes from: each
+// iteration offers a key drawn from d, which a full cache makes room for by
+// evicting its lowest key, and one time in four the top is taken as well
+template <typename Q> void cache(benchmark::State& state, distribution d) {
+  uint64_t n = state.range(0);
+  auto keys = bench::ranks(d, 4 * n, QUERIES);
+  Q q(n);
+  for (uint64_t i = 0; q.size() < n; ++i) { q.push({mix(i), i}); }
+  std::size_t i = 0;
+  for (auto _ : state) {
+    uint64_t k = mix(keys[i % QUERIES]);
+    q.push({k, i});
+    if (mix(i++) % 4 == 0) { q.pop(); }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// The cache as two kvpqs that both hold every key, one ordered in reverse so
+// that its top is the entry to evict
+struct dual_cache {
+  explicit dual_cache(std::size_t max_size) : max_size(max_size) {
+    top.reserve(max_size + 1);
+    bottom.reserve(max_size + 1);
+  }
+  void push(const std::pair<uint64_t, uint64_t>& p) {
+    if (!top.insert(p).second) { return; }
+    bottom.insert(p);
+    if (top.size() > max_size) {
+      top.erase(bottom.top().first);
+      bottom.pop();
+    }
+  }
+  void pop() {
+    bottom.erase(top.top().first);
+    top.pop();
+  }
+  std::size_t size() const { return top.size(); }
+
+  ds::kvpq<uint64_t, uint64_t> top;
+  ds::kvpq<uint64_t, uint64_t, std::hash<uint64_t>, std::equal_to<uint64_t>,
+           std::greater<uint64_t>>
+      bottom;
+  std::size_t max_size;
+};
+
+using benchmark_fn = void (*)(benchmark::State&, distribution);
+
+void register_op(const std::string& op, const std::string& queue,
+                 benchmark_fn fn) {
+  for (distribution d : {bench::UNIFORM, bench::ZIPFIAN}) {
+    benchmark::RegisterBenchmark(
+        (op + "/" + queue + "/" + bench::name(d)).c_str(), fn, d)
+        ->RangeMultiplier(10)
+        ->Range(1000, BENCH_MAX_N);
+  }
+}
+
+template <typename Q> void register_queue(const std::string& queue) {
+  for (auto [op, fn] : {std::pair<const char*, benchmark_fn>{"push", push<Q>},
+                        {"pop", pop<Q>},
+                        {"find", find<Q>},
+                        {"find_miss", find_miss<Q>},
+                        {"erase", erase<Q>},
+                        {"update", update<Q>},
+                        {"decrease", decrease<Q>},
+                        {"mixed", mixed<Q>}}) {
+    register_op(op, queue, fn);
+  }
+}
+
+template <typename K, typename V>
+void register_types(const std::string& types) {
+  using Q = ds::kvpq<K, V>;
+  register_queue<Q>("kvpq<" + types + ">");
+  register_op("build", "kvpq<" + types + ">", build<Q>);
+  register_op("grow", "kvpq<" + types + ">", grow<Q>);
+  register_op("copy", "kvpq<" + types + ">", copy<Q>);
+  register_op("equal", "kvpq<" + types + ">", equal<Q>);
+  register_op("open_mapped", "kvpq<" + types + ">", open_mapped<Q>);
+  register_op("pop_k16", "kvpq<" + types + ">", pop_k<Q, 16>);
+  register_op("pop_k256", "kvpq<" + types + ">", pop_k<Q, 256>);
+  register_op("pop_k4096", "kvpq<" + types + ">", pop_k<Q, 4096>);
+  register_op("find_batch64", "kvpq<" + types + ">", find_batch<Q, 64>);
+  register_op("find_batch512", "kvpq<" + types + ">", find_batch<Q, 512>);
+  register_op("update_in_place", "kvpq<" + types + ">", update<Q, true>);
+  register_op("decrease_in_place", "kvpq<" + types + ">", decrease<Q, true>);
+  register_queue<bench::map_pq<K, V>>("map_pq<" + types + ">");
+}
+
+// The heap-bound workloads with ARITY = D; kvpq<...> above has D = 2
+template <typename K, typename V, std::size_t D>
+void register_arity(const std::string& types) {
+  using Q = ds::kvpq<K, V, std::hash<K>, std::equal_to<K>, std::less<K>, D>;
+  std::string queue = "kvpq<" + types + ",d" + std::to_string(D) + ">";
+  register_op("push", queue, push<Q>);
+  register_op("pop", queue, pop<Q>);
+  register_op("decrease_in_place", queue, decrease<Q, true>);
+  register_op("mixed", queue, mixed<Q>);
+}
+
+// kvpq at max_load_factor 5, about 70% of buckets full, where probe sequences
+// are longer
+template <typename Q> struct loaded : Q {
+  loaded() { this->max_load_factor(5); }
+};
+
+template <typename K, typename V>
+void register_loaded(const std::string& types) {
+  using Q = loaded<ds::kvpq<K, V>>;
+  std::string queue = "kvpq<" + types + ",lf5>";
+  register_op("find", queue, find<Q>);
+  register_op("find_miss", queue, find_miss<Q>);
+  register_op("push", queue, push<Q>);
+  register_op("erase", queue, erase<Q>);
+}
+
+// The leading word of a blob, which orders blobs whose leading words differ
+struct first_word {
+  template <std::size_t N> uint64_t operator()(const blob<N>& b) const {
+    return b.w[0];
+  }
+};
+
+// The heap-bound workloads with priorities cached in the heap by PR
+template <typename K, typename V, typename PR>
+void register_priority(const std::string& types, const std::string& pr) {
+  using Q = ds::kvpq<K, V, std::hash<K>, std::equal_to<K>, std::less<>, 2, PR>;
+  std::string queue = "kvpq<" + types + "," + pr + ">";
+  register_op("push", queue, push<Q>);
+  register_op("pop", queue, pop<Q>);
+  register_op("decrease_in_place", queue, decrease<Q, true>);
+  register_op("mixed", queue, mixed<Q>);
+}
+// The event loop on each HEAP policy, and on a 4-ary heap. Cancellation with
+// each ERASE policy.
+template <typename HP, std::size_t D = 2, typename ER = ds::eager_erase>
+using timer_kvpq =
+    ds::kvpq<uint64_t, uint64_t, std::hash<uint64_t>, std::equal_to<uint64_t>,
+             std::greater<uint64_t>, D, ds::inline_key,
+             std::allocator<std::pair<uint64_t, uint64_t>>, ds::no_stats, HP,
+             ER>;
+
+void register_heaps() {
+  register_op("event_loop", "kvpq<u64,u64,greater>",
+              event_loop<timer_kvpq<ds::dary_heap>>);
+  register_op("event_loop", "kvpq<u64,u64,greater,d4>",
+              event_loop<timer_kvpq<ds::dary_heap, 4>>);
+  register_op("event_loop", "kvpq<u64,u64,greater,radix>",
+              event_loop<timer_kvpq<ds::radix_heap>>);
+  register_op("event_loop", "kvpq<u64,u64,greater,pairing>",
+              event_loop<timer_kvpq<ds::pairing_heap>>);
+  using pairing =
+      ds::kvpq<uint64_t, uint64_t, std::hash<uint64_t>,
+               std::equal_to<uint64_t>, std::less<uint64_t>, 2, ds::inline_key,
+               std::allocator<std::pair<uint64_t, uint64_t>>, ds::no_stats,
+               ds::pairing_heap>;
+  register_op("push", "kvpq<u64,u64,pairing>", push<pairing>);
+  register_op("pop", "kvpq<u64,u64,pairing>", pop<pairing>);
+  register_op("decrease_in_place", "kvpq<u64,u64,pairing>",
+              decrease<pairing, true>);
+  register_op("event_loop", "kvpq<u64,u64,greater,minmax>",
+              event_loop<timer_kvpq<ds::minmax_heap>>);
+  register_op("cancel", "kvpq<u64,u64,greater>",
+              cancel<timer_kvpq<ds::dary_heap>>);
+  register_op("cancel", "kvpq<u64,u64,greater,lazy>",
+              cancel<timer_kvpq<ds::dary_heap, 2, ds::lazy_erase>>);
+  register_op("cancel_handles", "kvpq<u64,u64,greater>",
+              cancel<timer_kvpq<ds::dary_heap>, true>);
+  register_op("cancel_handles", "kvpq<u64,u64,greater,lazy>",
+              cancel<timer_kvpq<ds::dary_heap, 2, ds::lazy_erase>, true>);
+  register_op("cancel", "map_pq<u64,u64,greater>",
+              cancel<bench::map_pq<uint64_t, uint64_t, std::hash<uint64_t>,
+                                   std::equal_to<uint64_t>,
+                                   std::greater<uint64_t>>>);
+  register_op("cache", "bounded_kvpq<u64,u64>",
+              cache<ds::bounded_kvpq<uint64_t, uint64_t>>);
+  register_op("cache", "2*kvpq<u64,u64>", cache<dual_cache>);
+}
+// kvpq recording its work in kvpq_stats. kvpq<...> records nothing, and the
+// difference is the cost of the statistics.
+template <typename K, typename V>
+void register_stats(const std::string& types) {
+  using Q = ds::kvpq<K, V, std::hash<K>, std::equal_to<K>, std::less<K>, 2,
+                     ds::default_priority<K>, std::allocator<std::pair<K, V>>,
+                     ds::kvpq_stats>;
+  std::string queue = "kvpq<" + types + ",stats>";
+  register_op("find", queue, find<Q>);
+  register_op("find_miss", queue, find_miss<Q>);
+  register_op("push", queue, push<Q>);
+  register_op("pop", queue, pop<Q>);
+  register_op("erase", queue, erase<Q>);
+}
+// kvpq whose tables and heap are in huge pages once they reach 2MiB
+template <typename K, typename V>
+using huge_kvpq = ds::kvpq<K, V, std::hash<K>, std::equal_to<K>, std::less<K>,
+                           2, ds::default_priority<K>,
+                           ds::huge_page_allocator<std::pair<K, V>>>;
+
+template <typename K, typename V> void register_huge(const std::string& types) {
+  using Q = huge_kvpq<K, V>;
+  std::string queue = "kvpq<" + types + ",huge>";
+  register_op("find", queue, find<Q>);
+  register_op("find_miss", queue, find_miss<Q>);
+  register_op("push", queue, push<Q>);
+}
+} // namespace
+
+int main(int argc, char** argv) {
+  register_types<uint64_t, uint64_t>("u64,u64");
+  register_types<uint64_t, blob<64>>("u64,b64");
+  register_types<blob<32>, uint64_t>("b32,u64");
+  register_arity<uint64_t, uint64_t, 4>("u64,u64");
+  register_arity<uint64_t, uint64_t, 8>("u64,u64");
+  register_arity<blob<32>, uint64_t, 4>("b32,u64");
+  register_arity<blob<32>, uint64_t, 8>("b32,u64");
+  register_loaded<uint64_t, uint64_t>("u64,u64");
+  register_loaded<blob<32>, uint64_t>("b32,u64");
+  register_priority<uint64_t, uint64_t, ds::inline_key>("u64,u64", "inline");
+  register_priority<blob<32>, uint64_t, ds::inline_key>("b32,u64", "inline");
+  register_priority<blob<32>, uint64_t, first_word>("b32,u64", "first_word");
+  register_heaps();
+  register_stats<uint64_t, uint64_t>("u64,u64");
+  register_stats<blob<32>, uint64_t>("b32,u64");
+  register_huge<uint64_t, uint64_t>("u64,u64");
+  register_huge<blob<32>, uint64_t>("b32,u64");
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) { return 1; }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+}
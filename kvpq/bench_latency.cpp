@@ -0,0 +1,44 @@
+// Per-insert latency percentiles across table growth
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "kvpq.hpp"
+
+using clk = std::chrono::steady_clock;
+
+template <typename MAP>
+void report(const char* name, const std::vector<std::uint64_t>& keys) {
+  MAP m;
+  std::vector<double> ns(keys.size());
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    auto start = clk::now();
+    m.insert({keys[i], i});
+    ns[i] =
+        std::chrono::duration<double, std::nano>(clk::now() - start).count();
+  }
+  double total = 0;
+  for (double t : ns) { total += t; }
+  std::sort(ns.begin(), ns.end());
+  auto pct = [&](double p) { return ns[std::size_t(p * (ns.size() - 1))]; };
+  std::printf("%-14s mean %7.1f  p50 %7.1f  p99 %7.1f  p99.9 %9.1f  max %11.1f "
+              "(ns)\n",
+              name, total / ns.size(), pct(.5), pct(.99), pct(.999),
+              ns.back());
+}
+
+int main(int argc, char** argv) {
+  std::size_t n = argc > 1 ? std::stoul(argv[1]) : 1 << 22;
+  std::mt19937_64 gen(1);
+  std::vector<std::uint64_t> keys(n);
+  for (auto& k : keys) { k = gen(); }
+  std::printf("%zu inserts into an empty map\n", n);
+  report<ds::kvpq<std::uint64_t, std::uint64_t>>("kvpq", keys);
+  report<std::unordered_map<std::uint64_t, std::uint64_t>>("unordered_map",
+                                                           keys);
+}
@@ -0,0 +1,92 @@
+// Lookups of std::string keys by std::string_view, with a hasher and
+// key_equal that take only std::string and with transparent ones, counting
+// the allocations each lookup makes
+#include <benchmark/benchmark.h>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "bench.hpp"
+#include "kvpq.hpp"
+
+using bench::mix;
+using std::uint64_t;
+
+namespace {
+// Allocations through operator new since the program started
+std::size_t allocations = 0;
+} // namespace
+
+void* operator new(std::size_t n) {
+  ++allocations;
+  if (void* p = std::malloc(n ? n : 1)) { return p; }
+  throw std::bad_alloc();
+}
+// GCC takes the pointer that a replacement operator delete frees to come from
+// operator new rather than malloc
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+namespace {
+constexpr uint64_t KEYS = 1 << 16;
+
+struct string_hash {
+  using is_transparent = void;
+  std::size_t operator()(std::string_view s) const {
+    return std::hash<std::string_view>()(s);
+  }
+};
+
+using plain = ds::kvpq<std::string, uint64_t>;
+using transparent =
+    ds::kvpq<std::string, uint64_t, string_hash, std::equal_to<>>;
+
+// Keys too long for the small string optimization, as request paths are
+std::string key(uint64_t r) {
+  return "/jobs/" + std::to_string(mix(r)) + "/status";
+}
+
+// Finds string_views of the keys, as a server does with the keys of requests
+// it has parsed. The plain kvpq must make a std::string of each. Neither
+// makes keys otherwise, though a lookup on a queue that is still rehashing
+// moves the entries it migrates, which makes copies of keys that cannot be
+// moved.
+template <typename Q> void find(benchmark::State& state) {
+  Q q;
+  std::vector<std::string> keys;
+  for (uint64_t r = 0; r < KEYS; ++r) {
+    keys.push_back(key(r));
+    q.insert({keys.back(), r});
+  }
+  std::size_t i = 0, before = allocations;
+  for (auto _ : state) {
+    std::string_view k = keys[i++ % KEYS];
+    if constexpr (std::is_same_v<Q, plain>) {
+      benchmark::DoNotOptimize(q.find(std::string(k)));
+    } else {
+      benchmark::DoNotOptimize(q.find(k));
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.counters["allocations_per_lookup"] = benchmark::Counter(
+      allocations - before, benchmark::Counter::kAvgIterations);
+}
+} // namespace
+
+int main(int argc, char** argv) {
+  benchmark::RegisterBenchmark("find/kvpq<string,u64>", find<plain>);
+  benchmark::RegisterBenchmark("find/kvpq<string,u64,transparent>",
+                               find<transparent>);
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) { return 1; }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+}
@@ -0,0 +1,31 @@
+// Bytes per element of kvpq<int, std::string> by max_load_factor
+#include <cstdio>
+#include <string>
+
+#include "kvpq.hpp"
+
+using IntStringKvpq = ds::kvpq<int, std::string>;
+
+void report(const IntStringKvpq& p, const char* when) {
+  double table = p.capacity() * IntStringKvpq::bucket_bytes();
+  double heap = p.heap_capacity() * IntStringKvpq::heap_slot_bytes();
+  std::printf("  %-8s %8zu %10zu %10zu %10.1f %10.1f %10.1f\n", when, p.size(),
+              p.capacity(), p.heap_capacity(), table / p.size(),
+              heap / p.size(), (table + heap) / p.size());
+}
+
+int main() {
+  for (float lf : {0.2f, 1.f, 5.f}) {
+    std::printf("max_load_factor %g\n  %-8s %8s %10s %10s %10s %10s %10s\n",
+                lf, "", "size", "buckets", "heap", "table B/e", "heap B/e",
+                "B/e");
+    for (int n : {1000, 10000, 100000, 1000000}) {
+      IntStringKvpq p;
+      p.max_load_factor(lf);
+      for (int i = 0; i < n; ++i) { p.insert({i, std::string()}); }
+      report(p, "grown");
+      p.shrink_to_fit();
+      report(p, "shrunk");
+    }
+  }
+}
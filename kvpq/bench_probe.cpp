@@ -0,0 +1,52 @@
+// Probe lengths of successful finds by max_load_factor
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "kvpq.hpp"
+
+using Kvpq = ds::kvpq<std::uint64_t, std::uint64_t>;
+
+void report(const Kvpq& p, const char* when) {
+  std::vector<Kvpq::size_type> hist = p.probe_histogram();
+  double mean = 0, var = 0;
+  for (std::size_t d = 0; d < hist.size(); ++d) { mean += d * hist[d]; }
+  mean /= p.size();
+  for (std::size_t d = 0; d < hist.size(); ++d) {
+    var += (d - mean) * (d - mean) * hist[d];
+  }
+  var /= p.size();
+  std::size_t p99 = 0;
+  for (std::size_t seen = hist[0]; seen < p.size() * .99;
+       seen += hist[++p99]) {}
+  // Probe lengths are one more than distances from the home bucket
+  std::printf("  %-7s %9zu %9zu %7.3f %7.2f %8.2f %5zu %5zu\n", when, p.size(),
+              p.capacity(), double(p.size()) / p.capacity(), mean + 1, var,
+              p99 + 1, hist.size());
+}
+
+// Fills a table of 2^21 buckets to its capacity at each max_load_factor
+int main(int argc, char** argv) {
+  std::size_t buckets = argc > 1 ? std::stoul(argv[1]) : 1 << 21;
+  for (float lf : {1.f, 5.f, 10.f, 20.f}) {
+    std::printf("max_load_factor %g\n  %-7s %9s %9s %7s %7s %8s %5s %5s\n", lf,
+                "", "size", "buckets", "full", "mean", "var", "p99", "max");
+    std::size_t n = (1. - 1. / std::sqrt(lf * 2. + 1.)) * buckets - 1;
+    std::mt19937_64 gen(1);
+    std::vector<std::uint64_t> keys(n);
+    Kvpq p(buckets);
+    p.max_load_factor(lf);
+    for (auto& k : keys) { p.insert({k = gen(), 0}); }
+    report(p, "filled");
+    // Replace every key once, in random order
+    for (std::size_t i = 0; i < n; ++i) {
+      std::uint64_t& k = keys[gen() % n];
+      p.erase(k);
+      p.insert({k = gen(), 0});
+    }
+    report(p, "churned");
+  }
+}
@@ -0,0 +1,132 @@
+// Throughput of one kvpq behind a mutex against sharded_kvpq, from 1 to 64
+// threads sharing a queue
+#include <benchmark/benchmark.h>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+
+#include "bench.hpp"
+#include "sharded_kvpq.hpp"
+
+using bench::mix;
+using std::uint64_t;
+
+namespace {
+// Entries in the queue when the threads start, half of the key universe
+constexpr uint64_t KEYS = 1 << 20;
+
+// The usual way to share a kvpq
+class locked_kvpq {
+ public:
+  bool insert(std::pair<uint64_t, uint64_t> p) {
+    std::lock_guard<std::mutex> lock(m_);
+    return q_.insert(p).second;
+  }
+  std::size_t erase(uint64_t k) {
+    std::lock_guard<std::mutex> lock(m_);
+    return q_.erase(k);
+  }
+  std::optional<uint64_t> find(uint64_t k) const {
+    std::lock_guard<std::mutex> lock(m_);
+    if (auto it = q_.find(k); it != q_.end()) { return it->second; }
+    return std::nullopt;
+  }
+  std::optional<std::pair<uint64_t, uint64_t>> try_pop() {
+    std::lock_guard<std::mutex> lock(m_);
+    if (q_.empty()) { return std::nullopt; }
+    auto p = q_.top();
+    q_.pop();
+    return p;
+  }
+
+ private:
+  mutable std::mutex m_;
+  ds::kvpq<uint64_t, uint64_t> q_;
+};
+
+using sharded = ds::sharded_kvpq<uint64_t, uint64_t>;
+
+// xorshift64, seeded per thread
+struct generator {
+  explicit generator(uint64_t seed) : state(mix(seed) | 1) {}
+  uint64_t operator()() {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+  }
+  uint64_t state;
+};
+
+// A key of the universe, which the queue holds about half of
+uint64_t key(generator& gen) { return mix(gen() % (2 * KEYS)); }
+
+// Runs op(q, gen, i) on a queue of KEYS entries that the threads share
+template <typename Q, typename OP>
+void shared(benchmark::State& state, OP op) {
+  static Q* q;
+  if (state.thread_index() == 0) {
+    q = new Q;
+    for (uint64_t r = 0; r < 2 * KEYS; r += 2) { q->insert({mix(r), r}); }
+  }
+  generator gen(state.thread_index() + 1);
+  uint64_t i = 0;
+  for (auto _ : state) { op(*q, gen, i++); }
+  state.SetItemsProcessed(state.iterations());
+  if (state.thread_index() == 0) { delete q; }
+}
+
+template <typename Q> void find(benchmark::State& state) {
+  shared<Q>(state, [](Q& q, generator& gen, uint64_t) {
+    benchmark::DoNotOptimize(q.find(key(gen)));
+  });
+}
+
+// 80% find, 10% insert, 10% erase
+template <typename Q> void mixed(benchmark::State& state) {
+  shared<Q>(state, [](Q& q, generator& gen, uint64_t) {
+    uint64_t r = gen();
+    uint64_t k = mix(r % (2 * KEYS));
+    switch (r >> 60) {
+    case 0:
+    case 1: benchmark::DoNotOptimize(q.insert({k, r})); break;
+    case 2:
+    case 3: benchmark::DoNotOptimize(q.erase(k)); break;
+    default: benchmark::DoNotOptimize(q.find(k));
+    }
+  });
+}
+
+// Each pop is followed by an insert, as when a dispatcher takes the most
+// urgent task and schedules another
+template <typename Q> void pop_push(benchmark::State& state) {
+  shared<Q>(state, [](Q& q, generator& gen, uint64_t) {
+    benchmark::DoNotOptimize(q.try_pop());
+    q.insert({key(gen), 0});
+  });
+}
+
+void register_op(const std::string& op, const std::string& queue,
+                 void (*fn)(benchmark::State&)) {
+  benchmark::RegisterBenchmark((op + "/" + queue).c_str(), fn)
+      ->ThreadRange(1, 64)
+      ->UseRealTime();
+}
+
+template <typename Q> void register_queue(const std::string& queue) {
+  register_op("find", queue, find<Q>);
+  register_op("mixed", queue, mixed<Q>);
+  register_op("pop_push", queue, pop_push<Q>);
+}
+} // namespace
+
+int main(int argc, char** argv) {
+  register_queue<locked_kvpq>("locked_kvpq");
+  register_queue<sharded>("sharded_kvpq");
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) { return 1; }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+}
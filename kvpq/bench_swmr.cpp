@@ -0,0 +1,123 @@
+// Lookups from 1 to 64 reader threads while one writer pops and pushes, on
+// swmr_kvpq and on a kvpq behind a readers-writer lock
+#include <benchmark/benchmark.h>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "bench.hpp"
+#include "swmr_kvpq.hpp"
+
+using bench::mix;
+using std::uint64_t;
+
+namespace {
+// Entries in the queue, half of the key universe
+constexpr uint64_t KEYS = 1 << 20;
+
+// The usual way to share a kvpq between readers
+class rw_locked_kvpq {
+ public:
+  bool insert(std::pair<uint64_t, uint64_t> p) {
+    std::unique_lock<std::shared_mutex> lock(m_);
+    return q_.insert(p).second;
+  }
+  std::optional<std::pair<uint64_t, uint64_t>> pop() {
+    std::unique_lock<std::shared_mutex> lock(m_);
+    if (q_.empty()) { return std::nullopt; }
+    auto p = q_.top();
+    q_.pop();
+    return p;
+  }
+  std::optional<uint64_t> find(uint64_t k) const {
+    std::shared_lock<std::shared_mutex> lock(m_);
+    if (auto it = q_.find(k); it != q_.end()) { return it->second; }
+    return std::nullopt;
+  }
+
+ private:
+  mutable std::shared_mutex m_;
+  ds::kvpq<uint64_t, uint64_t> q_;
+};
+
+using swmr = ds::swmr_kvpq<uint64_t, uint64_t>;
+
+// xorshift64, seeded per thread
+struct generator {
+  explicit generator(uint64_t seed) : state(mix(seed) | 1) {}
+  uint64_t operator()() {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+  }
+  uint64_t state;
+};
+
+// The benchmark threads find keys in a queue of KEYS entries. If BUSY, a
+// writer thread meanwhile pops the top and pushes a random key, as fast as it
+// can, and its rate is reported as writes_per_second.
+template <typename Q, bool BUSY> void find(benchmark::State& state) {
+  static Q* q;
+  static std::thread* writer;
+  static std::atomic<bool> stop;
+  static std::atomic<uint64_t> writes;
+  if (state.thread_index() == 0) {
+    q = new Q;
+    for (uint64_t r = 0; r < 2 * KEYS; r += 2) { q->insert({mix(r), r}); }
+    stop = false;
+    writes = 0;
+    if (BUSY) {
+      writer = new std::thread([] {
+        generator gen(0);
+        uint64_t n = 0;
+        for (; !stop.load(std::memory_order_relaxed); ++n) {
+          q->pop();
+          q->insert({mix(gen() % (2 * KEYS)), 0});
+        }
+        writes = n;
+      });
+    }
+  }
+  generator gen(state.thread_index() + 1);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(q->find(mix(gen() % (2 * KEYS))));
+  }
+  state.SetItemsProcessed(state.iterations());
+  if (state.thread_index() == 0) {
+    if (BUSY) {
+      stop = true;
+      writer->join();
+      delete writer;
+      state.counters["writes_per_second"] =
+          benchmark::Counter(writes, benchmark::Counter::kIsRate);
+    }
+    delete q;
+  }
+}
+
+template <typename Q> void register_queue(const std::string& queue) {
+  using benchmark_fn = void (*)(benchmark::State&);
+  for (auto [op, fn] :
+       {std::pair<const char*, benchmark_fn>{"find", find<Q, false>},
+        {"find_busy_writer", find<Q, true>}}) {
+    benchmark::RegisterBenchmark((std::string(op) + "/" + queue).c_str(), fn)
+        ->ThreadRange(1, 64)
+        ->UseRealTime();
+  }
+}
+} // namespace
+
+int main(int argc, char** argv) {
+  register_queue<rw_locked_kvpq>("rw_locked_kvpq");
+  register_queue<swmr>("swmr_kvpq");
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) { return 1; }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+}
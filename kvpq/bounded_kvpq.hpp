@@ -0,0 +1,112 @@
+// A kvpq that holds a bounded number of entries
+#pragma once
+
+#include <cstddef>    // size_t
+#include <functional> // equal_to, hash, less
+#include <optional>   // nullopt, optional
+#include <utility>    // forward, move, pair
+
+#include "kvpq.hpp"
+
+namespace ds {
+
+// A cache of the max_size() entries of highest priority. Consumers take the
+// top while a full queue makes room for new entries by evicting the bottom,
+// and both ends are kept in one kvpq with a minmax_heap rather than in two
+// queues that duplicate every key. Each operation takes O(log n).
+template <typename K, typename V, typename H, typename EQ, typename C,
+          typename PR, typename A>
+class bounded_kvpq {
+ public:
+  using kvpq_type = kvpq<K, V, H, EQ, C, 2, PR, A, no_stats, minmax_heap>;
+  using key_type = K;
+  using mapped_type = V;
+  using value_type = std::pair<K, V>;
+  using size_type = std::size_t;
+  using hasher = H;
+  using key_equal = EQ;
+  using value_compare = C;
+  using allocator_type = A;
+  using iterator = typename kvpq_type::iterator;
+  using const_iterator = typename kvpq_type::const_iterator;
+
+  // The arrays for max_size entries are allocated here, so the queue never
+  // grows afterwards
+  explicit bounded_kvpq(size_type max_size, const H& hash = H(),
+                        const EQ& key_equal = EQ(), const C& comp = C(),
+                        const A& alloc = A())
+      : q_(kvpq_type::DEFAULT_BUCKET_COUNT, hash, key_equal, comp, alloc),
+        max_size_(max_size) {
+    q_.reserve(max_size + 1);
+  }
+
+  // Iterators
+  iterator begin() noexcept { return q_.begin(); }
+  const_iterator begin() const noexcept { return q_.begin(); }
+  iterator end() noexcept { return q_.end(); }
+  const_iterator end() const noexcept { return q_.end(); }
+
+  // Modifiers
+  // These add an entry unless its key is present. A queue that then holds
+  // more than max_size() entries evicts the one of lowest priority, which may
+  // be the new one, and returns it.
+  std::optional<value_type> push(const value_type& p) { return emplace(p); }
+  std::optional<value_type> push(value_type&& p) {
+    return emplace(std::move(p));
+  }
+  template <typename... ARGS>
+  std::optional<value_type> emplace(ARGS&&... args) {
+    if (!q_.emplace(std::forward<ARGS>(args)...).second) {
+      return std::nullopt;
+    }
+    return evict();
+  }
+  // As above, but an entry with key k is given the value v instead
+  template <typename M>
+  std::optional<value_type> insert_or_assign(const K& k, M&& v) {
+    if (!q_.insert_or_assign(k, std::forward<M>(v)).second) {
+      return std::nullopt;
+    }
+    return evict();
+  }
+  void pop() { q_.pop(); }
+  void pop_bottom() { q_.pop_bottom(); }
+  iterator erase(const_iterator pos) { return q_.erase(pos); }
+  size_type erase(const K& k) { return q_.erase(k); }
+  // As kvpq::update, which leaves the size as it is
+  std::pair<iterator, bool> update(const K& old, K k) {
+    return q_.update(old, std::move(k));
+  }
+  void clear() noexcept { q_.clear(); }
+
+  // Lookup
+  value_type& top() { return q_.top(); }
+  const value_type& top() const { return q_.top(); }
+  value_type& bottom() { return q_.bottom(); }
+  const value_type& bottom() const { return q_.bottom(); }
+  iterator find(const K& k) { return q_.find(k); }
+  const_iterator find(const K& k) const { return q_.find(k); }
+  bool contains(const K& k) const { return q_.contains(k); }
+  V& at(const K& k) { return q_.at(k); }
+  const V& at(const K& k) const { return q_.at(k); }
+
+  // Capacity
+  [[nodiscard]] bool empty() const noexcept { return q_.empty(); }
+  size_type size() const noexcept { return q_.size(); }
+  size_type max_size() const noexcept { return max_size_; }
+
+  // Observers
+  const kvpq_type& queue() const noexcept { return q_; }
+
+ private:
+  // Removes and returns the bottom once the queue is over its bound
+  std::optional<value_type> evict() {
+    if (q_.size() <= max_size_) { return std::nullopt; }
+    return q_.extract_bottom();
+  }
+
+  kvpq_type q_;
+  size_type max_size_;
+};
+
+} // namespace ds
@@ -0,0 +1,87 @@
+// An allocator that backs large blocks with huge pages
+#pragma once
+
+#include <cstddef>     // max_align_t, size_t
+#include <cstdint>     // uintptr_t
+#include <cstring>     // memset
+#include <new>         // align_val_t, bad_alloc
+#include <type_traits> // true_type
+
+#include <sys/mman.h> // madvise, mmap, munmap
+
+namespace ds {
+
+// Blocks of at least HUGE_PAGE bytes are mapped on their own: from the
+// reserved huge page pool (MAP_HUGETLB) if it has room, and otherwise as
+// anonymous memory aligned to HUGE_PAGE and marked MADV_HUGEPAGE, so that the
+// kernel can back it with transparent huge pages. One TLB entry then covers
+// HUGE_PAGE bytes instead of a 4KiB page. Smaller blocks come from operator
+// new. All memory is zeroed.
+template <typename T> class huge_page_allocator {
+ public:
+  using value_type = T;
+  using is_always_equal = std::true_type;
+  using is_zeroed = std::true_type;
+  inline static constexpr std::size_t HUGE_PAGE = std::size_t(2) << 20;
+
+  huge_page_allocator() noexcept = default;
+  template <typename U>
+  huge_page_allocator(const huge_page_allocator<U>&) noexcept {}
+
+  [[nodiscard]] T* allocate(std::size_t n) {
+    if (std::size_t bytes = n * sizeof(T); bytes < HUGE_PAGE) {
+      void* p = operator new(bytes, std::align_val_t(ALIGN));
+      return static_cast<T*>(std::memset(p, 0, bytes));
+    }
+    std::size_t bytes = mapped(n);
+#ifdef MAP_HUGETLB
+    if (void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        p != MAP_FAILED) {
+      return static_cast<T*>(p);
+    }
+#endif
+    // Map a huge page more than needed and unmap the ends around an aligned
+    // region
+    void* p = mmap(nullptr, bytes + HUGE_PAGE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) { throw std::bad_alloc(); }
+    char* begin = static_cast<char*>(p);
+    char* aligned = reinterpret_cast<char*>(
+        (reinterpret_cast<std::uintptr_t>(begin) + HUGE_PAGE - 1) &
+        ~(HUGE_PAGE - 1));
+    if (aligned != begin) { munmap(begin, aligned - begin); }
+    munmap(aligned + bytes, begin + HUGE_PAGE - aligned);
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, bytes, MADV_HUGEPAGE);
+#endif
+    return reinterpret_cast<T*>(aligned);
+  }
+  void deallocate(T* p, std::size_t n) noexcept {
+    if (n * sizeof(T) < HUGE_PAGE) {
+      operator delete(p, std::align_val_t(ALIGN));
+    } else {
+      munmap(p, mapped(n));
+    }
+  }
+
+  template <typename U>
+  bool operator==(const huge_page_allocator<U>&) const noexcept {
+    return true;
+  }
+  template <typename U>
+  bool operator!=(const huge_page_allocator<U>&) const noexcept {
+    return false;
+  }
+
+ private:
+  inline static constexpr std::size_t ALIGN =
+      alignof(T) > alignof(std::max_align_t) ? alignof(T)
+                                             : alignof(std::max_align_t);
+  // Mappings are whole huge pages
+  [[nodiscard]] static std::size_t mapped(std::size_t n) {
+    return (n * sizeof(T) + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+  }
+};
+
+} // namespace ds
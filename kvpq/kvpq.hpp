@@ -1,21 +1,41 @@
 // A combination of an unordered map and a priority queue
 #pragma once
 
+#include <algorithm> // fill, max, min, partial_sort, pop_heap, push_heap
+#include <array>            // array
+#include <bit>              // bit_width
 #include <cassert>          // assert
+#include <chrono>           // nanoseconds, steady_clock
 #include <cmath>            // ceil, pow, sqrt
-#include <cstddef>          // ptrdiff_t, size_t
+#include <cstddef>          // offsetof, ptrdiff_t, size_t
+#include <cstdint> // int32_t, intptr_t, uint8_t, uint32_t, uint64_t, uintptr_t
+#include <cstdlib>          // calloc, free
+#include <cstring>          // memcmp, memcpy, memset
+#include <filesystem>       // path, remove, rename
 #include <functional>       // equal_to, hash, less
 #include <initializer_list> // initializer_list
-#include <iterator>         // iterator_traits, random_access_iterator_tag
-#include <memory>           // unique_ptr
-#include <stdexcept>        // out_of_range
-#include <type_traits>      // is_base_of_v, remove_const_t
+#include <iterator>         // iterator_traits, make_move_iterator
+#include <limits>           // numeric_limits
+#include <memory> // allocator_traits, pointer_traits, to_address, unique_ptr
+#include <new>              // align_val_t
+#include <numeric>          // iota
+#include <span>             // span
+#include <stdexcept>        // length_error, out_of_range, runtime_error
+#include <system_error>     // error_code
+#include <type_traits> // conditional_t, decay_t, enable_if_t, invoke_result_t,
+                       // is_*_v
 #include <utility> // forward, make_pair, move, pair, piecewise_construct, swap
 #include <variant> // monostate
+#include <vector>  // vector
+
+#ifdef __SSE2__
+#include <emmintrin.h> // _mm_cmpeq_epi8, _mm_loadu_si128, _mm_movemask_epi8
+#endif
 
 #include "../intrusive/pair.hpp" // pair
 
 #include "kvpq_fwd.hpp"
+#include "mapped_file.hpp"
 
 namespace ds {
 using std::forward;
@@ -28,11 +48,15 @@ template <typename KVPQ> struct kvpq_const_iterator {
   using value_type = const typename KVPQ::value_type;
   using pointer = value_type*;
   using reference = value_type&;
-  using iterator_category = std::random_access_iterator_tag;
+  // Those of a lazy_erase queue step over dead heap entries, so their
+  // arithmetic takes time linear in the distance
+  using iterator_category =
+      std::conditional_t<KVPQ::LAZY, std::bidirectional_iterator_tag,
+                         std::random_access_iterator_tag>;
 
   kvpq_const_iterator() = delete;
-  explicit kvpq_const_iterator(const typename KVPQ::heap_type* elt)
-      : elt_(elt) {}
+  kvpq_const_iterator(const KVPQ* q, const typename KVPQ::heap_type* elt)
+      : q_(q), elt_(elt) {}
 
   bool operator==(const ci& o) const { return elt_ == o.elt_; }
   bool operator!=(const ci& o) const { return elt_ != o.elt_; }
@@ -41,41 +65,72 @@ template <typename KVPQ> struct kvpq_const_iterator {
   bool operator>(const ci& o) const { return elt_ > o.elt_; }
   bool operator>=(const ci& o) const { return elt_ >= o.elt_; }
 
-  reference operator*() const { return elt_->other()->get(); }
-  const auto& operator-> () const { return *elt_->other(); }
+  reference operator*() const { return q_->table_of(*elt_).get(); }
+  const auto& operator-> () const { return q_->table_of(*elt_); }
   reference operator[](size_type n) const { return *(*this + n); }
 
   ci& operator++() {
     ++elt_;
+    skip_dead();
     return *this;
   }
   ci& operator++(int) {
     elt_++;
+    skip_dead();
     return *this;
   }
   ci& operator--() {
     --elt_;
+    skip_dead_back();
     return *this;
   }
   ci& operator--(int) {
     elt_--;
+    skip_dead_back();
     return *this;
   }
   ci& operator+=(difference_type n) {
-    elt_ += n;
-    return *this;
-  }
-  ci& operator-=(difference_type n) {
-    elt_ -= n;
+    if constexpr (KVPQ::LAZY) {
+      for (; n > 0; --n) { ++*this; }
+      for (; n < 0; ++n) { --*this; }
+    } else {
+      elt_ += n;
+    }
     return *this;
   }
-  ci operator+(difference_type n) const { return ci(elt_ + n); }
+  ci& operator-=(difference_type n) { return *this += -n; }
+  ci operator+(difference_type n) const { return ci(*this) += n; }
   friend ci operator+(difference_type n, const ci& it) { return it + n; }
-  ci operator-(difference_type n) const { return ci(elt_ - n); }
-  difference_type operator-(const ci& it) const { return elt_ - it.elt_; }
+  ci operator-(difference_type n) const { return ci(*this) -= n; }
+  difference_type operator-(const ci& it) const {
+    if constexpr (KVPQ::LAZY) {
+      // The live entries between them
+      const auto* lo = std::min(elt_, it.elt_);
+      const auto* hi = std::max(elt_, it.elt_);
+      difference_type n = 0;
+      for (; lo != hi; ++lo) { n += !KVPQ::dead(*lo); }
+      return elt_ < it.elt_ ? -n : n;
+    }
+    return elt_ - it.elt_;
+  }
 
  protected:
+  friend KVPQ;
+  const KVPQ* q_;
   const typename KVPQ::heap_type* elt_;
+
+ private:
+  void skip_dead() {
+    if constexpr (KVPQ::LAZY) {
+      elt_ = q_->heap_ + q_->next_live(elt_ - q_->heap_);
+    }
+  }
+  // The top is never dead
+  void skip_dead_back() {
+    if constexpr (KVPQ::LAZY) {
+      while (KVPQ::dead(*elt_)) { --elt_; }
+    }
+  }
 };
 
 template <typename KVPQ> struct kvpq_iterator : kvpq_const_iterator<KVPQ> {
@@ -86,15 +141,16 @@ template <typename KVPQ> struct kvpq_iterator : kvpq_const_iterator<KVPQ> {
   using value_type = std::remove_const_t<typename const_iterator::value_type>;
   using pointer = value_type*;
   using reference = value_type&;
-  using iterator_category = std::random_access_iterator_tag;
+  using iterator_category = typename const_iterator::iterator_category;
 
-  explicit kvpq_iterator(typename KVPQ::heap_type* elt) : const_iterator(elt) {}
+  kvpq_iterator(const KVPQ* q, typename KVPQ::heap_type* elt)
+      : const_iterator(q, elt) {}
   operator const_iterator&() { return *this; }
   operator const const_iterator&() const { return *this; }
 
-  reference operator*() { return elt()->other()->get(); }
-  auto& operator-> () { return *elt()->other(); }
-  reference operator[](size_type n) { return *(*this + n); }
+  reference operator*() const { return this->q_->table_of(*elt()).get(); }
+  auto& operator-> () const { return this->q_->table_of(*elt()); }
+  reference operator[](size_type n) const { return *(*this + n); }
 
   i& operator++() {
     ++ci();
@@ -124,7 +180,7 @@ template <typename KVPQ> struct kvpq_iterator : kvpq_const_iterator<KVPQ> {
   friend i operator+(difference_type n, const i& it) { return it + n; }
   i operator-(difference_type n) const { return i(ci() - n); }
   difference_type operator-(const const_iterator& it) const {
-    return ci() - it.ci();
+    return ci() - it;
   }
 
  private:
@@ -139,10 +195,202 @@ template <typename KVPQ> struct kvpq_iterator : kvpq_const_iterator<KVPQ> {
   friend KVPQ;
 }; // namespace ds
 
-template <typename K, typename V, typename H, typename EQ, typename C>
+// A PRIORITY policy that caches a copy of each key in its heap entry
+struct inline_key {
+  template <typename K> const K& operator()(const K& k) const { return k; }
+};
+
+// A STATS policy that records nothing. A STATS policy is told the work of
+// each operation through these members, which kvpq only calls, and only reads
+// the clock for, when STATS is not no_stats.
+struct no_stats {
+  // The probe steps of a lookup (find, at, contains, erase by key and the
+  // like) or of an insertion: the home bucket, then each group of control
+  // bytes read from either table
+  void find(std::size_t /* probes */) noexcept {}
+  void emplace(std::size_t /* probes */) noexcept {}
+  // The work of a push, or of refilling the top when it was popped: in a
+  // dary_heap or minmax_heap the levels an entry rose or sank, in a
+  // radix_heap the entries
+  // moved between buckets and in a pairing_heap the trees melded
+  void push(std::size_t /* levels */) noexcept {}
+  void pop(std::size_t /* levels */) noexcept {}
+  // The table entries shifted back into the slot of an erased or popped entry
+  void erase(std::size_t /* shifts */) noexcept {}
+  // The time taken to reallocate the table or the heap. Moving the old table's
+  // entries is spread over later operations and not included.
+  void resize(std::chrono::nanoseconds) noexcept {}
+};
+
+// Counts of recorded values by powers of two: counts[0] is the number of
+// zeros and counts[i] the number in [2^(i-1), 2^i)
+struct kvpq_histogram {
+  std::array<std::uint64_t, 65> counts{};
+  std::uint64_t sum = 0;
+
+  void record(std::uint64_t x) noexcept {
+    ++counts[std::bit_width(x)];
+    sum += x;
+  }
+  [[nodiscard]] std::uint64_t count() const noexcept {
+    std::uint64_t n = 0;
+    for (std::uint64_t c : counts) { n += c; }
+    return n;
+  }
+};
+
+// A STATS policy that keeps a histogram of each measure for a metrics
+// exporter to read through kvpq::stats(). Lookups record too, so threads must
+// not call const members of a queue with kvpq_stats at the same time.
+struct kvpq_stats {
+  kvpq_histogram find_probes;
+  kvpq_histogram emplace_probes;
+  kvpq_histogram push_levels;
+  kvpq_histogram pop_levels;
+  kvpq_histogram erase_shifts;
+  // In nanoseconds; resize_ns.count() is the number of resizes
+  kvpq_histogram resize_ns;
+
+  void find(std::size_t probes) noexcept { find_probes.record(probes); }
+  void emplace(std::size_t probes) noexcept { emplace_probes.record(probes); }
+  void push(std::size_t levels) noexcept { push_levels.record(levels); }
+  void pop(std::size_t levels) noexcept { pop_levels.record(levels); }
+  void erase(std::size_t shifts) noexcept { erase_shifts.record(shifts); }
+  void resize(std::chrono::nanoseconds t) noexcept {
+    resize_ns.record(t.count());
+  }
+};
+
+// HEAP policies. Each keeps the entry of highest priority first in the heap
+// array and orders the rest in its own way.
+// An implicit heap in which the ARITY children of entry i follow entry
+// ARITY * i. Pushes and pops take O(log n) comparisons.
+struct dary_heap {};
+// A radix heap for integral keys compared by std::less or std::greater, after
+// Ahuja, Mehlhorn, Orlin and Tarjan. Keys are kept in 65 buckets by the
+// highest bit in which they differ from the last key to reach the top, as
+// contiguous runs of the heap array, and a pop only sorts the lowest run into
+// the runs below it. A key moves down at most 64 times, so pops take O(1)
+// amortized moves and pushes one move per nonempty bucket below the key's.
+// The bounds hold while the queue is monotone: no key pushed, or given by
+// update, goes before the last one to reach the top. A key that does is
+// placed in O(1) by merging the buckets below it, whose keys then have
+// further to move down.
+struct radix_heap {};
+// A pairing heap, after Fredman, Sedgewick, Sleator and Tarjan, whose entries
+// link to their first child, their siblings and their parent. Pushing and
+// raising a priority are O(1); pops, erasures and lowering a priority take
+// O(log n) amortized melds.
+struct pairing_heap {};
+// A binary min-max heap, after Atkinson, Sack, Santoro and Strothotte, whose
+// levels alternate between entries that outrank their descendants, starting
+// at the top, and entries that their descendants outrank. The entry of lowest
+// priority is then a child of the top, so the kvpq also has bottom() and
+// pop_bottom(). Every operation takes O(log n) comparisons. ARITY must be 2.
+struct minmax_heap {};
+
+// ERASE policies
+// Erasing an entry removes it from the table and the heap at once
+struct eager_erase {};
+// Erasing an entry other than the top removes it from the table and leaves
+// its heap entry where it is, marked dead, so no heap entry moves. Dead
+// entries are dropped as they reach the top, and the heap is rebuilt without
+// them in O(n) once they outnumber the live ones. This suits queues that
+// erase most entries before they reach the top, such as timers that are
+// cancelled. Dead entries are ordered by their cached keys, so HEAP must be
+// dary_heap and PRIORITY inline_key, and iterators step over them, so they
+// are bidirectional.
+struct lazy_erase {};
+
+template <typename K, typename PR> struct kvpq_priority {
+  using type = std::decay_t<std::invoke_result_t<const PR&, const K&>>;
+};
+template <typename K> struct kvpq_priority<K, void> {
+  using type = std::monostate;
+};
+
+// Whether an allocator promises zeroed memory by defining is_zeroed as
+// std::true_type
+template <typename A, typename = void>
+struct allocator_is_zeroed : std::false_type {};
+template <typename A>
+struct allocator_is_zeroed<A, std::void_t<typename A::is_zeroed>>
+    : A::is_zeroed {};
+
+// Whether lookups may take a KEY other than the key type, which they may if
+// the hasher and key_equal both define is_transparent. They must then hash
+// and compare a KEY as they would the key it equals.
+template <typename H, typename EQ, typename KEY, typename = void>
+struct kvpq_is_transparent : std::false_type {};
+template <typename H, typename EQ, typename KEY>
+struct kvpq_is_transparent<
+    H, EQ, KEY,
+    std::void_t<typename H::is_transparent, typename EQ::is_transparent>>
+    : std::true_type {};
+
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
 class kvpq {
-  using table_type = intrusive::pair<std::pair<K, V>, std::monostate>;
-  using heap_type = intrusive::pair<std::monostate, std::pair<K, V>>;
+  using priority_type = typename kvpq_priority<K, PR>::type;
+  inline static constexpr bool RADIX = std::is_same_v<HP, radix_heap>;
+  inline static constexpr bool PAIRING = std::is_same_v<HP, pairing_heap>;
+  inline static constexpr bool MINMAX = std::is_same_v<HP, minmax_heap>;
+  inline static constexpr bool DARY = std::is_same_v<HP, dary_heap>;
+  static_assert(DARY || RADIX || PAIRING || MINMAX,
+                "HEAP is dary_heap, radix_heap, pairing_heap or minmax_heap");
+  static_assert(!MINMAX || D == 2, "minmax_heap is binary");
+  inline static constexpr bool LAZY = std::is_same_v<ER, lazy_erase>;
+  static_assert(LAZY || std::is_same_v<ER, eager_erase>,
+                "ERASE is eager_erase or lazy_erase");
+  static_assert(!LAZY || (DARY && std::is_same_v<PR, inline_key> &&
+                          std::is_trivially_copyable_v<K>),
+                "lazy_erase caches trivially copyable keys in a dary_heap");
+  // Radix heaps order keys as unsigned integers, with the top the least
+  inline static constexpr bool MAX_FIRST =
+      std::is_same_v<C, std::less<K>> || std::is_same_v<C, std::less<>>;
+  inline static constexpr bool MIN_FIRST =
+      std::is_same_v<C, std::greater<K>> || std::is_same_v<C, std::greater<>>;
+  static_assert(!RADIX || (std::is_integral_v<K> && sizeof(K) <= 8 &&
+                            (MAX_FIRST || MIN_FIRST)),
+                "radix_heap orders integral keys by std::less or std::greater");
+  // The heap indices of the first child, the next sibling and the previous
+  // sibling, or the parent for a first child, of a pairing heap entry
+  struct pairing_node {
+    inline static constexpr std::uint32_t NONE =
+        std::numeric_limits<std::uint32_t>::max();
+    [[no_unique_address]] priority_type priority;
+    std::uint32_t child = NONE;
+    std::uint32_t next = NONE;
+    std::uint32_t prev = NONE;
+  };
+  using node_type = std::conditional_t<PAIRING, pairing_node, priority_type>;
+  // The buckets of a radix heap: no entry's radix but the top's is less than
+  // last, and each but the top is in bucket radix_bucket(radix), which ends at
+  // heap index end[bucket]
+  struct radix_buckets {
+    std::uint64_t last = 0;
+    std::uint32_t end[65] = {};
+  };
+  using radix_state =
+      std::conditional_t<RADIX, radix_buckets, std::monostate>;
+  // Entries are linked by 32-bit indices, which kvpq maintains: a table entry
+  // holds the index of its heap entry and a heap entry the position of its
+  // table entry (see table_of). With a void PRIORITY a heap entry is just
+  // that index, and more of them share a cache line than pointers would.
+  using table_type =
+      intrusive::pair<std::pair<K, V>, node_type, intrusive::index_link>;
+  using heap_type =
+      intrusive::pair<node_type, std::pair<K, V>, intrusive::index_link>;
+  // Indices are relative to the arrays, so images of trivially copyable
+  // entries work wherever they are mapped
+  inline static constexpr bool MAPPABLE =
+      std::is_trivially_copyable_v<K> && std::is_trivially_copyable_v<V> &&
+      std::is_trivially_copyable_v<node_type>;
+  template <typename KEY>
+  using if_transparent =
+      std::enable_if_t<kvpq_is_transparent<H, EQ, KEY>::value>;
+  inline static constexpr bool RECORDS = !std::is_same_v<S, no_stats>;
 
  public:
   using key_type = K;
@@ -152,7 +400,8 @@ class kvpq {
   using size_type = std::size_t;
   using difference_type = std::ptrdiff_t;
   using hasher = H;
-  using key_equal = K;
+  using key_equal = EQ;
+  using allocator_type = A;
   using reference = value_type&;
   using const_reference = const value_type&;
   using pointer = value_type*;
@@ -166,59 +415,77 @@ class kvpq {
   // (1)
   kvpq() : kvpq(DEFAULT_BUCKET_COUNT) {}
   explicit kvpq(size_type bucket_count, const H& = H(), const EQ& = EQ(),
-                const C& = C());
+                const C& = C(), const A& = A());
+  explicit kvpq(const A& alloc)
+      : kvpq(DEFAULT_BUCKET_COUNT, H(), EQ(), C(), alloc) {}
   // (2)
   template <typename IT>
   kvpq(IT b, IT e, size_type bucket_count = DEFAULT_BUCKET_COUNT,
-       const H& hash = H(), const EQ& key_equal = EQ(), const C& comp = C())
-      : kvpq(bucket_count, hash, key_equal, comp) {
-    if constexpr (std::is_base_of_v<
-                      std::random_access_iterator_tag,
-                      std::iterator_traits<IT>::iterator_category>) {
-      // TODO: do not allocate for bucket_count first in this case
-      reserve(e - b);
-    }
+       const H& hash = H(), const EQ& key_equal = EQ(), const C& comp = C(),
+       const A& alloc = A())
+      : kvpq(initial_bucket_count(b, e, bucket_count), hash, key_equal, comp,
+             alloc) {
     insert(b, e);
   }
 
   // (3)
-  kvpq(const kvpq&);
+  kvpq(const kvpq& o)
+      : kvpq(o, std::allocator_traits<A>::select_on_container_copy_construction(
+                    o.alloc_)) {}
+  kvpq(const kvpq&, const A&);
 
   // (4)
-  kvpq(kvpq&&);
+  kvpq(kvpq&& o) : kvpq(move(o), A(o.alloc_)) {}
+  // Takes o's arrays if alloc can free them and moves its entries otherwise
+  kvpq(kvpq&&, const A& alloc);
 
   // (5)
   explicit kvpq(std::initializer_list<std::pair<K, V>> init,
                 size_type bucket_count = DEFAULT_BUCKET_COUNT,
                 const H& hash = H(), const EQ& key_equal = EQ(),
-                const C& comp = C())
-      : kvpq(std::max(bucket_count, size_type(get_bucket_mask(
-                                        init.size(), DEFAULT_MAX_LOAD_FACTOR)) +
-                                        1),
-             init.size, hash, key_equal, comp) {
-    insert(init);
-  }
+                const C& comp = C(), const A& alloc = A())
+      : kvpq(init.begin(), init.end(), bucket_count, hash, key_equal, comp,
+             alloc) {}
 
   ~kvpq();
 
   kvpq& operator=(const kvpq&);
   kvpq& operator=(kvpq&& o) {
-    ~kvpq();
-    return *(new (this) kvpq(move(o)));
+    A alloc = std::allocator_traits<
+                  A>::propagate_on_container_move_assignment::value
+                  ? o.alloc_
+                  : alloc_;
+    this->~kvpq();
+    return *(new (this) kvpq(move(o), alloc));
   }
 
+  allocator_type get_allocator() const noexcept { return alloc_; }
+
   // Iterators
-  iterator begin() noexcept { return iterator(heap_); }
-  const_iterator begin() const noexcept { return const_iterator(heap_); }
+  iterator begin() noexcept { return iterator(this, heap_); }
+  const_iterator begin() const noexcept { return const_iterator(this, heap_); }
   const_iterator cbegin() const noexcept { return begin(); }
-  iterator end() noexcept { return iterator(heap_ + size_); }
-  const_iterator end() const noexcept { return const_iterator(heap_ + size_); }
+  iterator end() noexcept { return iterator(this, heap_ + size_); }
+  const_iterator end() const noexcept {
+    return const_iterator(this, heap_ + size_);
+  }
   const_iterator cend() const noexcept { return end(); }
 
   // Modifiers
   void push(const std::pair<K, V>& p) { insert(p); }
-  void push(std::pair<K, V>&& p) { insert(p); }
+  void push(std::pair<K, V>&& p) { insert(move(p)); }
   void pop() { erase(begin()); }
+  // Moves the entry of highest priority out and erases it
+  value_type extract_top();
+  // Erases the entry of lowest priority, with a minmax_heap
+  void pop_bottom() { erase(find_bottom()); }
+  // Moves the entry of lowest priority out and erases it, with a minmax_heap
+  value_type extract_bottom();
+  // Moves the n entries of highest priority, or every entry if there are
+  // fewer, to out from the highest down and erases them. Returns the end of
+  // the output. The root of a dary_heap is refilled bottom-up, with about
+  // D - 1 comparisons per level where pop() makes D.
+  template <typename OUT> OUT pop_k(size_type n, OUT out);
   void clear() noexcept;
 
   // insert(1)
@@ -229,8 +496,10 @@ class kvpq {
     return emplace(move(p));
   }
   // insert(2)
-  template <typename P> std::pair<iterator, bool> insert(P&& p) {
-    return emplace(forward(p));
+  template <typename P, typename = std::enable_if_t<
+                            std::is_constructible_v<value_type, P&&>>>
+  std::pair<iterator, bool> insert(P&& p) {
+    return emplace(forward<P>(p));
   }
   // insert(3)
   iterator insert(const_iterator /* hint */, const std::pair<K, V>& p) {
@@ -240,25 +509,41 @@ class kvpq {
     return insert(move(p)).first;
   }
   // insert(4)
-  template <typename P>
-  std::pair<iterator, bool> insert(const_iterator /* hint */, P&& p) {
-    return insert(forward(p)).first;
+  template <typename P, typename = std::enable_if_t<
+                            std::is_constructible_v<value_type, P&&>>>
+  iterator insert(const_iterator /* hint */, P&& p) {
+    return insert(forward<P>(p)).first;
   }
   // insert(5)
-  template <typename IT> void insert(IT b, IT e) {
-    if constexpr (std::is_base_of_v<
-                      std::random_access_iterator_tag,
-                      std::iterator_traits<IT>::iterator_category>) {
-      reserve(size_ + (e - b));
-    }
-    while (b != e) { insert(*b++); }
-  }
+  // Places every entry in the table before restoring the heap, bottom-up
+  // when that is cheaper than sifting each new entry up
+  template <typename IT> void insert(IT b, IT e);
   // insert(6)
   void insert(std::initializer_list<std::pair<K, V>> init) {
-    reserve(size_ + init.size());
     insert(init.begin(), init.end());
   }
 
+  // Replaces the contents with the entries of a range, as insert(5)
+  template <typename IT> void assign(IT b, IT e) {
+    clear();
+    insert(b, e);
+  }
+  void assign(std::initializer_list<std::pair<K, V>> init) {
+    assign(init.begin(), init.end());
+  }
+
+  // The batch operations hash each key and fetch its home bucket a few keys
+  // before resolving it, so the cache misses of consecutive keys overlap
+  // instead of following one another.
+  // Inserts the entries of items as insert(5) and returns how many were new
+  size_type insert_batch(std::span<const value_type> items) {
+    size_type before = size();
+    insert(items.begin(), items.end());
+    return size() - before;
+  }
+  // Erases the entries with the given keys and returns how many there were
+  size_type erase_batch(std::span<const K> keys);
+
   // insert_or_assign(1)
   template <typename M>
   std::pair<iterator, bool> insert_or_assign(const K&, M&&);
@@ -267,133 +552,288 @@ class kvpq {
   // insert_or_assign(3)
   template <typename M>
   iterator insert_or_assign(const_iterator /* hint */, const K& k, M&& v) {
-    return insert_or_assign(k, forward(v)).first;
+    return insert_or_assign(k, forward<M>(v)).first;
   }
   // insert_or_assign(4)
   template <typename M>
   iterator insert_or_assign(const_iterator /* hint */, K&& k, M&& v) {
-    return insert_or_assign(move(k), forward(v)).first;
+    return insert_or_assign(move(k), forward<M>(v)).first;
   }
 
   template <typename... ARGS> std::pair<iterator, bool> emplace(ARGS&&...);
   template <typename... ARGS>
   iterator emplace_hint(const_iterator /* hint */, ARGS&&... args) {
-    return emplace(forward(args)...).first;
+    return emplace(forward<ARGS>(args)...).first;
   }
 
   // try_emplace(1)
   template <typename... ARGS>
   std::pair<iterator, bool> try_emplace(const K& k, ARGS&&... args) {
-    return emplace(std::make_pair(k, V(std::forward(args)...)));
+    return emplace(std::make_pair(k, V(std::forward<ARGS>(args)...)));
   }
   // try_emplace(2)
   template <typename... ARGS>
   std::pair<iterator, bool> try_emplace(K&& k, ARGS&&... args) {
     // TODO: rewrite with perfect forwarding and rebase constructors off this
     // instead of emplace
-    return emplace(std::make_pair(move(k), V(std::forward(args)...)));
+    return emplace(std::make_pair(move(k), V(std::forward<ARGS>(args)...)));
   }
   // try_emplace(3)
   template <typename... ARGS>
   iterator try_emplace(const_iterator /* hint */, const K& k, ARGS&&... args) {
-    return try_emplace(k, forward(args)...).first;
+    return try_emplace(k, forward<ARGS>(args)...).first;
   }
   // try_emplace(4)
   template <typename... ARGS>
   iterator try_emplace(const_iterator /* hint */, K&& k, ARGS&&... args) {
-    return try_emplace(move(k), forward(args)...).first;
+    return try_emplace(move(k), forward<ARGS>(args)...).first;
   }
 
   iterator erase(const_iterator pos);
-  size_type erase(const K&);
+  size_type erase(const K& k) { return erase_key(k); }
+  template <typename KEY, typename = if_transparent<KEY>,
+            typename = std::enable_if_t<
+                !std::is_convertible_v<const KEY&, const_iterator>>>
+  size_type erase(const KEY& k) {
+    return erase_key(k);
+  }
   void swap(kvpq&);
 
+  // The key is the priority, so changing an entry's priority changes its key.
+  // These give the entry at pos the key k: its table entry moves to k's probe
+  // sequence without rebuilding the value and its heap entry is sifted from
+  // where it is. If another entry has key k, nothing changes and the result
+  // points at that entry.
+  std::pair<iterator, bool> update(const_iterator pos, K k) {
+    return rekey(pos, move(k), 0);
+  }
+  // As above for the entry with key old, or {end(), false} if there is none
+  std::pair<iterator, bool> update(const K& old, K k) {
+    if (auto it = find(old); it != end()) { return update(it, move(k)); }
+    return {end(), false};
+  }
+  // As update, for a k that does not compare less than the current key. The
+  // entry is only sifted towards the top.
+  std::pair<iterator, bool> increase_key(const_iterator pos, K k) {
+    assert(!comp_(k, pos->first));
+    return rekey(pos, move(k), 1);
+  }
+  // As update, for a k that does not compare greater than the current key.
+  // The entry is only sifted away from the top.
+  std::pair<iterator, bool> decrease_key(const_iterator pos, K k) {
+    assert(!comp_(pos->first, k));
+    return rekey(pos, move(k), -1);
+  }
+
   // merge(1)
-  template <typename H2, typename P2, typename C2>
-  void merge(const kvpq<K, V, H2, P2, C2>& o) {
-    reserve(size_ + o.size());
+  template <typename H2, typename P2, typename C2, std::size_t D2,
+            typename PR2, typename A2, typename S2, typename HP2,
+            typename ER2>
+  void merge(const kvpq<K, V, H2, P2, C2, D2, PR2, A2, S2, HP2, ER2>& o) {
     insert(o.begin(), o.end());
   }
   // merge(2)
-  template <typename H2, typename P2, typename C2>
-  void merge(kvpq<K, V, H2, P2, C2>&&);
+  template <typename H2, typename P2, typename C2, std::size_t D2,
+            typename PR2, typename A2, typename S2, typename HP2,
+            typename ER2>
+  void merge(kvpq<K, V, H2, P2, C2, D2, PR2, A2, S2, HP2, ER2>&&);
 
   // Lookup
   std::pair<K, V>& top() { return *begin(); }
   const std::pair<K, V>& top() const { return *begin(); }
-  V& at(const K&);
-  const V& at(const K&) const;
+  // The entry of lowest priority and its position, with a minmax_heap
+  std::pair<K, V>& bottom() { return *find_bottom(); }
+  const std::pair<K, V>& bottom() const { return *find_bottom(); }
+  iterator find_bottom() { return iterator(this, heap_ + bottom_index()); }
+  const_iterator find_bottom() const {
+    return const_iterator(this, heap_ + bottom_index());
+  }
+  // Copies the n entries of highest priority, or every entry if there are
+  // fewer, to out from the highest down. Returns the end of the output.
+  template <typename OUT> OUT top_k(size_type n, OUT out) const {
+    best_first(n, [&](size_type j) {
+      *out = table_of(heap_[j]).get();
+      ++out;
+    });
+    return out;
+  }
+  V& at(const K& k) { return at_key(k); }
+  const V& at(const K& k) const { return at_key(k); }
   // TODO: create if not found
   V& operator[](const K& k) { return find(k)->second; }
   V& operator[](K&& k) { return find(k)->second; }
   size_type count(const K& k) const { return contains(k); }
-  iterator find(const K& k) {
-    return iterator(const_cast<const kvpq&>(*this).find(k));
-  }
-  const_iterator find(const K&) const;
+  iterator find(const K& k) { return find_key(k); }
+  const_iterator find(const K& k) const { return find_key(k); }
   bool contains(const K& k) const { return find(k) != end(); }
+  // With a transparent hasher and key_equal, lookups also take any KEY they
+  // accept, such as a std::string_view for std::string keys, without making
+  // a K of it
+  template <typename KEY, typename = if_transparent<KEY>>
+  V& at(const KEY& k) {
+    return at_key(k);
+  }
+  template <typename KEY, typename = if_transparent<KEY>>
+  const V& at(const KEY& k) const {
+    return at_key(k);
+  }
+  template <typename KEY, typename = if_transparent<KEY>>
+  size_type count(const KEY& k) const {
+    return contains(k);
+  }
+  template <typename KEY, typename = if_transparent<KEY>>
+  iterator find(const KEY& k) {
+    return find_key(k);
+  }
+  template <typename KEY, typename = if_transparent<KEY>>
+  const_iterator find(const KEY& k) const {
+    return find_key(k);
+  }
+  template <typename KEY, typename = if_transparent<KEY>>
+  bool contains(const KEY& k) const {
+    return find(k) != end();
+  }
+  // Sets out[i] to find(keys[i]). out must be as long as keys.
+  void find_batch(std::span<const K> keys, std::span<iterator> out) {
+    migrate(migrate_step_ * keys.size());
+    find_batch_into(keys, out);
+  }
+  void find_batch(std::span<const K> keys,
+                  std::span<const_iterator> out) const {
+    find_batch_into(keys, out);
+  }
+
+  // Handles
+  // Each entry is stamped with a 32-bit generation when it is inserted or its
+  // key changes, which the table keeps beside its hash. A handle records the
+  // stamped hash and the table slot the entry was in. Unlike an iterator it
+  // stays usable while the entry moves in the heap or the table. The members
+  // that take one look in the slot first and otherwise probe for the stamped
+  // hash, so they never hash or compare keys. They find nothing once the entry
+  // is erased or rekeyed, even if an entry with the same key is inserted since,
+  // until the generations wrap around.
+  class handle {
+   private:
+    friend kvpq;
+    handle(size_type hash, std::uintptr_t slot) : hash_(hash), slot_(slot) {}
+    size_type hash_;
+    std::uintptr_t slot_;
+  };
+  handle handle_of(const_iterator pos) const;
+  iterator find(const handle& h) {
+    migrate(migrate_step_);
+    return iterator(const_cast<const kvpq&>(*this).find(h));
+  }
+  const_iterator find(const handle& h) const;
+  bool contains(const handle& h) const { return resolve(h); }
+  // As erase(const K&) and update(const K&, K) for the entry of h. The handle
+  // is then stale.
+  size_type erase(const handle& h);
+  std::pair<iterator, bool> update(const handle& h, K k);
 
   // Capacity
   [[nodiscard]] bool empty() const noexcept { return size_ == 0; }
-  size_type size() const noexcept { return size_; }
-  size_type capacity() const noexcept { return bucket_mask_ + 1; }
-  static constexpr size_type max_size() noexcept { return -1; }
+  size_type size() const noexcept { return size_ - dead_; }
+  size_type capacity() const noexcept { return buckets_.mask + 1; }
+  size_type heap_capacity() const noexcept { return heap_capacity_; }
+  // The bytes that each bucket and each heap slot take
+  static constexpr size_type bucket_bytes() noexcept {
+    return sizeof(size_type) + sizeof(std::uint8_t) + sizeof(table_type);
+  }
+  static constexpr size_type heap_slot_bytes() noexcept {
+    return sizeof(heap_type);
+  }
+  // Links are 32-bit even though size_type is not, so this is 2^31 - 1
+  static constexpr size_type max_size() noexcept { return MAX_INDEX; }
   // std::unordered_map has expected number of probes for an unsuccessful search
   // - 1 = bucket_count * load_factor = size. We define load_factor to be the
   // number of probes required for an unsuccessful search - 1 divided by
   // bucket_count instead of size / bucket_count. This maintains the invariant
   // size / bucket_count < 1 even when load_factor() > 1.
-  float load_factor() const { return get_load_factor(size_, bucket_mask_); }
+  float load_factor() const { return get_load_factor(size(), buckets_.mask); }
   float max_load_factor() const { return max_load_factor_; }
   void max_load_factor(float lf) {
-    auto bucket_mask = get_bucket_mask(size_, lf);
-    auto table_capacity = get_table_capacity(lf, bucket_mask);
-    resize(bucket_mask, table_capacity);
     max_load_factor_ = lf;
-    assert(bucket_mask_ == bucket_mask);
-    assert(table_capacity_ >= table_capacity);
-    // TODO: heap_type[] of length at least capacity
-    //       (cache this length as heap_capacity_)
-    // TODO: rename capacity_ -> table_capacity_
-    table_capacity_ = get_table_capacity(max_load_factor_, bucket_mask_);
-  }
-  void rehash(size_type bucket_count) { resize(Mask(bucket_count - 1)); }
+    resize(get_bucket_mask(size(), lf));
+  }
+  void rehash(size_type bucket_count) {
+    resize(Mask(std::max(bucket_count, size_type(2)) - 1));
+  }
   void reserve(size_type count) {
     if (count > table_capacity_) {
       resize(get_bucket_mask(count, max_load_factor_));
     }
+    if (count > heap_capacity_) { reallocate_heap(count); }
+  }
+  // Rehashes to the fewest buckets that hold size() entries at
+  // max_load_factor() and releases unused heap slots, after dropping the dead
+  // entries of a lazy_erase queue
+  void shrink_to_fit() {
+    compact();
+    resize(get_bucket_mask(size_, max_load_factor_));
+    if (heap_capacity_ > size_) { reallocate_heap(size_); }
   }
+  // Growth does not rehash every entry at once: the previous table is kept
+  // alongside the new one and each emplace, find and erase migrates a bounded
+  // number of its buckets, sized so that it is empty before the new table
+  // fills. Returns whether such a migration is in progress.
+  bool rehashing() const noexcept { return migrating(); }
+  // Element d is the number of entries d buckets past their home bucket, so
+  // a successful find for them probes d + 1 buckets
+  std::vector<size_type> probe_histogram() const;
+  // The work recorded by the STATS policy. Copies start with a default STATS
+  // and moves take the source's.
+  const S& stats() const noexcept { return stats_; }
+  S& stats() noexcept { return stats_; }
 
   // Observers
   H hash_function() const { return hash_; }
   EQ key_eq() const { return key_equal_; }
   C comp_function() const { return comp_; }
 
+  // Images
+  // An image is a file holding the arrays of a kvpq of trivially copyable K
+  // and V as they are in memory. open_mapped maps it without reading it, so
+  // a queue of any size opens at once and its pages are read as they are
+  // used. Images open in a kvpq with the same entry layout on a machine with
+  // the same byte order, and H must hash keys as it did when saving.
+  // Writes an image of the queue to path, which may be the image it was
+  // opened from
+  void save(const std::filesystem::path& path) const;
+  // Maps the image at path. Changes go to private copies of its pages and
+  // never to the file. Throws std::runtime_error if path does not hold an
+  // image for this kvpq.
+  static kvpq open_mapped(const std::filesystem::path& path,
+                          const H& hash = H(), const EQ& key_equal = EQ(),
+                          const C& comp = C(), const A& alloc = A());
+
   // Non-member functionspa
+  // Whether both hold the same keys with equal values. As for
+  // std::unordered_map, their hashers and key_equals must agree.
   bool operator==(const kvpq& o) const;
   bool operator!=(const kvpq& o) const { return !(*this == o); }
-  friend void swap(const kvpq& lhs, const kvpq& rhs) { return lhs.swap(rhs); }
+  friend void swap(kvpq& lhs, kvpq& rhs) { lhs.swap(rhs); }
 
  private:
-  [[nodiscard]] inline size_type next(size_type i) const {
-    return (i + 1) & bucket_mask_;
-  }
-  [[nodiscard]] inline bool free(size_type i) const { return !offset_[i]; }
-  [[nodiscard]] inline size_type hash_at(size_type i) const {
-    return offset_[i] + i + 1;
-  }
-  inline void set_hash_at(size_type i, size_type h) { offset_[i] = h - i - 1; }
-  inline void clear_hash_at(size_type i) { set_hash_at(i, next(i)); }
+  // The heap is D-ary: the children of i are child(i) to child(i) + D - 1
+  static_assert(D >= 2);
   [[nodiscard]] static constexpr inline size_type parent(size_type i) {
-    return ((i + 1) >> 1) - 1;
+    return (i - 1) / D;
   }
-  [[nodiscard]] static constexpr inline size_type lchild(size_type i) {
-    return ((i + 1) << 1) - 1;
+  [[nodiscard]] static constexpr inline size_type child(size_type i) {
+    return i * D + 1;
   }
-  [[nodiscard]] static constexpr inline size_type rchild(size_type i) {
-    return (i + 1) << 1;
+  // The number of levels between heap index i and the root
+  [[nodiscard]] static constexpr size_type depth(size_type i) {
+    size_type d = 0;
+    for (; i; i = parent(i)) { ++d; }
+    return d;
   }
 
+  // The most buckets, and heap entries, that 32-bit links reach
+  inline static constexpr size_type MAX_INDEX =
+      std::numeric_limits<std::int32_t>::max();
+
   struct Mask {
     static_assert(sizeof(size_type) == sizeof(unsigned long));
     constexpr explicit Mask(size_type i)
@@ -406,6 +846,144 @@ class kvpq {
     constexpr operator const size_type&() const { return i_; }
     size_type i_;
   };
+  // The control bytes of the WIDTH slots from some slot on, compared at once.
+  // Free slots have control byte 0 and occupied ones 0x80 | a 7-bit fragment
+  // of their hash. Bit masks from match and free have one set bit per
+  // matching slot, and slot(m) is the position of the first.
+  struct group {
+#ifdef __SSE2__
+    inline static constexpr size_type WIDTH = 16;
+    explicit group(const std::uint8_t* p)
+        : v(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))) {}
+    [[nodiscard]] inline unsigned match(std::uint8_t c) const {
+      return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(char(c))));
+    }
+    [[nodiscard]] inline unsigned free() const {
+      return ~unsigned(_mm_movemask_epi8(v)) & 0xffff;
+    }
+    [[nodiscard]] static inline size_type slot(unsigned m) {
+      return __builtin_ctz(m);
+    }
+    __m128i v;
+#else
+    // Eight bytes in a word. match may report slots just after a real match
+    // whose bytes differ from c, which the full hash comparison rejects.
+    inline static constexpr size_type WIDTH = 8;
+    inline static constexpr std::uint64_t LSBS = 0x0101010101010101;
+    inline static constexpr std::uint64_t MSBS = 0x8080808080808080;
+    explicit group(const std::uint8_t* p) {
+      std::memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      v = __builtin_bswap64(v);
+#endif
+    }
+    [[nodiscard]] inline std::uint64_t match(std::uint8_t c) const {
+      std::uint64_t x = v ^ (LSBS * c);
+      return (x - LSBS) & ~x & MSBS;
+    }
+    [[nodiscard]] inline std::uint64_t free() const { return ~v & MSBS; }
+    [[nodiscard]] static inline size_type slot(std::uint64_t m) {
+      return __builtin_ctzll(m) / 8;
+    }
+    std::uint64_t v;
+#endif
+  };
+  [[nodiscard]] static inline std::uint8_t fragment(size_type h) {
+    // The home bucket takes the low bits, so mix the high ones into the
+    // fragment, which also spreads hashes that are identities on small keys
+    return 0x80 | (std::uint64_t(h) * 0x9e3779b97f4a7c15) >> 57;
+  }
+  // One linear-probing table with Robin Hood insertion, so the entries of a
+  // cluster are ordered by home bucket. offset[i] = h - i - 1 for the stamped
+  // hash h of the entry in slot i: the low half of its hash, which holds its
+  // home bucket, and its generation in the high half. An entry can only sit one
+  // slot before its home bucket if the table is full, so this is never 0 for
+  // an occupied slot and 0 marks a free slot. The control bytes follow the
+  // offsets, and the first group::WIDTH - 1 of them are repeated after the
+  // last so that a group can be loaded from any slot. A fragment mixes in the
+  // high half of the hash, which the stamped hash lacks, so it is computed
+  // when an entry is placed and then moves with the entry.
+  struct buckets {
+    Mask mask;
+    size_type* offset;
+    table_type* table;
+    // The position of table[0] from the anchor, in table entries
+    std::uint32_t first = 0;
+
+    [[nodiscard]] inline size_type next(size_type i) const {
+      return (i + 1) & mask;
+    }
+    [[nodiscard]] inline bool free(size_type i) const { return !offset[i]; }
+    [[nodiscard]] inline size_type hash_at(size_type i) const {
+      return offset[i] + i + 1;
+    }
+    // How many buckets past the home bucket of hash h slot i is
+    [[nodiscard]] inline size_type distance(size_type i, size_type h) const {
+      return (i - h) & mask;
+    }
+    inline void set_hash_at(size_type i, size_type h, std::uint8_t c) {
+      offset[i] = h - i - 1;
+      set_ctrl(i, c);
+    }
+    inline void clear_hash_at(size_type i) {
+      offset[i] = 0;
+      set_ctrl(i, 0);
+    }
+    [[nodiscard]] inline std::uint8_t* ctrl() const {
+      return reinterpret_cast<std::uint8_t*>(offset + mask + 1);
+    }
+    inline void set_ctrl(size_type i, std::uint8_t c) {
+      std::uint8_t* g = ctrl();
+      g[i] = c;
+      for (size_type j = i + mask + 1; j < mask + group::WIDTH; j += mask + 1) {
+        g[j] = c;
+      }
+    }
+    // The first free slot from slot i on
+    [[nodiscard]] inline size_type first_free(size_type i) const {
+      for (;; i = (i + group::WIDTH) & mask) {
+        if (auto f = group(ctrl() + i).free()) {
+          return (i + group::slot(f)) & mask;
+        }
+      }
+    }
+    // Empties and returns the slot that Robin Hood insertion gives an entry
+    // with hash h: the first from its home bucket that is free or holds an
+    // entry nearer its own. The entries from there to the next free slot move
+    // one slot on. The caller must set the slot's hash.
+    [[nodiscard]] size_type make_room(size_type h, heap_type* heap) {
+      size_type i = h & mask;
+      while (!free(i) && distance(i, hash_at(i)) >= distance(i, h)) {
+        i = next(i);
+      }
+      if (free(i)) { return i; }
+      for (size_type j = first_free(i), k; j != i; j = k) {
+        k = (j - 1) & mask;
+        new (table + j) table_type(move(table[k]));
+        table[k].~table_type();
+        set_hash_at(j, hash_at(k), ctrl()[k]);
+        relink(j, heap);
+      }
+      return i;
+    }
+    // The entry stamped with h, found by comparing stamped hashes from its
+    // home bucket on, without the key or the full hash
+    [[nodiscard]] const table_type* find_stamped(size_type h) const {
+      for (size_type i = h & mask;
+           !free(i) && distance(i, hash_at(i)) >= distance(i, h); i = next(i)) {
+        if (hash_at(i) == h) { return table + i; }
+      }
+      return nullptr;
+    }
+    // Points the heap entry of the entry in slot i, in heap, back at it
+    inline void relink(size_type i, heap_type* heap) {
+      heap[table[i].index()].set_index(first + std::uint32_t(i));
+    }
+    [[nodiscard]] inline bool owns(const table_type* t) const {
+      return !std::less<const table_type*>()(t, table) &&
+             std::less<const table_type*>()(t, table + mask + 1);
+    }
+  };
   [[nodiscard]] static constexpr inline float
   get_load_factor(size_type size, Mask bucket_mask) {
     // From https://www.cs.tau.ac.il/~zwick/Adv-Alg-2015/Linear-Probing.pdf
@@ -424,80 +1002,604 @@ class kvpq {
                      1)
                : Mask(1);
   }
-  [[nodiscard]] static inline size_type get_table_capacity(float load_factor,
-                                                           Mask bucket_mask) {
+  [[nodiscard]] static inline size_type get_capacity(float load_factor,
+                                                     Mask bucket_mask) {
     return (1. - 1. / std::sqrt(load_factor * 2. + 1.)) *
            (size_type(bucket_mask) + 1);
   }
-  void resize(Mask bucket_mask, size_type heap_capacity);
+  // The allocator hands out whole cache lines. The offsets, control bytes and
+  // table of a bucket array share one block, with the table starting on a
+  // line of its own; the heap grows separately and has a block of its own.
+  inline static constexpr std::size_t CACHE_LINE = 64;
+  struct alignas(CACHE_LINE) line {
+    unsigned char bytes[CACHE_LINE];
+  };
+  using line_traits =
+      typename std::allocator_traits<A>::template rebind_traits<line>;
+  using line_allocator = typename line_traits::allocator_type;
+  static_assert(alignof(table_type) <= CACHE_LINE &&
+                alignof(heap_type) <= CACHE_LINE);
+  [[nodiscard]] static constexpr inline size_type lines(size_type bytes) {
+    return (bytes + CACHE_LINE - 1) / CACHE_LINE;
+  }
+  // Lines before the table, which must start zeroed
+  [[nodiscard]] static constexpr inline size_type
+  table_line(Mask bucket_mask) {
+    return lines((bucket_mask + 1) * sizeof(size_type) + bucket_mask +
+                 group::WIDTH);
+  }
+  // The table may start up to one entry past its line to be in step with the
+  // anchor
+  [[nodiscard]] static constexpr inline size_type
+  bucket_lines(Mask bucket_mask) {
+    return table_line(bucket_mask) +
+           lines((bucket_mask + 2) * sizeof(table_type));
+  }
+  // std::allocator blocks come from calloc, which leaves zeroing large offset
+  // arrays to the first touch of each page. That spreads it over the
+  // migration instead of the insert that resizes.
+  inline static constexpr bool CALLOC =
+      std::is_same_v<line_allocator, std::allocator<line>> &&
+      alignof(table_type) <= alignof(std::max_align_t);
+  [[nodiscard]] buckets allocate(Mask bucket_mask) {
+    if (bucket_mask > MAX_INDEX) { throw std::length_error("kvpq::allocate"); }
+    line* block;
+    if constexpr (CALLOC) {
+      block = (line*)std::calloc(bucket_lines(bucket_mask), CACHE_LINE);
+      if (!block) { throw std::bad_alloc(); }
+    } else {
+      line_allocator alloc(alloc_);
+      block = std::to_address(
+          line_traits::allocate(alloc, bucket_lines(bucket_mask)));
+      if constexpr (!allocator_is_zeroed<line_allocator>::value) {
+        std::memset(block, 0, table_line(bucket_mask) * CACHE_LINE);
+      }
+    }
+    // Start the table a whole number of entries from the anchor, or make it
+    // the anchor if some slot would be out of reach. The least position is
+    // left to mark dead heap entries.
+    constexpr auto ENTRY = std::intptr_t(sizeof(table_type));
+    auto table =
+        reinterpret_cast<std::uintptr_t>(block + table_line(bucket_mask));
+    std::intptr_t pad = -(std::intptr_t(table - anchor_) % ENTRY);
+    if (pad < 0) { pad += ENTRY; }
+    std::intptr_t first = std::intptr_t(table + pad - anchor_) / ENTRY;
+    if (!anchor_ || first <= std::numeric_limits<std::int32_t>::min() ||
+        first + std::intptr_t(bucket_mask) >
+            std::numeric_limits<std::int32_t>::max()) {
+      anchor_ = table;
+      pad = first = 0;
+    }
+    return {bucket_mask, (size_type*)block, (table_type*)(table + pad),
+            std::uint32_t(first)};
+  }
+  void deallocate(buckets& b) {
+    if (!b.offset) { return; }
+    if (image_.contains(b.offset)) {
+      b.offset = nullptr;
+      b.table = nullptr;
+      release_image();
+      return;
+    }
+    if constexpr (CALLOC) {
+      std::free(b.offset);
+    } else {
+      line_allocator alloc(alloc_);
+      line_traits::deallocate(
+          alloc,
+          std::pointer_traits<typename line_traits::pointer>::pointer_to(
+              *(line*)b.offset),
+          bucket_lines(b.mask));
+    }
+    b.offset = nullptr;
+    b.table = nullptr;
+  }
+  // heap_ + 1 starts a cache line, so each group of D siblings shares one
+  // when they fit in it
+  inline static constexpr size_type HEAP_OFFSET =
+      CACHE_LINE % sizeof(heap_type) ? 0 : CACHE_LINE / sizeof(heap_type) - 1;
+  [[nodiscard]] static constexpr inline size_type
+  heap_lines(size_type heap_capacity) {
+    return lines((heap_capacity + HEAP_OFFSET) * sizeof(heap_type));
+  }
+  [[nodiscard]] heap_type* allocate_heap(size_type heap_capacity) {
+    if (heap_capacity > MAX_INDEX) {
+      throw std::length_error("kvpq::allocate_heap");
+    }
+    line_allocator alloc(alloc_);
+    return (heap_type*)std::to_address(
+               line_traits::allocate(alloc, heap_lines(heap_capacity))) +
+           HEAP_OFFSET;
+  }
+  void deallocate_heap(heap_type* heap, size_type heap_capacity) {
+    if (heap && !image_.contains(heap)) {
+      line_allocator alloc(alloc_);
+      line_traits::deallocate(
+          alloc,
+          std::pointer_traits<typename line_traits::pointer>::pointer_to(
+              *(line*)(heap - HEAP_OFFSET)),
+          heap_lines(heap_capacity));
+    }
+  }
+  void resize(Mask bucket_mask);
+  void reallocate_heap(size_type heap_capacity);
+
+  // Images
+  // The first line of an image. The block of offsets, control bytes and table
+  // follows, and then the block of the heap.
+  struct image_header {
+    char magic[8] = {'k', 'v', 'p', 'q', 'i', 'm', 'g', '\0'};
+    std::uint32_t version = 6;
+    std::uint32_t byte_order = 0x01020304;
+    std::uint64_t layout[8] = {sizeof(K),
+                               sizeof(V),
+                               sizeof(table_type),
+                               sizeof(heap_type),
+                               D,
+                               group::WIDTH,
+                               DARY      ? 0u
+                               : RADIX   ? 1u
+                               : PAIRING ? 2u
+                                         : 3u,
+                               LAZY};
+    std::uint64_t bucket_mask = 0;
+    std::uint64_t table_capacity = 0;
+    std::uint64_t heap_capacity = 0;
+    // Heap entries, and how many of them are dead
+    std::uint64_t size = 0;
+    std::uint64_t dead = 0;
+    std::uint64_t generation = 0;
+    float max_load_factor = 0;
+    radix_state radix{};
+  };
+  inline static constexpr size_type IMAGE_HEADER =
+      lines(sizeof(image_header)) * CACHE_LINE;
+  [[nodiscard]] static size_type image_bytes(Mask bucket_mask,
+                                             size_type heap_capacity) {
+    return IMAGE_HEADER +
+           (bucket_lines(bucket_mask) + heap_lines(heap_capacity)) * CACHE_LINE;
+  }
+  [[nodiscard]] static buckets image_buckets(char* image, Mask bucket_mask) {
+    char* block = image + IMAGE_HEADER;
+    return {bucket_mask, (size_type*)block,
+            (table_type*)(block + table_line(bucket_mask) * CACHE_LINE)};
+  }
+  [[nodiscard]] static heap_type* image_heap(char* image, Mask bucket_mask) {
+    return (heap_type*)(image + IMAGE_HEADER +
+                        bucket_lines(bucket_mask) * CACHE_LINE) +
+           HEAP_OFFSET;
+  }
+  kvpq(mapped_file&& image, const image_header&, const H&, const EQ&,
+       const C&, const A&);
+  // Unmaps the image once none of the arrays are in it
+  void release_image() {
+    if (image_ && !image_.contains(buckets_.offset) &&
+        !image_.contains(old_buckets_.offset) && !image_.contains(heap_)) {
+      image_ = mapped_file();
+    }
+  }
+
+  // Incremental rehashing
+  [[nodiscard]] inline bool migrating() const noexcept {
+    return old_buckets_.offset;
+  }
+  // Slot of old_buckets_ to start probing from for hash h. The migrated slots
+  // are free, so a home bucket among them is replaced by the next slot to
+  // migrate if it is in the same cluster, and otherwise by the free slot
+  // before migrate_begin_, since no probe sequence crosses a free slot.
+  [[nodiscard]] inline size_type old_home(size_type h) const {
+    size_type i = h & old_buckets_.mask;
+    if (size_type d = (i - migrate_begin_) & old_buckets_.mask; d < migrated_) {
+      i = d < migrate_cluster_ ? migrate_begin_ - 1
+                               : migrate_begin_ + migrated_;
+    }
+    return i & old_buckets_.mask;
+  }
+  void migrate(size_type bucket_count);
+  // Records its lifetime in stats_ as a resize
+  struct resizing {
+    explicit resizing(kvpq& q) : q(q) {
+      if constexpr (RECORDS) { start = std::chrono::steady_clock::now(); }
+    }
+    resizing(const resizing&) = delete;
+    resizing& operator=(const resizing&) = delete;
+    ~resizing() {
+      if constexpr (RECORDS) {
+        q.stats_.resize(std::chrono::steady_clock::now() - start);
+      }
+    }
+    kvpq& q;
+    [[maybe_unused]] std::chrono::steady_clock::time_point start;
+  };
+
+  // Table
+  template <typename KEY> V& at_key(const KEY&);
+  template <typename KEY> const V& at_key(const KEY&) const;
+  template <typename KEY> iterator find_key(const KEY& k) {
+    migrate(migrate_step_);
+    return iterator(const_cast<const kvpq&>(*this).find_key(k));
+  }
+  template <typename KEY> const_iterator find_key(const KEY&) const;
+  template <typename KEY> size_type erase_key(const KEY&);
+  // The stamped hash of an entry with hash h that is inserted or rekeyed now.
+  // Tables have at most 2^31 slots, so the low half of h holds every bit that
+  // chooses a home bucket.
+  [[nodiscard]] inline size_type stamp(size_type h) {
+    return std::uint32_t(h) | size_type(generation_++) << 32;
+  }
+  // Adds the probe steps it takes to probes
+  template <typename KEY>
+  table_type* probe(const buckets&, size_type i, size_type h, std::uint8_t c,
+                    const KEY&, size_type& probes) const;
+  // Finds k, which has hash h. Probes with the fragment c, which comes from h
+  // unless h is the stamped hash of an entry with control byte c.
+  template <typename KEY>
+  const table_type* lookup(const KEY& k, size_type h, std::uint8_t c) const;
+  template <typename KEY>
+  const table_type* lookup(const KEY& k, size_type h) const {
+    return lookup(k, h, fragment(h));
+  }
+  // Finds the entry of a handle
+  const table_type* resolve(const handle&) const;
+  // Calls resolve(i, h) for i from 0 to n - 1, where h is the hash of key(i),
+  // after hashing key(i + AHEAD) and fetching its home bucket, for writing if
+  // WRITE
+  template <bool WRITE, typename KEY, typename RESOLVE>
+  void pipeline(size_type n, KEY&& key, RESOLVE&& resolve) const;
+  template <typename IT>
+  void find_batch_into(std::span<const K> keys, std::span<IT> out) const;
+  // Empties a slot, moving each entry after it back one slot until one is
+  // free or in its home bucket. Robin Hood order keeps the entries of a
+  // cluster sorted by home bucket, so none further on can move back either.
+  void erase_slot(table_type*);
+  std::pair<iterator, bool> rekey(const_iterator pos, K&& k, int direction);
+
+  // Heap
+  // Whether heap entry a has a lower priority than b. Cached priorities decide
+  // unless they are equivalent, which only happens for distinct keys if the
+  // projection drops part of the key. Cached keys are the keys themselves, so
+  // they need no second comparison.
+  [[nodiscard]] inline bool heap_less(const heap_type& a,
+                                      const heap_type& b) const {
+    if constexpr (std::is_same_v<PR, inline_key>) {
+      return comp_(priority(a), priority(b));
+    } else if constexpr (!std::is_void_v<PR>) {
+      if (comp_(priority(a), priority(b))) { return true; }
+      if (comp_(priority(b), priority(a))) { return false; }
+    }
+    return comp_(table_of(a)->first, table_of(b)->first);
+  }
+  // The priority cached in heap entry e
+  [[nodiscard]] static inline priority_type& priority(heap_type& e) {
+    if constexpr (PAIRING) {
+      return e.get().priority;
+    } else {
+      return e.get();
+    }
+  }
+  [[nodiscard]] static inline const priority_type&
+  priority(const heap_type& e) {
+    return priority(const_cast<heap_type&>(e));
+  }
+  inline void set_priority(heap_type& e) const {
+    if constexpr (!std::is_void_v<PR>) {
+      priority(e) = PR()(table_of(e)->first);
+    }
+  }
+  // The table entry of heap entry e. Every table starts a whole number of
+  // entries from anchor_, so one 32-bit index reaches both tables during a
+  // migration and no comparison has to pick a table first.
+  [[nodiscard]] inline table_type& table_of(const heap_type& e) const {
+    return *reinterpret_cast<table_type*>(
+        anchor_ + std::uintptr_t(std::intptr_t(std::int32_t(e.index())) *
+                                 std::intptr_t(sizeof(table_type))));
+  }
+  // The table position of the dead heap entries of a lazy_erase queue, which
+  // is never a table's (see allocate)
+  inline static constexpr std::uint32_t DEAD =
+      std::uint32_t(std::numeric_limits<std::int32_t>::min());
+  [[nodiscard]] static inline bool dead(const heap_type& e) {
+    if constexpr (LAZY) {
+      return e.index() == DEAD;
+    } else {
+      return false;
+    }
+  }
+  // The first live heap index from j on, or size_
+  // The heap position of pos, counting dead entries
+  [[nodiscard]] inline size_type index_of(const_iterator pos) const {
+    return pos.elt_ - heap_;
+  }
+  [[nodiscard]] inline size_type next_live(size_type j) const {
+    while (j < size_ && dead(heap_[j])) { ++j; }
+    return j;
+  }
+  // Points the table entry of heap_[j], unless it is dead, back at it
+  inline void relink(size_type j) {
+    if (!dead(heap_[j])) { table_of(heap_[j]).set_index(j); }
+  }
+  // Links slot i of b and heap_[j]
+  inline void link(buckets& b, size_type i, size_type j) {
+    b.table[i].set_index(j);
+    heap_[j].set_index(b.first + std::uint32_t(i));
+  }
+  size_type sift_up(size_type j);
+  size_type sift_down(size_type j);
+  size_type sift_hole(size_type j, heap_type&& e);
+  void heapify(size_type placed);
+  // Calls f with the heap indices of the n entries of highest priority, from
+  // the highest down
+  template <typename F> void best_first(size_type n, F&& f) const;
+  // Where the HEAP policies differ. heap_push orders heap_[j], the last entry,
+  // which was just appended. heap_erase removes heap_[j] without reading its
+  // table entry, which may have been moved out. heap_update orders heap_[j]
+  // after its priority changed, in the direction given as for rekey. They
+  // return the entry's new index.
+  size_type heap_push(size_type j);
+  void heap_erase(size_type j);
+  size_type heap_update(size_type j, int direction);
+  // lazy_erase. drop_dead_top erases dead entries from the top until it is
+  // live, and compact rebuilds the heap without dead entries. Both do nothing
+  // with eager_erase.
+  void drop_dead_top();
+  void compact();
+
+  // Radix heap. The top is the entry of least radix and bucket b holds
+  // heap_[radix_begin(b)] to heap_[radix_.end[b] - 1], with bucket 64 first
+  // and bucket 0, which only holds a radix equal to last, last. Each returns
+  // the number of entries it moved.
+  [[nodiscard]] inline std::uint64_t radix(const heap_type& e) const {
+    std::uint64_t x;
+    if constexpr (std::is_same_v<PR, inline_key>) {
+      x = std::uint64_t(priority(e));
+    } else {
+      x = std::uint64_t(table_of(e)->first);
+    }
+    if constexpr (std::is_signed_v<K>) { x ^= std::uint64_t(1) << 63; }
+    return MAX_FIRST ? ~x : x;
+  }
+  [[nodiscard]] inline int radix_bucket(std::uint64_t x) const {
+    return std::bit_width(x ^ radix_.last);
+  }
+  [[nodiscard]] inline size_type radix_begin(int b) const {
+    return b < 64 ? radix_.end[b + 1] : 1;
+  }
+  // The lowest nonempty bucket of a heap of two entries or more
+  [[nodiscard]] inline int radix_lowest() const {
+    int b = 0;
+    while (radix_begin(b) == radix_.end[b]) { ++b; }
+    return b;
+  }
+  // The bucket holding heap_[j], for j > 0
+  [[nodiscard]] inline int radix_bucket_of(size_type j) const {
+    int b = 0;
+    while (radix_begin(b) > j) { ++b; }
+    return b;
+  }
+  size_type radix_push(size_type j);
+  size_type radix_insert(size_type j);
+  size_type radix_pop();
+  size_type radix_to_end(size_type j);
+  void radix_update(size_type j);
+  void radix_distribute(size_type s, int b);
+
+  // Pairing heap. The top is the root, and trees other than the heap are
+  // detached: their roots have no parent or siblings.
+  inline static constexpr std::uint32_t NONE = pairing_node::NONE;
+  [[nodiscard]] inline pairing_node& node(size_type j) {
+    return heap_[j].get();
+  }
+  [[nodiscard]] inline const pairing_node& node(size_type j) const {
+    return heap_[j].get();
+  }
+  // Makes the detached tree rooted at c the first child of p
+  inline void pairing_link(size_type p, size_type c) {
+    pairing_node& n = node(c);
+    n.prev = p;
+    n.next = node(p).child;
+    if (n.next != NONE) { node(n.next).prev = c; }
+    node(p).child = c;
+  }
+  // Melds detached trees. Returns the root of the result.
+  inline size_type pairing_meld(size_type a, size_type b) {
+    if (heap_less(heap_[a], heap_[b])) { std::swap(a, b); }
+    pairing_link(a, b);
+    return a;
+  }
+  // Detaches the tree rooted at heap_[j], for j > 0
+  void pairing_cut(size_type j);
+  // Melds the children of heap_[j] into one detached tree and returns its
+  // root, or NONE. Adds the melds it makes to melds.
+  size_type pairing_merge(size_type j, size_type& melds);
+  // Moves heap_[from] to the unused slot to and points its links at it
+  void pairing_move(size_type from, size_type to);
+  // Melds the detached tree rooted at heap_[j] into the heap and returns the
+  // new index of heap_[j]
+  size_type pairing_attach(size_type j);
+
+  // Min-max heap. Entries on high levels, those of even depth, outrank their
+  // descendants; the rest are outranked by theirs.
+  [[nodiscard]] static inline bool minmax_high(size_type j) {
+    return std::bit_width(j + 1) & 1;
+  }
+  // Whether a belongs above b on a high level if high, or on a low one
+  [[nodiscard]] inline bool minmax_above(const heap_type& a,
+                                         const heap_type& b, bool high) const {
+    return high ? heap_less(b, a) : heap_less(a, b);
+  }
+  [[nodiscard]] inline size_type bottom_index() const {
+    static_assert(MINMAX, "bottom needs a minmax_heap");
+    if (size_ < 3) { return size_ - 1; }
+    return heap_less(heap_[2], heap_[1]) ? 2 : 1;
+  }
+  // These return the new index of heap_[j]
+  size_type minmax_fix(size_type j);
+  size_type minmax_up(size_type j, bool high);
+  size_type minmax_down(size_type j);
+
+  template <typename... ARGS> std::pair<heap_type*, bool> place(ARGS&&...);
+  // As place, for an entry whose key has hash h
+  template <typename... ARGS>
+  std::pair<heap_type*, bool> place_hashed(size_type h, ARGS&&...);
+  std::pair<heap_type*, bool> place_entry(size_type h, table_type&&,
+                                          heap_type&&);
+  template <typename IT>
+  [[nodiscard]] static size_type initial_bucket_count(IT b, IT e,
+                                                      size_type bucket_count) {
+    if constexpr (std::is_base_of_v<
+                      std::random_access_iterator_tag,
+                      typename std::iterator_traits<IT>::iterator_category>) {
+      return std::max(
+          bucket_count,
+          size_type(get_bucket_mask(e - b, DEFAULT_MAX_LOAD_FACTOR)) + 1);
+    }
+    return bucket_count;
+  }
+
+  void copy_from(const kvpq&);
+  void clone_into(buckets&, heap_type*) const;
 
   [[no_unique_address]] H hash_;
   [[no_unique_address]] EQ key_equal_;
   [[no_unique_address]] C comp_;
+  [[no_unique_address]] A alloc_;
+  [[no_unique_address]] mutable S stats_;
+  [[no_unique_address]] radix_state radix_;
   float max_load_factor_ = DEFAULT_MAX_LOAD_FACTOR;
-  Mask bucket_mask_;
+  // The image that open_mapped mapped, while any array is still in it
+  mapped_file image_;
+  // The address that heap entries locate their table entries from
+  std::uintptr_t anchor_ = 0;
+  buckets buckets_;
+  // The table being migrated into buckets_, if any, starting at
+  // migrate_begin_ (a slot after a free slot), migrate_step_ buckets at a time.
+  // The cluster being migrated started migrate_cluster_ slots after it.
+  buckets old_buckets_{Mask(1), nullptr, nullptr};
+  size_type migrate_begin_ = 0;
+  size_type migrated_ = 0;
+  size_type migrate_cluster_ = 0;
+  size_type migrate_step_ = 0;
   size_type table_capacity_;
-  size_type heap_capacity_; // TODO: FIXME
+  // The heap holds entries in priority order and grows like a vector,
+  // independently of the bucket count
+  size_type heap_capacity_;
+  // Heap entries, including the dead_ dead ones of a lazy_erase queue
   size_type size_ = 0;
-  size_type* offset_;
-  table_type* table_;
+  size_type dead_ = 0;
   heap_type* heap_;
+  // The generation that stamp gives the next entry
+  std::uint32_t generation_ = 0;
 };
 
 // (1)
-template <typename K, typename V, typename H, typename EQ, typename C>
-kvpq<K, V, H, EQ, C>::kvpq(size_type bucket_count, const H& hash,
-                           const EQ& key_equal, const C& comp)
-    : hash_(hash), key_equal_(key_equal), comp_(comp),
-      bucket_mask_(bucket_count - 1),
-      table_capacity_(get_capacity(max_load_factor_, bucket_mask_)) {
-  offset_ = new size_type[capacity()]();
-  table_ = (table_type*)operator new[](capacity() * sizeof(table_type));
-  heap_ = (heap_type*)operator new[](capacity() * sizeof(heap_type));
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::kvpq(
+    size_type bucket_count, const H& hash, const EQ& key_equal, const C& comp,
+    const A& alloc)
+    : hash_(hash), key_equal_(key_equal), comp_(comp), alloc_(alloc),
+      buckets_(allocate(Mask(bucket_count - 1))),
+      table_capacity_(std::min(get_capacity(max_load_factor_, buckets_.mask),
+                               size_type(buckets_.mask))),
+      heap_capacity_(table_capacity_) {
+  heap_ = allocate_heap(heap_capacity_);
 }
 // (3)
-template <typename K, typename V, typename H, typename EQ, typename C>
-kvpq<K, V, H, EQ, C>::kvpq(const kvpq& o)
-    : kvpq(o.capacity(), o.hash_, o.key_equal_, o.comp_) {
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::kvpq(const kvpq& o, const A& alloc)
+    : kvpq(o.capacity(), o.hash_, o.key_equal_, o.comp_, alloc) {
   max_load_factor_ = o.max_load_factor_;
   table_capacity_ = o.table_capacity_;
-  for (size_type i = 0; i < o.size(); ++i) {
-    ++size_;
-    size_type j = o.heap_[i].other() - o.table_;
-    offset_[j] = o.offset_[j];
-    auto [table_entry, heap_entry] = table_type::make(o.table_[j].get());
-    new (table_ + j) table_type(move(table_entry));
-    new (heap_ + i) heap_type(move(heap_entry));
-  }
-  assert(table_capacity_ >= size_);
+  copy_from(o);
 }
 
 // (4)
-template <typename K, typename V, typename H, typename EQ, typename C>
-kvpq<K, V, H, EQ, C>::kvpq(kvpq&& o)
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::kvpq(kvpq&& o, const A& alloc)
     : hash_(move(o.hash_)), key_equal_(move(o.key_equal_)),
-      comp_(move(o.comp_)), bucket_mask_(o.bucket_mask_),
-      max_load_factor_(o.max_load_factor_), table_capacity_(o.table_capacity_),
-      size_(o.size_), offset_(o.offset_), table_(o.table_), heap_(o.heap_) {
-  o.size_ = 0;
-  o.offset_ = nullptr;
-  o.table_ = nullptr;
+      comp_(move(o.comp_)), alloc_(alloc), stats_(move(o.stats_)),
+      radix_(o.radix_), max_load_factor_(o.max_load_factor_),
+      image_(move(o.image_)),
+      anchor_(o.anchor_), buckets_(o.buckets_),
+      old_buckets_(o.old_buckets_), migrate_begin_(o.migrate_begin_),
+      migrated_(o.migrated_), migrate_cluster_(o.migrate_cluster_),
+      migrate_step_(o.migrate_step_), table_capacity_(o.table_capacity_),
+      heap_capacity_(o.heap_capacity_), size_(o.size_), dead_(o.dead_),
+      heap_(o.heap_), generation_(o.generation_) {
+  if (!std::allocator_traits<A>::is_always_equal::value && alloc_ != o.alloc_) {
+    // The arrays stay with o's allocator. The entries are relocated to a table
+    // with the same buckets, where they keep their slots and need no
+    // rehashing.
+    o.image_ = move(image_);
+    o.migrate(-1);
+    anchor_ = 0;
+    buckets_ = allocate(o.buckets_.mask);
+    old_buckets_.offset = nullptr;
+    old_buckets_.table = nullptr;
+    heap_capacity_ = std::max(size_, table_capacity_);
+    heap_ = allocate_heap(heap_capacity_);
+    if (!size_) { return; }
+    std::memcpy(buckets_.offset, o.buckets_.offset,
+                table_line(buckets_.mask) * CACHE_LINE);
+    // Each run of occupied slots at once
+    for (size_type i = 0, run = 0; i <= buckets_.mask + 1; ++i) {
+      if (i <= buckets_.mask && !o.buckets_.free(i)) {
+        ++run;
+      } else if (run) {
+        intrusive::relocate_range(o.buckets_.table + i - run,
+                                  buckets_.table + i - run, run);
+        run = 0;
+      }
+    }
+    // The new table is the anchor, so positions in it are its slots
+    intrusive::relocate_range(o.heap_, heap_, size_,
+                              [&](heap_type& e, size_type) {
+                                if (!dead(e)) {
+                                  e.set_index(e.index() - o.buckets_.first);
+                                }
+                              });
+    std::memset(o.buckets_.offset, 0, table_line(buckets_.mask) * CACHE_LINE);
+    o.size_ = o.dead_ = 0;
+    return;
+  }
+  o.size_ = o.dead_ = o.heap_capacity_ = 0;
+  o.buckets_.offset = o.old_buckets_.offset = nullptr;
+  o.buckets_.table = o.old_buckets_.table = nullptr;
   o.heap_ = nullptr;
 }
 
-template <typename K, typename V, typename H, typename EQ, typename C>
-kvpq<K, V, H, EQ, C>::~kvpq() {
-  clear();
-  delete[] offset_;
-  operator delete[](table_);
-  operator delete[](heap_);
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::~kvpq() {
+  // Entries of trivially copyable types need not be destroyed one by one,
+  // which would copy every page of a mapped image
+  if constexpr (MAPPABLE) {
+    deallocate(old_buckets_);
+  } else {
+    clear();
+  }
+  deallocate(buckets_);
+  deallocate_heap(heap_, heap_capacity_);
 }
 
-template <typename K, typename V, typename H, typename EQ, typename C>
-kvpq<K, V, H, EQ, C>& kvpq<K, V, H, EQ, C>::operator=(const kvpq& o) {
-  if (bucket_mask_ != o.bucket_mask_) {
-    ~kvpq();
-    return *(new (this) kvpq(o));
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>&
+kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::operator=(const kvpq& o) {
+  if (this == &o) { return *this; }
+  constexpr bool POCCA =
+      std::allocator_traits<A>::propagate_on_container_copy_assignment::value;
+  if (buckets_.mask != o.buckets_.mask || (POCCA && alloc_ != o.alloc_)) {
+    A alloc = POCCA ? o.alloc_ : alloc_;
+    this->~kvpq();
+    return *(new (this) kvpq(o, alloc));
   }
 
   clear();
@@ -506,229 +1608,1484 @@ kvpq<K, V, H, EQ, C>& kvpq<K, V, H, EQ, C>::operator=(const kvpq& o) {
   comp_ = o.comp_;
   max_load_factor_ = o.max_load_factor_;
   table_capacity_ = o.table_capacity_;
+  copy_from(o);
+  return *this;
+}
 
-  for (size_type i = 0; i < o.size(); ++i) {
-    ++size_;
-    size_type j = o.heap_[i].other() - o.table_;
-    offset_[j] = o.offset_[j];
-    auto [table_entry, heap_entry] = table_type::make(o.table_[j].get());
-    new (table_ + j) table_type(move(table_entry));
-    new (heap_ + i) heap_type(move(heap_entry));
+// Clones the entries of o into this empty kvpq with o's bucket mask
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+void kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::copy_from(const kvpq& o) {
+  assert(!size_ && buckets_.mask == o.buckets_.mask);
+  if (o.size_ > heap_capacity_) { reallocate_heap(o.size_); }
+  o.clone_into(buckets_, heap_);
+  size_ = o.size_;
+  dead_ = o.dead_;
+  generation_ = o.generation_;
+  radix_ = o.radix_;
+  assert(table_capacity_ >= size());
+}
+// Clones the entries into the empty bucket array b, which has the bucket mask
+// of buckets_, and heap, which has room for them. Entries in the current
+// table keep their slots; those still in the old table are rehashed after
+// them so that they do not take a slot another entry needs. Dead heap entries
+// are copied as they are.
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+void kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::clone_into(
+    buckets& b, heap_type* heap) const {
+  assert(b.mask == buckets_.mask);
+  if (!size_) { return; }
+  // Trivially copyable entries are copied with the arrays, which only leaves
+  // the heap's table positions to move with the table
+  if constexpr (MAPPABLE) {
+    if (!migrating()) {
+      std::memcpy(b.offset, buckets_.offset, table_line(b.mask) * CACHE_LINE);
+      std::memcpy(static_cast<void*>(b.table), buckets_.table,
+                  (b.mask + 1) * sizeof(table_type));
+      std::memcpy(static_cast<void*>(heap), heap_, size_ * sizeof(heap_type));
+      if (b.first != buckets_.first) {
+        for (size_type i = 0; i < size_; ++i) {
+          if (!dead(heap[i])) {
+            heap[i].set_index(heap[i].index() - buckets_.first + b.first);
+          }
+        }
+      }
+      return;
+    }
   }
-  assert(table_capacity_ >= size_);
+  for (bool old : {false, true}) {
+    for (size_type i = 0; i < size_; ++i) {
+      if constexpr (LAZY) {
+        if (dead(heap_[i])) {
+          if (!old) {
+            std::memcpy(static_cast<void*>(heap + i), heap_ + i,
+                        sizeof(heap_type));
+          }
+          continue;
+        }
+      }
+      const table_type* t = &table_of(heap_[i]);
+      if (buckets_.owns(t) == old) { continue; }
+      size_type h, j;
+      std::uint8_t c;
+      if (old) {
+        h = old_buckets_.hash_at(t - old_buckets_.table);
+        c = old_buckets_.ctrl()[t - old_buckets_.table];
+        j = b.make_room(h, heap);
+      } else {
+        j = t - buckets_.table;
+        h = buckets_.hash_at(j);
+        c = buckets_.ctrl()[j];
+      }
+      b.set_hash_at(j, h, c);
+      auto [table_entry, heap_entry] = table_type::make(t->get());
+      new (b.table + j) table_type(move(table_entry));
+      new (heap + i) heap_type(move(heap_entry));
+      heap[i].get() = heap_[i].get();
+      b.table[j].set_index(i);
+      heap[i].set_index(b.first + std::uint32_t(j));
+    }
+  }
+}
 
-  return *this;
+// Images
+// The arrays are cloned into the file rather than copied, since the links of
+// entries in two blocks depend on the distance between the blocks. The image
+// is written beside path and renamed over it, since path may be the image
+// this queue is mapped from, whose pages truncating it would discard.
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+void kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::save(
+    const std::filesystem::path& path) const {
+  static_assert(MAPPABLE, "images hold trivially copyable keys and values");
+  image_header header;
+  header.bucket_mask = buckets_.mask;
+  header.table_capacity = table_capacity_;
+  header.heap_capacity = std::max(size_, size_type(1));
+  header.size = size_;
+  header.dead = dead_;
+  header.generation = generation_;
+  header.max_load_factor = max_load_factor_;
+  header.radix = radix_;
+  std::filesystem::path temp = path;
+  temp += ".tmp";
+  try {
+    mapped_file image = mapped_file::create(
+        temp, image_bytes(buckets_.mask, header.heap_capacity));
+    std::memcpy(image.data(), &header, sizeof(header));
+    buckets b = image_buckets(image.data(), buckets_.mask);
+    clone_into(b, image_heap(image.data(), buckets_.mask));
+    std::filesystem::rename(temp, path);
+  } catch (...) {
+    std::error_code ec;
+    std::filesystem::remove(temp, ec);
+    throw;
+  }
+}
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::open_mapped(
+    const std::filesystem::path& path, const H& hash, const EQ& key_equal,
+    const C& comp, const A& alloc) -> kvpq {
+  static_assert(MAPPABLE, "images hold trivially copyable keys and values");
+  mapped_file image = mapped_file::open(path);
+  image_header header, expected;
+  if (image.size() >= sizeof(header)) {
+    std::memcpy(&header, image.data(), sizeof(header));
+  }
+  // Links reach no further than MAX_INDEX, which also keeps image_bytes from
+  // overflowing
+  size_type mask = header.bucket_mask;
+  if (std::memcmp(&header, &expected, offsetof(image_header, bucket_mask)) ||
+      !mask || mask & (mask + 1) || mask > MAX_INDEX ||
+      header.heap_capacity > MAX_INDEX || header.table_capacity > mask ||
+      header.size > header.heap_capacity ||
+      header.dead > (LAZY ? header.size : 0) ||
+      header.size - header.dead > header.table_capacity ||
+      image.size() != image_bytes(Mask(mask), header.heap_capacity)) {
+    throw std::runtime_error("kvpq::open_mapped: not an image of this kvpq");
+  }
+  return kvpq(move(image), header, hash, key_equal, comp, alloc);
+}
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::kvpq(
+    mapped_file&& image, const image_header& header, const H& hash,
+    const EQ& key_equal, const C& comp, const A& alloc)
+    : hash_(hash), key_equal_(key_equal), comp_(comp), alloc_(alloc),
+      radix_(header.radix), max_load_factor_(header.max_load_factor),
+      image_(move(image)),
+      buckets_(image_buckets(image_.data(), Mask(header.bucket_mask))),
+      table_capacity_(header.table_capacity),
+      heap_capacity_(header.heap_capacity), size_(header.size),
+      dead_(header.dead), heap_(image_heap(image_.data(), buckets_.mask)),
+      generation_(std::uint32_t(header.generation)) {
+  anchor_ = reinterpret_cast<std::uintptr_t>(buckets_.table);
 }
 
 // Modifiers
-template <typename K, typename V, typename H, typename EQ, typename C>
-void kvpq<K, V, H, EQ, C>::clear() noexcept {
-  for (size_type i = 0; i < size(); ++i) {
-    size_type j = heap_[i].other() - table_;
-    table_[j].~table_type();
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+void kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::clear() noexcept {
+  for (size_type i = 0; i < size_; ++i) {
+    if (!dead(heap_[i])) {
+      table_type* t = &table_of(heap_[i]);
+      buckets& b = buckets_.owns(t) ? buckets_ : old_buckets_;
+      b.clear_hash_at(t - b.table);
+      t->~table_type();
+    }
     heap_[i].~heap_type();
-    clear_hash_at(j);
-    --size_;
   }
+  size_ = dead_ = 0;
+  if (migrating()) { deallocate(old_buckets_); }
 }
 
 // insert_or_assign(1)
-template <typename K, typename V, typename H, typename EQ, typename C>
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
 template <typename M>
-std::pair<kvpq_iterator<kvpq<K, V, H, EQ, C>>, bool>
-kvpq<K, V, H, EQ, C>::insert_or_assign(const K& k, M&& v) {
+std::pair<kvpq_iterator<kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>>, bool>
+kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::insert_or_assign(const K& k, M&& v) {
   if (auto it = find(k); it == end()) {
-    return emplace(std::piecewise_construct, k, forward(v));
+    return emplace(k, forward<M>(v));
   } else {
-    it->second = forward(v);
+    it->second = forward<M>(v);
     return {it, false};
   }
 }
 // insert_or_assign(2)
-template <typename K, typename V, typename H, typename EQ, typename C>
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
 template <typename M>
-std::pair<kvpq_iterator<kvpq<K, V, H, EQ, C>>, bool>
-kvpq<K, V, H, EQ, C>::insert_or_assign(K&& k, M&& v) {
+std::pair<kvpq_iterator<kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>>, bool>
+kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::insert_or_assign(K&& k, M&& v) {
   if (auto it = find(k); it == end()) {
-    return emplace(std::piecewise_construct, move(k), forward(v));
+    return emplace(move(k), forward<M>(v));
   } else {
-    it->second = forward(v);
+    it->second = forward<M>(v);
     return {it, false};
   }
 }
 
-template <typename K, typename V, typename H, typename EQ, typename C>
+// insert(5)
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+template <typename IT>
+void kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::insert(IT b, IT e) {
+  if constexpr (std::is_base_of_v<
+                    std::random_access_iterator_tag,
+                    typename std::iterator_traits<IT>::iterator_category>) {
+    reserve(size_ + (e - b));
+  }
+  size_type placed = size_;
+  try {
+    if constexpr (std::is_base_of_v<
+                      std::random_access_iterator_tag,
+                      typename std::iterator_traits<IT>::iterator_category>) {
+      pipeline<true>(
+          e - b, [&](size_type i) -> const K& { return b[i].first; },
+          [&](size_type i, size_type h) { place_hashed(h, b[i]); });
+    } else {
+      for (; b != e; ++b) { place(*b); }
+    }
+  } catch (...) {
+    heapify(placed);
+    throw;
+  }
+  heapify(placed);
+}
+
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
 template <typename... ARGS>
-std::pair<kvpq_iterator<kvpq<K, V, H, EQ, C>>, bool>
-kvpq<K, V, H, EQ, C>::emplace(ARGS&&... args) {
+std::pair<kvpq_iterator<kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>>, bool>
+kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::emplace(ARGS&&... args) {
+  auto [e, fresh] = place(std::forward<ARGS>(args)...);
+  if (!fresh) { return {iterator(this, e), false}; }
+  return {iterator(this, heap_ + heap_push(e - heap_)), true};
+}
+// Adds an entry to the table and to the end of the heap without sifting it.
+// Returns the heap entry with its key and whether it is the new one.
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+template <typename... ARGS>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::place(ARGS&&... args)
+    -> std::pair<heap_type*, bool> {
   auto [table_entry, heap_entry] =
       table_type::make(value_type(std::forward<ARGS>(args)...));
-  reserve(size_ + 1);
-  size_type h = hash_(table_entry->first), i = h;
-  while (!free(i)) {
-    if (hash_at(i) == h && key_equal_(table_[i]->first, table_entry->first)) {
-      return {iterator(table_[i].other()), false};
-    }
-    i = next(i);
-  }
-
-  set_hash_at(i, h);
-  new (table_ + i) table_type(move(table_entry));
-  size_type j = size_;
-  while (j &&
-         comp_(heap_[parent(j)].other()->get().first, table_entry->first)) {
-    if (j == size_) {
-      new (heap_ + j) heap_type(move(heap_[parent(j)]));
-    } else {
-      heap_[j] = move(heap_[parent(j)]);
-    }
-    j = parent(j);
+  size_type h = hash_(table_entry->first);
+  return place_entry(h, move(table_entry), move(heap_entry));
+}
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+template <typename... ARGS>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::place_hashed(size_type h,
+                                                             ARGS&&... args)
+    -> std::pair<heap_type*, bool> {
+  auto [table_entry, heap_entry] =
+      table_type::make(value_type(std::forward<ARGS>(args)...));
+  return place_entry(h, move(table_entry), move(heap_entry));
+}
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::place_entry(
+    size_type h, table_type&& table_entry, heap_type&& heap_entry)
+    -> std::pair<heap_type*, bool> {
+  if (size() + 1 > table_capacity_) {
+    resize(get_bucket_mask(size() + 1, max_load_factor_));
   }
-  if (j == size_) {
-    new (heap_ + j) heap_type(move(heap_entry));
-  } else {
-    heap_[j] = move(heap_entry);
+  migrate(migrate_step_);
+  const K& k = table_entry->first;
+  size_type probes = 0;
+  const std::uint8_t c = fragment(h);
+  table_type* t = probe(buckets_, h & buckets_.mask, h, c, k, probes);
+  if (!t && migrating()) {
+    t = probe(old_buckets_, old_home(h), h, c, k, probes);
+  }
+  stats_.emplace(probes);
+  if (t) { return {heap_ + t->index(), false}; }
+
+  if (size_ == heap_capacity_) {
+    reallocate_heap(std::max(2 * heap_capacity_, size_type(1)));
   }
+  size_type i = buckets_.make_room(h, heap_);
+  buckets_.set_hash_at(i, stamp(h), fragment(h));
+  new (buckets_.table + i) table_type(move(table_entry));
+  new (heap_ + size_) heap_type(move(heap_entry));
+  link(buckets_, i, size_);
+  set_priority(heap_[size_]);
   ++size_;
-  assert(table_capacity_ >= size_);
-  return {iterator(heap_ + j), true};
-}
-template <typename K, typename V, typename H, typename EQ, typename C>
-kvpq_iterator<kvpq<K, V, H, EQ, C>>
-kvpq<K, V, H, EQ, C>::erase(const_iterator pos) {
-  const table_type& table_entry = *pos;
-  {
-    size_type j = table_entry.other() - heap_;
-    while (j) {
-      heap_[j] = move(heap_[parent(j)]);
-      j = parent(j);
-    }
-    while (lchild(j) < size_) {
-      if (rchild(j) < size_ && comp_(lchild(j), rchild(j))) {
-        heap_[j] = move(heap_[rchild(j)]);
-        j = rchild(j);
-      } else {
-        heap_[j] = move(heap_[lchild(j)]);
-        j = lchild(j);
-      }
-    }
-    heap_[j].~heap_type();
+  assert(table_capacity_ >= size());
+  return {heap_ + size_ - 1, true};
+}
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+kvpq_iterator<kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>>
+kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::erase(const_iterator pos) {
+  migrate(migrate_step_);
+  size_type j = index_of(pos);
+  table_type* t = &table_of(heap_[j]);
+  if (LAZY && j) {
+    heap_[j].set_index(DEAD);
+    ++dead_;
+  } else {
+    heap_erase(j);
   }
-  {
-    size_type i = &table_entry - table_;
-    for (size_type j = i; !free(j); j = next(j)) {
-      if (((hash_at(j) - i) & bucket_mask_) <
-          ((hash_at(i) - i) & bucket_mask_)) {
-        table_[i] = move(table_[j]);
-        set_hash_at(i, hash_at(j));
-        i = j;
-      }
-    }
-    table_[i].~table_type();
+  erase_slot(t);
+  if constexpr (LAZY) {
+    if (dead_ > size_ - dead_) { compact(); }
+    drop_dead_top();
+    j = next_live(std::min(j, size_));
   }
+  return iterator(this, heap_ + j);
 }
-template <typename K, typename V, typename H, typename EQ, typename C>
-auto kvpq<K, V, H, EQ, C>::erase(const K& k) -> size_type {
-  if (auto it = find(k); it == end()) {
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+template <typename KEY>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::erase_key(const KEY& k)
+    -> size_type {
+  if (auto it = const_cast<const kvpq&>(*this).find_key(k); it == end()) {
     return 0;
   } else {
     erase(it);
     return 1;
   }
 }
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::erase_batch(
+    std::span<const K> keys)
+    -> size_type {
+  size_type erased = 0;
+  pipeline<true>(
+      keys.size(), [&](size_type i) -> const K& { return keys[i]; },
+      [&](size_type i, size_type h) {
+        if (const table_type* t = lookup(keys[i], h)) {
+          erase(const_iterator(this, heap_ + t->index()));
+          ++erased;
+        }
+      });
+  return erased;
+}
+
+// direction is positive if k does not compare less than the current key,
+// negative if it does not compare greater and 0 if unknown
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::rekey(const_iterator pos, K&& k,
+                                                      int direction)
+    -> std::pair<iterator, bool> {
+  migrate(migrate_step_);
+  size_type j = index_of(pos);
+  table_type* t = &table_of(heap_[j]);
+  if (!key_equal_((*t)->first, k)) {
+    size_type h = hash_(k);
+    if (const table_type* u = lookup(k, h)) {
+      return {iterator(this, heap_ + u->index()), false};
+    }
+    table_type e(move(*t));
+    erase_slot(t);
+    e->first = move(k);
+    size_type i = buckets_.make_room(h, heap_);
+    buckets_.set_hash_at(i, stamp(h), fragment(h));
+    t = new (buckets_.table + i) table_type(move(e));
+    buckets_.relink(i, heap_);
+    set_priority(heap_[j]);
+  }
+  j = heap_update(j, direction);
+  // Dropping dead entries that sank to the top moves the heap entry again
+  if constexpr (LAZY) {
+    drop_dead_top();
+    j = t->index();
+  }
+  return {iterator(this, heap_ + j), true};
+}
 
-template <typename K, typename V, typename H, typename EQ, typename C>
-void kvpq<K, V, H, EQ, C>::swap(kvpq& o) {
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+void kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::swap(kvpq& o) {
   using std::swap;
-  swap(bucket_mask_, o.bucket_mask_);
   swap(hash_, o.hash_);
   swap(key_equal_, o.key_equal_);
   swap(comp_, o.comp_);
+  if constexpr (std::allocator_traits<
+                    A>::propagate_on_container_swap::value) {
+    swap(alloc_, o.alloc_);
+  } else {
+    assert(alloc_ == o.alloc_);
+  }
+  swap(stats_, o.stats_);
+  swap(radix_, o.radix_);
+  swap(max_load_factor_, o.max_load_factor_);
+  image_.swap(o.image_);
+  swap(anchor_, o.anchor_);
+  swap(buckets_, o.buckets_);
+  swap(old_buckets_, o.old_buckets_);
+  swap(migrate_begin_, o.migrate_begin_);
+  swap(migrated_, o.migrated_);
+  swap(migrate_cluster_, o.migrate_cluster_);
+  swap(migrate_step_, o.migrate_step_);
+  swap(table_capacity_, o.table_capacity_);
+  swap(heap_capacity_, o.heap_capacity_);
   swap(size_, o.size_);
-  swap(offset_, o.offset_);
-  swap(table_, o.table_);
+  swap(dead_, o.dead_);
   swap(heap_, o.heap_);
+  swap(generation_, o.generation_);
 }
 
 // merge(2)
-template <typename K, typename V, typename H, typename EQ, typename C>
-template <typename H2, typename P2, typename C2>
-void kvpq<K, V, H, EQ, C>::merge(kvpq<K, V, H2, P2, C2>&& o) {
-  reserve(size_ + o.size());
-  for (std::pair<K, V>& elt : o) { insert(move(elt)); }
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+template <typename H2, typename P2, typename C2, std::size_t D2, typename PR2,
+          typename A2, typename S2, typename HP2, typename ER2>
+void kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::merge(
+    kvpq<K, V, H2, P2, C2, D2, PR2, A2, S2, HP2, ER2>&& o) {
+  insert(std::make_move_iterator(o.begin()), std::make_move_iterator(o.end()));
   o.clear();
 }
 
 // Lookup
-template <typename K, typename V, typename H, typename EQ, typename C>
-V& kvpq<K, V, H, EQ, C>::at(const K& k) {
-  if (auto it = find(k); it == end()) {
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+template <typename KEY>
+V& kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::at_key(const KEY& k) {
+  if (auto it = find_key(k); it == end()) {
     throw std::out_of_range("V& kvpq::at(const K&)");
   } else {
     return it->second;
   }
 }
-template <typename K, typename V, typename H, typename EQ, typename C>
-const V& kvpq<K, V, H, EQ, C>::at(const K& k) const {
-  if (auto it = find(k); it == end()) {
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+template <typename KEY>
+const V& kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::at_key(const KEY& k) const {
+  if (auto it = find_key(k); it == end()) {
     throw std::out_of_range("const V& kvpq::at(const K&) const");
   } else {
     return it->second;
   }
 }
 
-template <typename K, typename V, typename H, typename EQ, typename C>
-kvpq_const_iterator<kvpq<K, V, H, EQ, C>>
-kvpq<K, V, H, EQ, C>::find(const K& k) const {
-  size_type h = hash_(k);
-  for (size_type i = h; !free(i); i = next(i)) {
-    if (hash_at(i) == h && key_equal_(table_[i]->first, k)) {
-      return const_iterator(table_[i].other());
-    }
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+template <typename KEY>
+kvpq_const_iterator<kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>>
+kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::find_key(const KEY& k) const {
+  if (const table_type* t = lookup(k, hash_(k))) {
+    return const_iterator(this, heap_ + t->index());
   }
   return end();
 }
 
-// Hash policy
-template <typename K, typename V, typename H, typename EQ, typename C>
-void kvpq<K, V, H, EQ, C>::resize(Mask bucket_mask, size_type heap_capacity) {
-  if (~bucket_mask_ & bucket_mask && heap_capacity_ >= heap_capacity) {
+// Handles
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::handle_of(
+    const_iterator pos) const
+    -> handle {
+  const table_type& t = table_of(heap_[index_of(pos)]);
+  const buckets& b = buckets_.owns(&t) ? buckets_ : old_buckets_;
+  return handle(b.hash_at(&t - b.table), reinterpret_cast<std::uintptr_t>(&t));
+}
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+kvpq_const_iterator<kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>>
+kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::find(const handle& h) const {
+  if (const table_type* t = resolve(h)) {
+    return const_iterator(this, heap_ + t->index());
+  }
+  return end();
+}
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::erase(const handle& h)
+    -> size_type {
+  if (auto it = find(h); it != end()) {
+    erase(it);
+    return 1;
+  }
+  return 0;
+}
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::update(const handle& h, K k)
+    -> std::pair<iterator, bool> {
+  if (auto it = find(h); it != end()) { return update(it, move(k)); }
+  return {end(), false};
+}
+// The recorded slot may be in a table that has since been freed, so only its
+// address is compared with the tables until it is known to be in one
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::resolve(const handle& h) const
+    -> const table_type* {
+  for (const buckets* b : {&buckets_, &old_buckets_}) {
+    if (b == &old_buckets_ && !migrating()) { break; }
+    size_type i = (h.slot_ - reinterpret_cast<std::uintptr_t>(b->table)) /
+                  sizeof(table_type);
+    if (i <= b->mask && !b->free(i) && b->hash_at(i) == h.hash_) {
+      return b->table + i;
+    }
+  }
+  const table_type* t = buckets_.find_stamped(h.hash_);
+  if (!t && migrating()) { t = old_buckets_.find_stamped(h.hash_); }
+  return t;
+}
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+template <typename IT>
+void kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::find_batch_into(
+    std::span<const K> keys, std::span<IT> out) const {
+  assert(out.size() == keys.size());
+  pipeline<false>(
+      keys.size(), [&](size_type i) -> const K& { return keys[i]; },
+      [&](size_type i, size_type h) {
+        const table_type* t = lookup(keys[i], h);
+        out[i] = IT(this, heap_ + (t ? t->index() : size_));
+      });
+}
+
+// Table
+// Returns the slot of b holding k, which has hash h and fragment c, searching
+// from slot i. Compares a group of control bytes at a time and only compares
+// keys in slots whose fragment matches. A search that reaches a free slot, or
+// whose group ends in an entry nearer its home bucket than k would be, fails;
+// so a lookup reads at most one offset per group.
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+template <typename KEY>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::probe(
+    const buckets& b, size_type i, size_type h, std::uint8_t c, const KEY& k,
+    size_type& probes) const
+    -> table_type* {
+  if constexpr (RECORDS) { ++probes; }
+  // Most keys sit in their home bucket. Its address does not depend on the
+  // control bytes, so checking it first lets a predicted branch fetch it while
+  // they load.
+  if (b.ctrl()[i] == c && key_equal_(b.table[i]->first, k)) {
+    return b.table + i;
+  }
+  for (;; i = (i + group::WIDTH) & b.mask) {
+    if constexpr (RECORDS) { ++probes; }
+    group g(b.ctrl() + i);
+    auto f = g.free(), m = g.match(c);
+    // Slots after the first free one are not in the probe sequence
+    if (f) { m &= (f & -f) - 1; }
+    for (; m; m &= m - 1) {
+      size_type j = (i + group::slot(m)) & b.mask;
+      if (key_equal_(b.table[j]->first, k)) { return b.table + j; }
+    }
+    if (size_type e = (i + group::WIDTH - 1) & b.mask;
+        f || b.distance(e, b.hash_at(e)) < b.distance(e, h)) {
+      return nullptr;
+    }
+  }
+}
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+template <typename KEY>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::lookup(const KEY& k,
+                                                       size_type h,
+                                                       std::uint8_t c) const
+    -> const table_type* {
+  size_type probes = 0;
+  table_type* t = probe(buckets_, h & buckets_.mask, h, c, k, probes);
+  if (!t && migrating()) {
+    t = probe(old_buckets_, old_home(h), h, c, k, probes);
+  }
+  stats_.find(probes);
+  return t;
+}
+// AHEAD keys are in flight, enough to keep the core's outstanding misses busy
+// without the first of them being evicted before it is used
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+template <bool WRITE, typename KEY, typename RESOLVE>
+void kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::pipeline(
+    size_type n, KEY&& key, RESOLVE&& resolve) const {
+  constexpr size_type AHEAD = 16;
+  size_type hashes[AHEAD];
+  for (size_type i = 0; i < n + AHEAD; ++i) {
+    if (i >= AHEAD) { resolve(i - AHEAD, hashes[i % AHEAD]); }
+    if (i < n) {
+      size_type h = hashes[i % AHEAD] = hash_(key(i));
+      size_type j = h & buckets_.mask;
+      __builtin_prefetch(buckets_.ctrl() + j, WRITE);
+      __builtin_prefetch(buckets_.table + j, WRITE);
+      if constexpr (WRITE) { __builtin_prefetch(buckets_.offset + j, 1); }
+    }
+  }
+}
+// Each entry is taken from the root, whose slot is refilled from the end of
+// a D-ary heap by sift_hole
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+template <typename OUT>
+OUT kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::pop_k(size_type n, OUT out) {
+  n = std::min(n, size());
+  migrate(migrate_step_ * n);
+  for (; n; --n) {
+    table_type* t = &table_of(heap_[0]);
+    *out = move(t->get());
+    ++out;
+    erase_slot(t);
+    if constexpr (DARY) {
+      size_type j = 0;
+      if (--size_) { j = sift_hole(0, move(heap_[size_])); }
+      heap_[size_].~heap_type();
+      if constexpr (RECORDS) { stats_.pop(depth(j)); }
+    } else {
+      heap_erase(0);
+    }
+    drop_dead_top();
+  }
+  return out;
+}
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::extract_top() -> value_type {
+  migrate(migrate_step_);
+  table_type* t = &table_of(heap_[0]);
+  value_type p = move(t->get());
+  heap_erase(0);
+  erase_slot(t);
+  drop_dead_top();
+  return p;
+}
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::extract_bottom() -> value_type {
+  migrate(migrate_step_);
+  size_type j = bottom_index();
+  table_type* t = &table_of(heap_[j]);
+  value_type p = move(t->get());
+  heap_erase(j);
+  erase_slot(t);
+  return p;
+}
+// Destroys the table entry t and fills its slot by backward shifting
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+void kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::erase_slot(table_type* t) {
+  buckets& b = buckets_.owns(t) ? buckets_ : old_buckets_;
+  size_type i = t - b.table;
+  t->~table_type();
+  size_type shifts = 0;
+  for (size_type j = b.next(i); !b.free(j); j = b.next(j)) {
+    if (b.distance(j, b.hash_at(j)) >= b.distance(j, i)) {
+      new (b.table + i) table_type(move(b.table[j]));
+      b.table[j].~table_type();
+      b.set_hash_at(i, b.hash_at(j), b.ctrl()[j]);
+      b.relink(i, heap_);
+      i = j;
+      ++shifts;
+    } else {
+      break;
+    }
+  }
+  b.clear_hash_at(i);
+  stats_.erase(shifts);
+}
+
+// Heap
+// Moves heap_[j] towards the root until its parent does not compare less.
+// Returns its new index.
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::sift_up(size_type j)
+    -> size_type {
+  heap_type e = move(heap_[j]);
+  while (j && heap_less(heap_[parent(j)], e)) {
+    heap_[j] = move(heap_[parent(j)]);
+    relink(j);
+    j = parent(j);
+  }
+  heap_[j] = move(e);
+  relink(j);
+  return j;
+}
+// Moves heap_[j] towards the leaves until no child compares greater. Returns
+// its new index.
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::sift_down(size_type j)
+    -> size_type {
+  heap_type e = move(heap_[j]);
+  for (size_type c; (c = child(j)) < size_; j = c) {
+    for (size_type s = c + 1, end = std::min(c + D, size_); s < end; ++s) {
+      if (heap_less(heap_[c], heap_[s])) { c = s; }
+    }
+    if (!heap_less(e, heap_[c])) { break; }
+    heap_[j] = move(heap_[c]);
+    relink(j);
+  }
+  heap_[j] = move(e);
+  relink(j);
+  return j;
+}
+// Fills heap_[j], whose subheaps are valid, with e, which is placed no higher
+// than j. The better child moves up until the slot is a leaf and e then moves
+// up from there, as in Wegener's bottom-up heapsort: e usually comes from the
+// end of the heap and belongs near the leaves, so this compares children with
+// one another but seldom with e.
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::sift_hole(size_type j,
+                                                          heap_type&& e)
+    -> size_type {
+  size_type top = j;
+  for (size_type c; (c = child(j)) < size_; j = c) {
+    // Compilers choose the child without a branch, so nothing is loaded for
+    // the next levels until the choice is made unless it is fetched here: the
+    // heap entries two levels down and the table entries one level down
+    if (size_type g = child(child(c)); g < size_) {
+      __builtin_prefetch(heap_ + g);
+      __builtin_prefetch(heap_ + std::min(g + D * D * D, size_) - 1);
+    }
+    if (size_type g = child(c); g < size_) {
+      for (size_type x = g, end = std::min(g + D * D, size_); x < end; ++x) {
+        __builtin_prefetch(&table_of(heap_[x]));
+      }
+    }
+    for (size_type s = c + 1, end = std::min(c + D, size_); s < end; ++s) {
+      if (heap_less(heap_[c], heap_[s])) { c = s; }
+    }
+    heap_[j] = move(heap_[c]);
+    relink(j);
+  }
+  while (j > top && heap_less(heap_[parent(j)], e)) {
+    heap_[j] = move(heap_[parent(j)]);
+    relink(j);
+    j = parent(j);
+  }
+  heap_[j] = move(e);
+  relink(j);
+  return j;
+}
+// Restores the heap order after entries from index placed on were added
+// unsifted. Floyd's bottom-up construction takes O(size()) comparisons, so it
+// is used once the new entries are at least as many as the old ones.
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+void kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::heapify(size_type placed) {
+  if constexpr (RADIX || PAIRING) {
+    // Each new entry is pushed as though it had just been appended
+    for (size_type n = size_; placed < n; ++placed) {
+      size_ = placed + 1;
+      heap_push(placed);
+    }
+    return;
+  }
+  if (size_ - placed < placed) {
+    for (; placed < size_; ++placed) {
+      MINMAX ? minmax_fix(placed) : sift_up(placed);
+    }
+  } else if (size_ > 1) {
+    // Keys are compared through the table, so fetch the table entries of the
+    // children of a node a few nodes before sifting it
+    constexpr size_type AHEAD = 16;
+    for (size_type j = parent(size_ - 1) + 1; j--;) {
+      if (j >= AHEAD) {
+        __builtin_prefetch(&table_of(heap_[j - AHEAD]));
+        for (size_type c = child(j - AHEAD), e = std::min(c + D, size_); c < e;
+             ++c) {
+          __builtin_prefetch(&table_of(heap_[c]));
+        }
+      }
+      MINMAX ? minmax_down(j) : sift_down(j);
+    }
+  }
+  drop_dead_top();
+}
+
+// A max-heap of the indices whose parents, or in a min-max heap grandparents,
+// were reported holds the candidates for the next entry. It is at most
+// (D - 1) * n + 1 long in a D-ary heap. The buckets of a radix heap are
+// ordered among themselves, so they are only sorted one at a time until n
+// entries are found. Dead entries are not reported, but their children are
+// candidates.
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+template <typename F>
+void kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::best_first(size_type n,
+                                                           F&& f) const {
+  n = std::min(n, size());
+  if (!n) { return; }
+  auto less = [this](size_type x, size_type y) {
+    return heap_less(heap_[x], heap_[y]);
+  };
+  if constexpr (RADIX) {
+    f(0);
+    --n;
+    std::vector<size_type> run;
+    for (int b = 0; n; ++b) {
+      size_type s = radix_begin(b);
+      if (s == radix_.end[b]) { continue; }
+      run.resize(radix_.end[b] - s);
+      std::iota(run.begin(), run.end(), s);
+      auto mid = run.begin() + std::min(n, run.size());
+      std::partial_sort(run.begin(), mid, run.end(),
+                        [&](size_type x, size_type y) { return less(y, x); });
+      for (auto it = run.begin(); it != mid; ++it) { f(*it); }
+      n -= mid - run.begin();
+    }
     return;
   }
-  // new offset, table arrays
+  std::vector<size_type> frontier{0};
+  if constexpr (DARY) { frontier.reserve((D - 1) * n + 1); }
+  auto candidate = [&](size_type c) {
+    frontier.push_back(c);
+    std::push_heap(frontier.begin(), frontier.end(), less);
+  };
+  while (n) {
+    std::pop_heap(frontier.begin(), frontier.end(), less);
+    size_type j = frontier.back();
+    frontier.pop_back();
+    if (!dead(heap_[j])) {
+      f(j);
+      --n;
+    }
+    if constexpr (PAIRING) {
+      for (size_type c = node(j).child; c != NONE; c = node(c).next) {
+        candidate(c);
+      }
+    } else if constexpr (MINMAX) {
+      // Every entry below a high one is outranked by a grandchild of it or
+      // is a child of it, so low entries add no candidates
+      if (!minmax_high(j)) { continue; }
+      for (size_type c = child(j), e = std::min(c + 2, size_); c < e; ++c) {
+        candidate(c);
+      }
+      for (size_type g = child(child(j)), e = std::min(g + 4, size_); g < e;
+           ++g) {
+        candidate(g);
+      }
+    } else {
+      for (size_type c = child(j), e = std::min(c + D, size_); c < e; ++c) {
+        candidate(c);
+      }
+    }
+  }
+}
 
-  // TODO: check that operator new[] allocates bytes, not sizeof(T) natively
-  // TODO: heap_ should not be the same size as table_, but should instead grow
-  // like a vector
-  // TODO: don't move in copy construction / don't use table_type::make (use
-  // constructor instead)?
+// Heap policies
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::heap_push(size_type j)
+    -> size_type {
+  if constexpr (RADIX) {
+    const table_type& t = table_of(heap_[j]);
+    size_type moved = radix_push(j);
+    if constexpr (RECORDS) { stats_.push(moved); }
+    return t.index();
+  } else if constexpr (PAIRING) {
+    if constexpr (RECORDS) { stats_.push(1); }
+    return pairing_attach(j);
+  } else {
+    size_type k = MINMAX ? minmax_fix(j) : sift_up(j);
+    if constexpr (RECORDS) { stats_.push(depth(j) - depth(k)); }
+    return k;
+  }
+}
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+void kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::heap_erase(size_type j) {
+  if constexpr (RADIX) {
+    if (j) {
+      radix_to_end(j);
+      heap_[--size_].~heap_type();
+    } else {
+      size_type moved = radix_pop();
+      if constexpr (RECORDS) { stats_.pop(moved); }
+    }
+  } else if constexpr (PAIRING) {
+    size_type melds = 0;
+    if (j) { pairing_cut(j); }
+    size_type r = pairing_merge(j, melds), vacant = j;
+    if (r != NONE && !j) {
+      pairing_move(r, 0);
+      vacant = r;
+    } else if (r != NONE) {
+      pairing_attach(r);
+      ++melds;
+    }
+    if (vacant != --size_) { pairing_move(size_, vacant); }
+    heap_[size_].~heap_type();
+    if constexpr (RECORDS) {
+      if (!j) { stats_.pop(melds); }
+    }
+  } else {
+    if (j != --size_) {
+      heap_[j] = move(heap_[size_]);
+      relink(j);
+    }
+    heap_[size_].~heap_type();
+    size_type k = j;
+    if constexpr (MINMAX) {
+      if (j < size_) { k = minmax_fix(j); }
+    } else if (j < size_ && (k = sift_up(j)) == j) {
+      k = sift_down(j);
+    }
+    if constexpr (RECORDS) {
+      if (!j) { stats_.pop(depth(k)); }
+    }
+  }
+}
+// A pairing heap cuts out an entry whose priority rose and melds it with the
+// root. Otherwise its children may now outrank it, so they are melded and
+// put back first.
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::heap_update(size_type j,
+                                                            int direction)
+    -> size_type {
+  if constexpr (RADIX) {
+    const table_type& t = table_of(heap_[j]);
+    radix_update(j);
+    return t.index();
+  } else if constexpr (PAIRING) {
+    if (direction > 0) {
+      if (!j) { return 0; }
+      pairing_cut(j);
+      return pairing_attach(j);
+    }
+    size_type melds = 0;
+    if (j) { pairing_cut(j); }
+    size_type r = pairing_merge(j, melds);
+    if (!j) { return r != NONE && !pairing_attach(r) ? r : 0; }
+    if (r != NONE) { pairing_attach(r); }
+    return pairing_attach(j);
+  } else if constexpr (MINMAX) {
+    return minmax_fix(j);
+  } else {
+    if (direction > 0) { return sift_up(j); }
+    if (direction < 0) { return sift_down(j); }
+    if (size_type up = sift_up(j); up != j) { return up; }
+    return sift_down(j);
+  }
+}
 
-  // iterate through offset and arrays, starting at some element after a free
-  // element, moving the table value to its new position and setting the new
-  // hash at and table value
+// The top of a lazy_erase queue is always live, so that top() and begin()
+// need no check
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+void kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::drop_dead_top() {
+  if constexpr (LAZY) {
+    while (size_ && dead(heap_[0])) {
+      heap_erase(0);
+      --dead_;
+    }
+  }
+}
+// Moves the live entries to the front in order and heapifies them
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+void kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::compact() {
+  if constexpr (LAZY) {
+    if (!dead_) { return; }
+    size_type n = 0;
+    for (size_type j = 0; j < size_; ++j) {
+      if (dead(heap_[j])) { continue; }
+      if (n != j) { heap_[n] = move(heap_[j]); }
+      relink(n++);
+    }
+    for (size_type j = n; j < size_; ++j) { heap_[j].~heap_type(); }
+    size_ = n;
+    dead_ = 0;
+    heapify(0);
+  }
+}
 
-  // new substruct to store bucket_mask, capacity_, offset pointer, and table
-  // pointer and give it the next, etc... methods; get table_type* through
-  // private table(): allows not having to duplicate next() math
+// Radix heap
+// Places heap_[j], the last entry, which is in no bucket. An entry that goes
+// before the top swaps places with it and the top goes to a bucket instead.
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::radix_push(size_type j)
+    -> size_type {
+  if (size_ == 1) {
+    radix_.last = radix(heap_[0]);
+    std::fill(std::begin(radix_.end), std::end(radix_.end), 1);
+    return 0;
+  }
+  if (radix(heap_[j]) < radix(heap_[0])) {
+    heap_[0].swap(heap_[j]);
+    relink(0);
+  }
+  return radix_insert(j);
+}
+// Puts heap_[j], the last entry, which is in no bucket, in its bucket. Each
+// bucket after it gives its first entry to the slot past its end. A radix x
+// less than last becomes last: the entries of the buckets below
+// h = bit_width(x ^ last), which follow bucket h, differ from x first in bit
+// h - 1 and join bucket h, which is empty since last has that bit set, while
+// those of higher buckets stay where they are.
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::radix_insert(size_type j)
+    -> size_type {
+  std::uint64_t x = radix(heap_[j]);
+  assert(radix_.end[0] == j);
+  if (x < radix_.last) {
+    std::fill(radix_.end, radix_.end + radix_bucket(x) + 1, j);
+    radix_.last = x;
+  }
+  int b = radix_bucket(x);
+  heap_type e = move(heap_[j]);
+  size_type hole = j, moved = 0;
+  for (int i = 0; i < b; ++i) {
+    if (size_type s = radix_begin(i); s != hole) {
+      heap_[hole] = move(heap_[s]);
+      relink(hole);
+      hole = s;
+      ++moved;
+    }
+    ++radix_.end[i];
+  }
+  heap_[hole] = move(e);
+  relink(hole);
+  ++radix_.end[b];
+  return moved;
+}
+// Removes the top. The best entry of the lowest nonempty bucket, which is
+// last in the heap, takes its place and becomes last, so the rest of that
+// bucket is sorted into the buckets below it.
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::radix_pop()
+    -> size_type {
+  if (size_ == 1) {
+    heap_[--size_].~heap_type();
+    return 0;
+  }
+  int b = radix_lowest();
+  size_type s = radix_begin(b), p = s;
+  std::uint64_t m = radix(heap_[s]);
+  for (size_type i = s + 1; i < size_; ++i) {
+    if (std::uint64_t x = radix(heap_[i]); x < m) {
+      m = x;
+      p = i;
+    }
+  }
+  radix_.last = m;
+  heap_[0] = move(heap_[p]);
+  relink(0);
+  if (p != --size_) { heap_[p] = move(heap_[size_]); }
+  heap_[size_].~heap_type();
+  radix_distribute(s, b);
+  return size_ - s + 1;
+}
+// Moves heap_[j], for j > 0, to the end of the heap and out of the buckets.
+// The last entry of its bucket and of each bucket after it fills the slot
+// before. The entry is left for the caller to relink.
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::radix_to_end(size_type j)
+    -> size_type {
+  heap_type e = move(heap_[j]);
+  size_type hole = j, moved = 0;
+  for (int i = radix_bucket_of(j); i >= 0; --i) {
+    if (size_type last = radix_.end[i] - 1; last != hole) {
+      heap_[hole] = move(heap_[last]);
+      relink(hole);
+      hole = last;
+      ++moved;
+    }
+    --radix_.end[i];
+  }
+  heap_[hole] = move(e);
+  return moved;
+}
+// A top that falls behind the lowest nonempty bucket is replaced as a pop
+// would replace it, and then goes to a bucket itself
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+void kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::radix_update(size_type j) {
+  if (j) {
+    radix_to_end(j);
+    radix_push(size_ - 1);
+    return;
+  }
+  std::uint64_t x = radix(heap_[0]);
+  if (size_ == 1 || x < radix_.last) { return; }
+  int b = radix_lowest();
+  if (radix_bucket(x) < b) { return; }
+  size_type s = radix_begin(b), p = s;
+  std::uint64_t m = radix(heap_[s]);
+  for (size_type i = s + 1; i < size_; ++i) {
+    if (std::uint64_t y = radix(heap_[i]); y < m) {
+      m = y;
+      p = i;
+    }
+  }
+  if (x < m) {
+    radix_.last = x;
+    radix_distribute(s, b);
+    return;
+  }
+  radix_.last = m;
+  heap_[0].swap(heap_[p]);
+  relink(0);
+  if (radix_bucket(x) < b) {
+    radix_distribute(s, b);
+    return;
+  }
+  // The old top differs from m where it differed from the old last, so it
+  // stays above bucket b
+  heap_[p].swap(heap_[size_ - 1]);
+  --size_;
+  radix_distribute(s, b);
+  ++size_;
+  radix_insert(size_ - 1);
+}
+// Sorts heap_[s] to heap_[size_ - 1], whose radixes all fall in buckets 1
+// to b - 1, into those buckets and leaves bucket b empty. Counting the
+// entries of each bucket gives its slots, and each entry is then swapped into
+// a slot of its bucket, as in American flag sort.
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+void kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::radix_distribute(size_type s,
+                                                                 int b) {
+  size_type count[65] = {}, next[65];
+  for (size_type i = s; i < size_; ++i) {
+    ++count[radix_bucket(radix(heap_[i]))];
+  }
+  assert(!count[0]);
+  radix_.end[b] = s;
+  for (int i = b - 1, end = s; i >= 0; --i) {
+    next[i] = end;
+    radix_.end[i] = end += count[i];
+  }
+  for (int i = b - 1; i > 0; --i) {
+    while (next[i] < radix_.end[i]) {
+      if (int d = radix_bucket(radix(heap_[next[i]])); d == i) {
+        ++next[i];
+      } else {
+        assert(d < b);
+        heap_[next[i]].swap(heap_[next[d]++]);
+      }
+    }
+  }
+  for (size_type i = s; i < size_; ++i) { relink(i); }
+}
+// Pairing heap
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+void kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::pairing_cut(size_type j) {
+  pairing_node& n = node(j);
+  pairing_node& p = node(n.prev);
+  (p.child == j ? p.child : p.next) = n.next;
+  if (n.next != NONE) { node(n.next).prev = n.prev; }
+  n.prev = n.next = NONE;
+}
+// Two-pass pairing: the children are melded in pairs from the first, and the
+// pairs are then melded into one from the last. The pairs are chained
+// through next in reverse as they are made.
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::pairing_merge(size_type j,
+                                                              size_type& melds)
+    -> size_type {
+  size_type c = node(j).child, pairs = NONE;
+  node(j).child = NONE;
+  while (c != NONE) {
+    size_type a = c, b = node(a).next;
+    c = b == NONE ? NONE : size_type(node(b).next);
+    node(a).prev = node(a).next = NONE;
+    if (b != NONE) {
+      node(b).prev = node(b).next = NONE;
+      a = pairing_meld(a, b);
+      if constexpr (RECORDS) { ++melds; }
+    }
+    node(a).next = pairs;
+    pairs = a;
+  }
+  if (pairs == NONE) { return NONE; }
+  size_type r = pairs;
+  pairs = node(r).next;
+  node(r).next = NONE;
+  while (pairs != NONE) {
+    size_type a = pairs;
+    pairs = node(a).next;
+    node(a).next = NONE;
+    r = pairing_meld(r, a);
+    if constexpr (RECORDS) { ++melds; }
+  }
+  return r;
+}
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+void kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::pairing_move(size_type from,
+                                                             size_type to) {
+  heap_[to] = move(heap_[from]);
+  relink(to);
+  pairing_node& n = node(to);
+  if (n.prev != NONE) {
+    pairing_node& p = node(n.prev);
+    (p.child == from ? p.child : p.next) = to;
+  }
+  if (n.next != NONE) { node(n.next).prev = to; }
+  if (n.child != NONE) { node(n.child).prev = to; }
+}
+// A tree whose root outranks the heap's swaps places with the heap's root, so
+// the top stays at index 0
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::pairing_attach(size_type j)
+    -> size_type {
+  if (!j) { return 0; }
+  if (!heap_less(heap_[0], heap_[j])) {
+    pairing_link(0, j);
+    return j;
+  }
+  heap_[0].swap(heap_[j]);
+  relink(0);
+  relink(j);
+  for (size_type r : {size_type(0), j}) {
+    if (size_type c = node(r).child; c != NONE) { node(c).prev = r; }
+  }
+  pairing_link(0, j);
+  return 0;
+}
+
+// Min-max heap
+// Orders heap_[j] after it was pushed, replaced or given a new priority. An
+// entry that belongs above its parent on the parent's level swaps places with
+// it: the parent then belongs above none of j's descendants on j's level, so
+// it moves down from j, and the entry moves up among the parent's ancestors
+// on that level. Any other entry moves up among j's ancestors on j's level or
+// down from j.
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::minmax_fix(size_type j)
+    -> size_type {
+  bool high = minmax_high(j);
+  if (size_type p = parent(j); j && minmax_above(heap_[j], heap_[p], !high)) {
+    heap_[j].swap(heap_[p]);
+    relink(j);
+    relink(p);
+    minmax_down(j);
+    return minmax_up(p, !high);
+  }
+  if (size_type k = minmax_up(j, high); k != j) { return k; }
+  return minmax_down(j);
+}
+// Moves heap_[j] towards the root past the grandparents it belongs above
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::minmax_up(size_type j,
+                                                          bool high)
+    -> size_type {
+  heap_type e = move(heap_[j]);
+  while (j > 2) {
+    size_type g = parent(parent(j));
+    if (!minmax_above(e, heap_[g], high)) { break; }
+    heap_[j] = move(heap_[g]);
+    relink(j);
+    j = g;
+  }
+  heap_[j] = move(e);
+  relink(j);
+  return j;
+}
+// Moves heap_[j] towards the leaves, as Atkinson et al. trickle down: the
+// child or grandchild that belongs highest on j's level moves up while it
+// belongs above the entry. If it was a grandchild, its parent is on the other
+// level, and if the entry belongs above the parent there the two swap and the
+// parent goes on down instead.
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::minmax_down(size_type j)
+    -> size_type {
+  bool high = minmax_high(j);
+  heap_type e = move(heap_[j]);
+  size_type placed = size_;
+  for (size_type c; (c = child(j)) < size_;) {
+    size_type m = c;
+    if (c + 1 < size_ && minmax_above(heap_[c + 1], heap_[m], high)) {
+      m = c + 1;
+    }
+    for (size_type g = child(c), end = std::min(g + 4, size_); g < end; ++g) {
+      if (minmax_above(heap_[g], heap_[m], high)) { m = g; }
+    }
+    if (!minmax_above(heap_[m], e, high)) { break; }
+    heap_[j] = move(heap_[m]);
+    relink(j);
+    j = m;
+    if (m < child(c)) { break; }
+    if (size_type p = parent(m); minmax_above(e, heap_[p], !high)) {
+      e.swap(heap_[p]);
+      relink(p);
+      if (placed == size_) { placed = p; }
+    }
+  }
+  heap_[j] = move(e);
+  relink(j);
+  return placed == size_ ? j : placed;
+}
+
+// Hash policy
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+auto kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::probe_histogram() const
+    -> std::vector<size_type> {
+  std::vector<size_type> hist;
+  for (const buckets* b : {&buckets_, &old_buckets_}) {
+    if (!b->offset) { continue; }
+    for (size_type i = 0; i <= b->mask; ++i) {
+      if (b->free(i)) { continue; }
+      size_type d = b->distance(i, b->hash_at(i));
+      if (d >= hist.size()) { hist.resize(d + 1); }
+      ++hist[d];
+    }
+  }
+  return hist;
+}
 
-  // buckets_ = buckets; (operator= for buckets calls destructor?)
-  // capacity_ = get_capacity(max_load_factor_, bucket_mask_);
-  assert(table_capacity_ >= size_);
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+void kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::migrate(
+    size_type bucket_count) {
+  if (!migrating()) { return; }
+  for (; bucket_count && migrated_ <= old_buckets_.mask;
+       --bucket_count, ++migrated_) {
+    size_type i = (migrate_begin_ + migrated_) & old_buckets_.mask;
+    if (old_buckets_.free(i)) {
+      migrate_cluster_ = migrated_ + 1;
+      continue;
+    }
+    size_type h = old_buckets_.hash_at(i), j = buckets_.make_room(h, heap_);
+    buckets_.set_hash_at(j, h, old_buckets_.ctrl()[i]);
+    new (buckets_.table + j) table_type(move(old_buckets_.table[i]));
+    buckets_.relink(j, heap_);
+    old_buckets_.table[i].~table_type();
+    old_buckets_.clear_hash_at(i);
+  }
+  if (migrated_ > old_buckets_.mask) { deallocate(old_buckets_); }
+}
+
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+void kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::resize(Mask bucket_mask) {
+  migrate(-1);
+  while (std::min(get_capacity(max_load_factor_, bucket_mask),
+                  size_type(bucket_mask)) < size()) {
+    bucket_mask = Mask(bucket_mask + 1);
+  }
+  table_capacity_ = std::min(get_capacity(max_load_factor_, bucket_mask),
+                             size_type(bucket_mask));
+  if (bucket_mask == buckets_.mask) { return; }
+
+  resizing r(*this);
+  old_buckets_ = buckets_;
+  std::uintptr_t anchor = anchor_;
+  buckets_ = allocate(bucket_mask);
+  if (!size_) {
+    deallocate(old_buckets_);
+    return;
+  }
+  // Start after a free slot so that no probe sequence wraps past the slots
+  // that are migrated first.
+  migrate_begin_ = 0;
+  while (!old_buckets_.free(migrate_begin_)) { ++migrate_begin_; }
+  migrate_begin_ = old_buckets_.next(migrate_begin_);
+  migrated_ = migrate_cluster_ = 0;
+  // Every insertion until the new table is full migrates migrate_step_
+  // buckets, which empties the old table in time.
+  size_type room = table_capacity_ - size();
+  migrate_step_ = room ? (size_type(old_buckets_.mask) + room) / room
+                       : old_buckets_.mask + 1;
+  // The entries of the old table cannot be found from a new anchor
+  if (!room || anchor_ != anchor) { migrate(-1); }
+}
+
+// Moves the heap into an array of heap_capacity slots. This is a single
+// sequential pass with no hashing or probing, so unlike the table it is not
+// spread over later operations. Heap entries stay at their indices, so their
+// table entries need no relinking, and those of trivially copyable priorities
+// are copied as bytes.
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+void kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::reallocate_heap(
+    size_type heap_capacity) {
+  assert(heap_capacity >= size_);
+  resizing r(*this);
+  heap_type* heap = allocate_heap(heap_capacity);
+  intrusive::relocate_range(heap_, heap, size_);
+  deallocate_heap(heap_, heap_capacity_);
+  heap_ = heap;
+  heap_capacity_ = heap_capacity;
+  release_image();
 }
 
 // Non-member functions
-template <typename K, typename V, typename H, typename EQ, typename C>
-bool kvpq<K, V, H, EQ, C>::operator==(const kvpq& o) const {
+// Walks o's tables in slot order and looks each entry up by the hash o stored
+// for it, so no key is rehashed. Where the tables have the same bucket mask,
+// an entry is usually in the same slot of both, which is checked before
+// probing.
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A, typename S, typename HP,
+          typename ER>
+bool kvpq<K, V, H, EQ, C, D, PR, A, S, HP, ER>::operator==(
+    const kvpq& o) const {
   if (this == &o) { return true; }
-  if (hash_ != o.hash_ || key_equal_ != o.key_equal_ || comp_ != o.comp_ ||
-      size_ != o.size_) {
-    return false;
-  }
-  // TODO: use knowledge of hashes to avoid rehashing
-  for (auto it = o.begin(); it != o.end(); ++o) {
-    if (auto item = find(it->first);
-        item == end() || !key_eq_(item->second, it->second)) {
-      return false;
+  if (size() != o.size()) { return false; }
+  for (const buckets* b : {&o.buckets_, &o.old_buckets_}) {
+    if (!b->offset) { continue; }
+    bool aligned = b->mask == buckets_.mask;
+    for (size_type i = 0; i <= b->mask; ++i) {
+      if (b->free(i)) { continue; }
+      const std::pair<K, V>& e = b->table[i];
+      const table_type* t = buckets_.table + i;
+      if (!aligned || buckets_.free(i) ||
+          std::uint32_t(buckets_.hash_at(i)) != std::uint32_t(b->hash_at(i)) ||
+          !key_equal_((*t)->first, e.first)) {
+        t = lookup(e.first, b->hash_at(i), b->ctrl()[i]);
+      }
+      if (!t || !((*t)->second == e.second)) { return false; }
     }
   }
   return true;
@@ -1,11 +1,88 @@
 // A combination of an unordered map and a priority queue
 #pragma once
 
-#include <functional> // equal_to, hash, less
+#include <cstddef>         // size_t
+#include <cstdint>         // uint64_t
+#include <functional>      // equal_to, hash, less
+#include <memory>          // allocator
+#include <memory_resource> // polymorphic_allocator
+#include <type_traits>     // conditional_t, is_trivially_copyable_v
+#include <utility>         // pair
 
 namespace ds {
+struct inline_key;
+struct no_stats;
+struct dary_heap;
+struct eager_erase;
+
+// The PRIORITY of a kvpq that does not choose one. Keys that are trivially
+// copyable and no larger than a word are copied into their heap entries, so
+// the heap holds (key, table position) and is sifted without reading the
+// table. Larger keys are kept only in the table, and a heap entry is just the
+// table position.
+template <typename K>
+using default_priority =
+    std::conditional_t<std::is_trivially_copyable_v<K> &&
+                           sizeof(K) <= sizeof(std::uint64_t),
+                       inline_key, void>;
+
+// ARITY is the number of children of each heap node. Unless PRIORITY is void,
+// heap entries cache PRIORITY()(key), which COMPARE must accept (std::less<>
+// does), so sifting compares them without reading the table. The projection
+// must preserve order; keys whose projections are equivalent are compared in
+// full. ALLOCATOR provides the memory of the tables and the heap. STATS
+// records the work of each operation (see kvpq_stats); no_stats records
+// nothing and costs nothing. HEAP orders the heap: dary_heap, the implicit
+// heap of ARITY, radix_heap for integer keys that mostly arrive in priority
+// order, pairing_heap for queues that change priorities often, or
+// minmax_heap, which also gives the entry of lowest priority (see
+// bounded_kvpq). ERASE says when erased entries leave the heap: eager_erase
+// at once, or lazy_erase when they reach the top or the heap is compacted.
+// Entries are linked by 32-bit indices whatever the size type, so a kvpq
+// holds at most max_size() = 2^31 - 1 entries and throws std::length_error
+// rather than grow past it.
 template <typename K, typename V, typename HASH = std::hash<K>,
           typename KEY_EQUAL = std::equal_to<K>,
-          typename COMPARE = std::less<K>>
+          typename COMPARE = std::less<K>, std::size_t ARITY = 2,
+          typename PRIORITY = default_priority<K>,
+          typename ALLOCATOR = std::allocator<std::pair<K, V>>,
+          typename STATS = no_stats, typename HEAP = dary_heap,
+          typename ERASE = eager_erase>
 class kvpq;
+
+// A kvpq split into shards that threads can use concurrently
+template <typename K, typename V, typename HASH = std::hash<K>,
+          typename KEY_EQUAL = std::equal_to<K>,
+          typename COMPARE = std::less<K>, std::size_t ARITY = 2,
+          typename PRIORITY = default_priority<K>,
+          typename ALLOCATOR = std::allocator<std::pair<K, V>>>
+class sharded_kvpq;
+
+// A kvpq of at most a fixed number of entries, which evicts the entry of
+// lowest priority to make room
+template <typename K, typename V, typename HASH = std::hash<K>,
+          typename KEY_EQUAL = std::equal_to<K>,
+          typename COMPARE = std::less<K>,
+          typename PRIORITY = default_priority<K>,
+          typename ALLOCATOR = std::allocator<std::pair<K, V>>>
+class bounded_kvpq;
+
+// A kvpq that threads can read without locking while one thread writes
+template <typename K, typename V, typename HASH = std::hash<K>,
+          typename KEY_EQUAL = std::equal_to<K>,
+          typename COMPARE = std::less<K>, std::size_t ARITY = 2,
+          typename PRIORITY = default_priority<K>,
+          typename ALLOCATOR = std::allocator<std::pair<K, V>>>
+class swmr_kvpq;
+
+namespace pmr {
+template <typename K, typename V, typename HASH = std::hash<K>,
+          typename KEY_EQUAL = std::equal_to<K>,
+          typename COMPARE = std::less<K>, std::size_t ARITY = 2,
+          typename PRIORITY = default_priority<K>, typename STATS = no_stats,
+          typename HEAP = dary_heap, typename ERASE = eager_erase>
+using kvpq = ds::kvpq<K, V, HASH, KEY_EQUAL, COMPARE, ARITY, PRIORITY,
+                      std::pmr::polymorphic_allocator<std::pair<K, V>>, STATS,
+                      HEAP, ERASE>;
+}
 }
@@ -0,0 +1,91 @@
+// A file mapped into memory
+#pragma once
+
+#include <cerrno>       // errno
+#include <cstddef>      // size_t
+#include <filesystem>   // path
+#include <functional>   // less
+#include <system_error> // generic_category, system_error
+#include <utility>      // exchange, move, swap
+
+#include <fcntl.h>    // O_*, open
+#include <sys/mman.h> // MAP_*, PROT_*, mmap, munmap
+#include <sys/stat.h> // fstat
+#include <unistd.h>   // close, ftruncate
+
+namespace ds {
+
+// Owns a mapping of a whole file, which it unmaps when destroyed. The file
+// descriptor is closed as soon as the file is mapped.
+class mapped_file {
+ public:
+  mapped_file() noexcept = default;
+  mapped_file(mapped_file&& o) noexcept
+      : data_(std::exchange(o.data_, nullptr)),
+        size_(std::exchange(o.size_, 0)) {}
+  mapped_file& operator=(mapped_file&& o) noexcept {
+    mapped_file(std::move(o)).swap(*this);
+    return *this;
+  }
+  ~mapped_file() {
+    if (data_) { munmap(data_, size_); }
+  }
+
+  // Creates the file at path, or truncates it, with size zero bytes and maps
+  // it for writing
+  static mapped_file create(const std::filesystem::path& path,
+                            std::size_t size) {
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) { fail("open"); }
+    if (ftruncate(fd, off_t(size))) { fail("ftruncate", fd); }
+    return map(fd, size, MAP_SHARED);
+  }
+  // Maps the file at path privately: its pages are read on demand, and
+  // writes go to copies of them rather than to the file
+  static mapped_file open(const std::filesystem::path& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { fail("open"); }
+    struct stat st;
+    if (fstat(fd, &st)) { fail("fstat", fd); }
+    return map(fd, std::size_t(st.st_size), MAP_PRIVATE);
+  }
+
+  [[nodiscard]] char* data() const noexcept { return data_; }
+  [[nodiscard]] std::size_t size() const noexcept { return size_; }
+  explicit operator bool() const noexcept { return data_; }
+  // Whether p points into the mapping
+  [[nodiscard]] bool contains(const void* p) const noexcept {
+    auto c = static_cast<const char*>(p);
+    return data_ && !std::less<const char*>()(c, data_) &&
+           std::less<const char*>()(c, data_ + size_);
+  }
+  void swap(mapped_file& o) noexcept {
+    std::swap(data_, o.data_);
+    std::swap(size_, o.size_);
+  }
+
+ private:
+  // Closes fd, if any, and throws the error in errno
+  [[noreturn]] static void fail(const char* what, int fd = -1) {
+    int e = errno;
+    if (fd >= 0) { close(fd); }
+    throw std::system_error(e, std::generic_category(), what);
+  }
+  // Maps and closes fd. Empty files have no mapping.
+  static mapped_file map(int fd, std::size_t size, int flags) {
+    mapped_file f;
+    if (size) {
+      void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+      if (p == MAP_FAILED) { fail("mmap", fd); }
+      f.data_ = static_cast<char*>(p);
+      f.size_ = size;
+    }
+    close(fd);
+    return f;
+  }
+
+  char* data_ = nullptr;
+  std::size_t size_ = 0;
+};
+
+} // namespace ds
@@ -0,0 +1,275 @@
+// A kvpq partitioned by hash into independently locked shards
+#pragma once
+
+#include <algorithm>  // max, min, partial_sort
+#include <atomic>     // atomic, memory_order_relaxed
+#include <cstddef>    // size_t
+#include <cstdint>    // uint64_t
+#include <functional> // equal_to, hash, less
+#include <iterator>   // back_inserter
+#include <memory>     // unique_ptr
+#include <mutex>      // lock_guard, mutex, scoped_lock, try_lock, unique_lock
+#include <optional>   // nullopt, optional
+#include <thread>     // hardware_concurrency, this_thread
+#include <utility>    // forward, move, pair
+#include <vector>     // vector
+
+#include "kvpq.hpp"
+
+namespace ds {
+
+// Each key belongs to the shard its hash picks, so find, insert and erase lock
+// one shard and threads working on different shards do not contend. Results
+// are values rather than iterators, which would outlive the lock.
+//
+// try_pop is relaxed, as in the MultiQueues of Rihani, Sanders and Dementiev:
+// it pops the better top of two random shards, so the popped entry's expected
+// rank among all entries is O(shard_count()) rather than 1. top(k) is the exact
+// k best entries when no other thread is modifying the queue.
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A>
+class sharded_kvpq {
+ public:
+  using kvpq_type = kvpq<K, V, H, EQ, C, D, PR, A>;
+  using key_type = K;
+  using mapped_type = V;
+  using value_type = std::pair<K, V>;
+  using size_type = std::size_t;
+  using hasher = H;
+  using key_equal = EQ;
+  using value_compare = C;
+  using allocator_type = A;
+
+  // Four shards per hardware thread, so that two threads seldom want the same
+  // shard
+  [[nodiscard]] static size_type default_shard_count() {
+    return 4 * std::max(std::thread::hardware_concurrency(), 1u);
+  }
+
+  // Each of the shards starts with bucket_count buckets
+  explicit sharded_kvpq(
+      size_type shard_count = default_shard_count(),
+      size_type bucket_count = kvpq_type::DEFAULT_BUCKET_COUNT,
+      const H& hash = H(), const EQ& key_equal = EQ(), const C& comp = C(),
+      const A& alloc = A())
+      : hash_(hash), comp_(comp),
+        shard_count_(std::max(shard_count, size_type(1))),
+        shards_(new shard[shard_count_]) {
+    for (size_type i = 0; i < shard_count_; ++i) {
+      shards_[i].q = kvpq_type(bucket_count, hash, key_equal, comp, alloc);
+    }
+  }
+  sharded_kvpq(const sharded_kvpq&) = delete;
+  sharded_kvpq& operator=(const sharded_kvpq&) = delete;
+
+  // Modifiers
+  // These return whether an entry was added
+  bool insert(const value_type& p) { return emplace(p); }
+  bool insert(value_type&& p) { return emplace(std::move(p)); }
+  template <typename... ARGS> bool emplace(ARGS&&... args) {
+    value_type p(std::forward<ARGS>(args)...);
+    shard& s = shard_of(p.first);
+    std::lock_guard<std::mutex> lock(s.m);
+    bool fresh = s.q.emplace(std::move(p)).second;
+    s.publish_size();
+    return fresh;
+  }
+  template <typename M> bool insert_or_assign(const K& k, M&& v) {
+    shard& s = shard_of(k);
+    std::lock_guard<std::mutex> lock(s.m);
+    bool fresh = s.q.insert_or_assign(k, std::forward<M>(v)).second;
+    s.publish_size();
+    return fresh;
+  }
+  size_type erase(const K& k) {
+    shard& s = shard_of(k);
+    std::lock_guard<std::mutex> lock(s.m);
+    size_type erased = s.q.erase(k);
+    s.publish_size();
+    return erased;
+  }
+  // Gives the entry with key old the key k, which may move it to another
+  // shard. Returns false and changes nothing if there is no entry with key old
+  // or another one has key k.
+  bool update(const K& old, K k);
+  // Removes and returns an entry near the top, or nothing if the queue is
+  // empty
+  std::optional<value_type> try_pop();
+  void clear();
+
+  // Lookup
+  std::optional<V> find(const K& k) const {
+    const shard& s = shard_of(k);
+    std::lock_guard<std::mutex> lock(s.m);
+    if (auto it = s.q.find(k); it != s.q.end()) { return it->second; }
+    return std::nullopt;
+  }
+  bool contains(const K& k) const {
+    const shard& s = shard_of(k);
+    std::lock_guard<std::mutex> lock(s.m);
+    return s.q.contains(k);
+  }
+  // Calls f on the value of key k while its shard is locked. Returns whether
+  // there is such an entry.
+  template <typename F> bool visit(const K& k, F&& f) {
+    shard& s = shard_of(k);
+    std::lock_guard<std::mutex> lock(s.m);
+    if (auto it = s.q.find(k); it != s.q.end()) {
+      std::forward<F>(f)(it->second);
+      return true;
+    }
+    return false;
+  }
+  // Copies of the k entries of highest priority, highest first. Each shard is
+  // read under its own lock, so entries that move while this runs may be
+  // missed or seen twice.
+  std::vector<value_type> top(size_type k) const;
+
+  // Capacity
+  // Exact only when no other thread is modifying the queue
+  [[nodiscard]] bool empty() const noexcept { return !size(); }
+  size_type size() const noexcept {
+    size_type n = 0;
+    for (size_type i = 0; i < shard_count_; ++i) {
+      n += shards_[i].size.load(std::memory_order_relaxed);
+    }
+    return n;
+  }
+  size_type shard_count() const noexcept { return shard_count_; }
+
+  // Observers
+  H hash_function() const { return hash_; }
+  C comp_function() const { return comp_; }
+
+ private:
+  inline static constexpr std::size_t CACHE_LINE = 64;
+  // size mirrors q.size() so that empty shards can be skipped without locking
+  struct alignas(CACHE_LINE) shard {
+    mutable std::mutex m;
+    std::atomic<size_type> size{0};
+    kvpq_type q;
+
+    void publish_size() { size.store(q.size(), std::memory_order_relaxed); }
+  };
+
+  // kvpq takes its home buckets from the low bits of the hash and its control
+  // bytes from the high bits of its product with the golden ratio, so the
+  // shard comes from a different mix of the hash for the keys of a shard to
+  // spread over both
+  [[nodiscard]] size_type shard_index(const K& k) const {
+    std::uint64_t x = hash_(k);
+    x = (x ^ (x >> 31)) * 0xbf58476d1ce4e5b9;
+    return size_type(((x ^ (x >> 27)) >> 32) * shard_count_ >> 32);
+  }
+  [[nodiscard]] shard& shard_of(const K& k) { return shards_[shard_index(k)]; }
+  [[nodiscard]] const shard& shard_of(const K& k) const {
+    return shards_[shard_index(k)];
+  }
+  // A shard drawn by a generator of the calling thread
+  [[nodiscard]] size_type random_shard() const {
+    thread_local std::uint64_t state =
+        std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return size_type((state >> 32) * shard_count_ >> 32);
+  }
+  // Moves the top of s out and pops it. s must be locked and not empty.
+  static value_type pop(shard& s) {
+    value_type p = s.q.extract_top();
+    s.publish_size();
+    return p;
+  }
+
+  [[no_unique_address]] H hash_;
+  [[no_unique_address]] C comp_;
+  size_type shard_count_;
+  std::unique_ptr<shard[]> shards_;
+};
+
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A>
+bool sharded_kvpq<K, V, H, EQ, C, D, PR, A>::update(const K& old, K k) {
+  shard& s = shard_of(old);
+  shard& t = shard_of(k);
+  if (&s == &t) {
+    std::lock_guard<std::mutex> lock(s.m);
+    return s.q.update(old, std::move(k)).second;
+  }
+  std::scoped_lock lock(s.m, t.m);
+  auto it = s.q.find(old);
+  if (it == s.q.end() || t.q.contains(k)) { return false; }
+  V v = std::move(it->second);
+  s.q.erase(it);
+  t.q.emplace(std::move(k), std::move(v));
+  s.publish_size();
+  t.publish_size();
+  return true;
+}
+
+// Locks two random shards without waiting and pops the better top. After as
+// many failed attempts as there are shards, which happens when most shards are
+// empty or contended, every shard is tried in turn.
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A>
+auto sharded_kvpq<K, V, H, EQ, C, D, PR, A>::try_pop()
+    -> std::optional<value_type> {
+  if (shard_count_ > 1) {
+    for (size_type attempt = 0; attempt < shard_count_; ++attempt) {
+      size_type i = random_shard(), j = random_shard();
+      if (i == j) { j = (j + 1) % shard_count_; }
+      shard& a = shards_[i];
+      shard& b = shards_[j];
+      if (!a.size.load(std::memory_order_relaxed) &&
+          !b.size.load(std::memory_order_relaxed)) {
+        continue;
+      }
+      std::unique_lock<std::mutex> la(a.m, std::defer_lock);
+      std::unique_lock<std::mutex> lb(b.m, std::defer_lock);
+      if (std::try_lock(la, lb) != -1) { continue; }
+      if (a.q.empty() && b.q.empty()) { continue; }
+      bool first = b.q.empty() ||
+                   (!a.q.empty() && !comp_(a.q.top().first, b.q.top().first));
+      return pop(first ? a : b);
+    }
+  }
+  for (size_type n = 0, i = random_shard(); n < shard_count_;
+       ++n, i = (i + 1) % shard_count_) {
+    shard& s = shards_[i];
+    std::lock_guard<std::mutex> lock(s.m);
+    if (!s.q.empty()) { return pop(s); }
+  }
+  return std::nullopt;
+}
+
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A>
+void sharded_kvpq<K, V, H, EQ, C, D, PR, A>::clear() {
+  for (size_type i = 0; i < shard_count_; ++i) {
+    std::lock_guard<std::mutex> lock(shards_[i].m);
+    shards_[i].q.clear();
+    shards_[i].publish_size();
+  }
+}
+
+// Takes the k best entries of each shard and keeps the k best of those
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A>
+auto sharded_kvpq<K, V, H, EQ, C, D, PR, A>::top(size_type k) const
+    -> std::vector<value_type> {
+  std::vector<value_type> best;
+  for (size_type i = 0; i < shard_count_ && k; ++i) {
+    const shard& s = shards_[i];
+    std::lock_guard<std::mutex> lock(s.m);
+    s.q.top_k(k, std::back_inserter(best));
+  }
+  k = std::min(k, best.size());
+  std::partial_sort(best.begin(), best.begin() + k, best.end(),
+                    [this](const value_type& a, const value_type& b) {
+                      return comp_(b.first, a.first);
+                    });
+  best.resize(k);
+  return best;
+}
+
+} // namespace ds
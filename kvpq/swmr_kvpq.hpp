@@ -0,0 +1,194 @@
+// A kvpq that many threads can read without locks while one thread writes
+#pragma once
+
+#include <algorithm>   // max
+#include <atomic>      // atomic
+#include <cstddef>     // size_t
+#include <functional>  // equal_to, hash, less
+#include <memory>      // unique_ptr
+#include <mutex>       // lock_guard, mutex
+#include <optional>    // nullopt, optional
+#include <stdexcept>   // out_of_range
+#include <thread>      // hardware_concurrency, this_thread
+#include <type_traits> // invoke_result_t, is_void_v
+#include <utility>     // forward, move, pair
+
+#include "kvpq.hpp"
+
+namespace ds {
+
+// Left-right concurrency control, from Ramalhete and Correia, "Left-Right: A
+// Concurrency Control Technique with Wait-Free Population Oblivious Reads".
+// There are two replicas of the queue. Readers announce themselves in a read
+// indicator and use the replica that the writer is not modifying, so they
+// never lock, retry or see a partial update. The writer applies each change
+// to the other replica, switches readers to it, waits for the readers still on
+// the old replica to leave and then applies the change to that one too. A
+// replica is only resized while no reader can reach it, so its old arrays are
+// freed immediately.
+//
+// Writes cost twice as much as on a kvpq, plus two scans of the read
+// indicator. write(f) applies several changes per switch. Writers are
+// serialized by a mutex, which is uncontended with a single writer.
+template <typename K, typename V, typename H, typename EQ, typename C,
+          std::size_t D, typename PR, typename A>
+class swmr_kvpq {
+ public:
+  using kvpq_type = kvpq<K, V, H, EQ, C, D, PR, A>;
+  using key_type = K;
+  using mapped_type = V;
+  using value_type = std::pair<K, V>;
+  using size_type = std::size_t;
+  using hasher = H;
+  using key_equal = EQ;
+  using value_compare = C;
+  using allocator_type = A;
+
+  // reader_slots is the number of counters in each read indicator. Readers
+  // sharing a counter contend on it, and the writer reads every counter twice
+  // per switch.
+  explicit swmr_kvpq(
+      size_type bucket_count = kvpq_type::DEFAULT_BUCKET_COUNT,
+      const H& hash = H(), const EQ& key_equal = EQ(), const C& comp = C(),
+      const A& alloc = A(),
+      size_type reader_slots =
+          std::max(std::thread::hardware_concurrency(), 1u))
+      : replicas_{kvpq_type(bucket_count, hash, key_equal, comp, alloc),
+                  kvpq_type(bucket_count, hash, key_equal, comp, alloc)},
+        reader_slots_(std::max(reader_slots, size_type(1))),
+        readers_(new counter[2 * reader_slots_]) {}
+  swmr_kvpq(const swmr_kvpq&) = delete;
+  swmr_kvpq& operator=(const swmr_kvpq&) = delete;
+
+  // Reading, from any thread
+  // Calls f with the replica that readers currently use and returns its
+  // result. f must not keep references into the replica.
+  template <typename F> decltype(auto) read(F&& f) const {
+    reading r(*this);
+    return std::forward<F>(f)(replicas_[left_right_.load()]);
+  }
+  std::optional<V> find(const K& k) const {
+    return read([&](const kvpq_type& q) -> std::optional<V> {
+      if (auto it = q.find(k); it != q.end()) { return it->second; }
+      return std::nullopt;
+    });
+  }
+  bool contains(const K& k) const {
+    return read([&](const kvpq_type& q) { return q.contains(k); });
+  }
+  V at(const K& k) const {
+    if (auto v = find(k)) { return *std::move(v); }
+    throw std::out_of_range("V swmr_kvpq::at(const K&) const");
+  }
+  std::optional<value_type> top() const {
+    return read([](const kvpq_type& q) -> std::optional<value_type> {
+      if (q.empty()) { return std::nullopt; }
+      return q.top();
+    });
+  }
+  size_type size() const {
+    return read([](const kvpq_type& q) { return q.size(); });
+  }
+  [[nodiscard]] bool empty() const { return !size(); }
+
+  // Writing
+  // Calls f with each replica in turn and returns its first result. f must
+  // make the same change to both, which it does if it only calls kvpq members
+  // with the same arguments.
+  template <typename F> decltype(auto) write(F&& f) {
+    std::lock_guard<std::mutex> lock(writer_);
+    if constexpr (std::is_void_v<std::invoke_result_t<F&, kvpq_type&>>) {
+      f(back());
+      publish();
+      f(back());
+    } else {
+      auto result = f(back());
+      publish();
+      f(back());
+      return result;
+    }
+  }
+  bool insert(const value_type& p) {
+    return write([&](kvpq_type& q) { return q.insert(p).second; });
+  }
+  template <typename M> bool insert_or_assign(const K& k, const M& v) {
+    return write(
+        [&](kvpq_type& q) { return q.insert_or_assign(k, v).second; });
+  }
+  size_type erase(const K& k) {
+    return write([&](kvpq_type& q) { return q.erase(k); });
+  }
+  bool update(const K& old, const K& k) {
+    return write([&](kvpq_type& q) { return q.update(old, k).second; });
+  }
+  // Removes and returns the top entry, or nothing if the queue is empty
+  std::optional<value_type> pop() {
+    return write([](kvpq_type& q) -> std::optional<value_type> {
+      if (q.empty()) { return std::nullopt; }
+      value_type p = q.top();
+      q.pop();
+      return p;
+    });
+  }
+  void clear() {
+    write([](kvpq_type& q) { q.clear(); });
+  }
+
+ private:
+  inline static constexpr std::size_t CACHE_LINE = 64;
+  struct alignas(CACHE_LINE) counter {
+    std::atomic<size_type> n{0};
+  };
+  // Counts a reader in the read indicator of the current version for as long
+  // as it lives
+  class reading {
+   public:
+    explicit reading(const swmr_kvpq& q)
+        : c_(q.readers_[q.version_.load() * q.reader_slots_ +
+                        q.reader_slot()]) {
+      ++c_.n;
+    }
+    reading(const reading&) = delete;
+    reading& operator=(const reading&) = delete;
+    ~reading() { --c_.n; }
+
+   private:
+    counter& c_;
+  };
+
+  [[nodiscard]] size_type reader_slot() const {
+    thread_local size_type slot =
+        std::hash<std::thread::id>()(std::this_thread::get_id());
+    return slot % reader_slots_;
+  }
+  // The replica that readers do not use. Only the writer calls this.
+  [[nodiscard]] kvpq_type& back() {
+    return replicas_[!left_right_.load(std::memory_order_relaxed)];
+  }
+  void wait_for_readers(int version) const {
+    for (size_type i = 0; i < reader_slots_; ++i) {
+      while (readers_[version * reader_slots_ + i].n.load()) {
+        std::this_thread::yield();
+      }
+    }
+  }
+  // Sends new readers to the replica just written and waits until no reader
+  // uses the other, first on one version's read indicator and then on the
+  // other's, so that readers arriving meanwhile cannot starve the writer
+  void publish() {
+    left_right_.store(!left_right_.load(std::memory_order_relaxed));
+    int version = version_.load(std::memory_order_relaxed);
+    wait_for_readers(!version);
+    version_.store(!version);
+    wait_for_readers(version);
+  }
+
+  kvpq_type replicas_[2];
+  std::atomic<int> left_right_{0};
+  std::atomic<int> version_{0};
+  size_type reader_slots_;
+  std::unique_ptr<counter[]> readers_;
+  std::mutex writer_;
+};
+
+} // namespace ds
@@ -0,0 +1,97 @@
+#include <catch2/catch.hpp>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+
+#include "bounded_kvpq.hpp"
+
+using IntIntBounded = ds::bounded_kvpq<int, int>;
+
+TEST_CASE("bounded operations", "[bounded_kvpq]") {
+  IntIntBounded p(100);
+  REQUIRE(p.max_size() == 100);
+  REQUIRE(p.empty());
+  std::mt19937 gen(5);
+  std::uniform_int_distribution<int> key(0, 5000);
+  std::map<int, int> m;
+  std::size_t capacity = p.queue().capacity();
+  for (int n = 0; n < 20000; ++n) {
+    int k = key(gen);
+    switch (n % 8) {
+    case 0: REQUIRE(p.erase(k) == m.erase(k)); break;
+    case 1:
+      if (!m.empty()) {
+        REQUIRE(p.top() == std::pair<int, int>(*m.rbegin()));
+        p.pop();
+        m.erase(std::prev(m.end()));
+      }
+      break;
+    case 2:
+      if (!m.empty()) {
+        REQUIRE(p.bottom() == std::pair<int, int>(*m.begin()));
+        p.pop_bottom();
+        m.erase(m.begin());
+      }
+      break;
+    case 3: {
+      bool fresh = !m.count(k);
+      m[k] = n;
+      auto evicted = p.insert_or_assign(k, n);
+      if (fresh && m.size() > 100) {
+        REQUIRE(evicted == std::pair<int, int>(*m.begin()));
+        m.erase(m.begin());
+      } else {
+        REQUIRE(!evicted);
+      }
+      break;
+    }
+    default: {
+      bool fresh = m.insert({k, n}).second;
+      auto evicted = p.push({k, n});
+      if (fresh && m.size() > 100) {
+        REQUIRE(evicted == std::pair<int, int>(*m.begin()));
+        m.erase(m.begin());
+      } else {
+        REQUIRE(!evicted);
+      }
+    }
+    }
+    REQUIRE(p.size() == m.size());
+    if (!m.empty()) {
+      REQUIRE(p.top().first == m.rbegin()->first);
+      REQUIRE(p.bottom().first == m.begin()->first);
+    }
+  }
+  for (auto& [k, v] : m) { REQUIRE(p.at(k) == v); }
+  // The arrays were sized for the bound up front
+  REQUIRE(p.queue().capacity() == capacity);
+}
+
+TEST_CASE("bounded eviction", "[bounded_kvpq]") {
+  // A new entry below every other one in a full queue is turned away
+  ds::bounded_kvpq<int, std::unique_ptr<int>> p(3);
+  for (int k : {5, 1, 9}) { REQUIRE(!p.emplace(k, std::make_unique<int>(k))); }
+  auto evicted = p.emplace(0, std::make_unique<int>(0));
+  REQUIRE(evicted->first == 0);
+  REQUIRE(*evicted->second == 0);
+  evicted = p.emplace(7, std::make_unique<int>(7));
+  REQUIRE(evicted->first == 1);
+  REQUIRE(*evicted->second == 1);
+  REQUIRE(p.bottom().first == 5);
+  REQUIRE(p.top().first == 9);
+
+  // Keys too large to cache in the heap, ordered in reverse
+  ds::bounded_kvpq<std::string, int, std::hash<std::string>,
+                   std::equal_to<std::string>, std::greater<std::string>>
+      q(2);
+  q.push({"b", 0});
+  q.push({"c", 0});
+  REQUIRE(q.push({"a", 0})->first == "c");
+  REQUIRE(q.top().first == "a");
+  REQUIRE(q.bottom().first == "b");
+
+  ds::bounded_kvpq<int, int> none(0);
+  REQUIRE(none.push({1, 1})->first == 1);
+  REQUIRE(none.empty());
+}
@@ -1,10 +1,26 @@
+#include <algorithm>
 #include <catch2/catch.hpp>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <iterator>
 #include <limits>
+#include <map>
+#include <memory_resource>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
 #include <variant>
+#include <vector>
 
+#include "huge_page_allocator.hpp"
 #include "kvpq.hpp"
 
+#include <sys/mman.h>
+
 using ds::kvpq;
 using IntStringKvpq = kvpq<int, std::string>;
 
@@ -40,7 +56,7 @@ TEST_CASE("insert", "[kvpq]") {
   REQUIRE(p.find(3) != p.end());
   REQUIRE(p.find(4) == p.end());
   REQUIRE(p.size() == 2);
-  REQUIRE(p.capacity() == 4);
+  REQUIRE(p.capacity() == 8);
   REQUIRE(p[2] == "bcd");
   REQUIRE(p[3] == "abcd");
   REQUIRE(p.size() == 2);
@@ -51,9 +67,1241 @@ TEST_CASE("insert", "[kvpq]") {
   REQUIRE(p.find(4) == p.end());
   REQUIRE(p.find(5) != p.end());
   REQUIRE(p.size() == 3);
-  REQUIRE(p.capacity() == 4);
+  REQUIRE(p.capacity() == 8);
   REQUIRE(p[2] == "bcd");
   REQUIRE(p[3] == "abcd");
   REQUIRE(p[5] == "cd");
   REQUIRE(p.size() == 3);
 }
+
+TEST_CASE("pop", "[kvpq]") {
+  IntStringKvpq p;
+  for (int i : {5, 3, 8, 1, 9, 2, 7, 4, 6, 0}) {
+    p.push({i, std::to_string(i)});
+  }
+  REQUIRE(p.size() == 10);
+  for (int i = 9; i >= 0; --i) {
+    REQUIRE(p.top().first == i);
+    REQUIRE(p.top().second == std::to_string(i));
+    p.pop();
+    REQUIRE(p.find(i) == p.end());
+    REQUIRE(p.size() == size_t(i));
+  }
+  REQUIRE(p.empty());
+
+  // extract_top moves the top out, and keys only in the table stay intact
+  auto key = [](int i) {
+    return "a key too long to be stored inline " + std::to_string(100 + i);
+  };
+  kvpq<std::string, int> q;
+  for (int i = 0; i < 100; ++i) { q.push({key(i), i}); }
+  for (int i = 99; i >= 0; --i) {
+    auto [k, v] = q.extract_top();
+    REQUIRE(v == i);
+    REQUIRE(k == key(i));
+    REQUIRE(!q.contains(k));
+    for (const auto& [other, value] : q) { REQUIRE(q.at(other) == value); }
+  }
+  REQUIRE(q.empty());
+}
+
+TEST_CASE("erase", "[kvpq]") {
+  IntStringKvpq p;
+  for (int i = 0; i < 100; ++i) { p.insert({i * 7 % 100, std::to_string(i)}); }
+  REQUIRE(p.size() == 100);
+  for (int i = 0; i < 100; i += 3) { REQUIRE(p.erase(i) == 1); }
+  REQUIRE(p.erase(0) == 0);
+  REQUIRE(p.size() == 66);
+  for (int i = 0; i < 100; ++i) { REQUIRE(p.contains(i) == bool(i % 3)); }
+  for (int i = 98; i >= 0; --i) {
+    if (i % 3) {
+      REQUIRE(p.top().first == i);
+      p.pop();
+    }
+  }
+  REQUIRE(p.empty());
+}
+
+TEST_CASE("incremental rehash", "[kvpq]") {
+  kvpq<int, int> p(16);
+  int n = 0;
+  while (!p.rehashing()) {
+    p.insert({n, n});
+    ++n;
+  }
+  REQUIRE(p.capacity() > 16);
+
+  // Entries are found in whichever table they are in
+  kvpq<int, int> q = p;
+  for (int i = 0; i < n; ++i) {
+    REQUIRE(q.contains(i));
+    REQUIRE(q.at(i) == i);
+  }
+  const int last = n - 1;
+  REQUIRE(p.erase(0) == 1);
+  REQUIRE(p.erase(last) == 1);
+  REQUIRE(!p.contains(0));
+  REQUIRE(!p.contains(last));
+
+  while (p.rehashing()) {
+    p.insert({n, n});
+    ++n;
+  }
+  REQUIRE(p.size() == size_t(n - 2));
+  for (int i = 1; i < n; ++i) { REQUIRE(p.contains(i) == (i != last)); }
+  for (int i = n; i-- > 1;) {
+    if (i != last) {
+      REQUIRE(p.top().first == i);
+      REQUIRE(p.top().second == i);
+      p.pop();
+    }
+  }
+  REQUIRE(p.empty());
+}
+
+TEST_CASE("growth", "[kvpq]") {
+  kvpq<int, int> p;
+  std::vector<int> keys(10000);
+  for (int i = 0; i < 10000; ++i) { keys[i] = i * 7919 % 10007; }
+  for (int k : keys) { REQUIRE(p.insert({k, -k}).second); }
+  REQUIRE(!p.insert({keys[0], 0}).second);
+  REQUIRE(p.size() == keys.size());
+  REQUIRE(p.capacity() >= keys.size());
+  for (int k : keys) { REQUIRE(p[k] == -k); }
+  p.clear();
+  REQUIRE(p.empty());
+  REQUIRE(p.find(keys[0]) == p.end());
+}
+
+TEST_CASE("equality and copies", "[kvpq]") {
+  kvpq<int, int> p(16);
+  int n = 0;
+  while (!p.rehashing()) {
+    p.insert({n, -n});
+    ++n;
+  }
+  // Copied in the middle of a rehash, and once it is done
+  kvpq<int, int> q = p;
+  REQUIRE(q == p);
+  REQUIRE(p == q);
+  REQUIRE(!(p != q));
+  p.rehash(p.capacity());
+  REQUIRE(!p.rehashing());
+  kvpq<int, int> r = p;
+  REQUIRE(r == p);
+  REQUIRE(r == q);
+  for (int i = n; i-- > 0;) {
+    REQUIRE(r.top().first == i);
+    REQUIRE(r.top().second == -i);
+    r.pop();
+  }
+  r = p;
+  REQUIRE(r == p);
+
+  // The same entries inserted in another order into a table of another size
+  kvpq<int, int> s(1024);
+  for (int i = n; i-- > 0;) { s.insert({i, -i}); }
+  REQUIRE(s == p);
+  REQUIRE(p == s);
+  REQUIRE(s == q);
+  s[0] = 1;
+  REQUIRE(s != p);
+  REQUIRE(q != s);
+  s.erase(0);
+  REQUIRE(s != p);
+  s.insert({n, 0});
+  REQUIRE(s != p);
+  REQUIRE(p != s);
+
+  kvpq<int, std::string> a{{1, "a"}, {2, "b"}};
+  kvpq<int, std::string> b{{2, "b"}, {1, "a"}};
+  REQUIRE(a == b);
+  b[2] = "c";
+  REQUIRE(a != b);
+  swap(a, b);
+  REQUIRE(a.at(2) == "c");
+  REQUIRE(b.at(2) == "b");
+}
+
+// Pops every entry of p, checking them against m in priority order
+template <typename Q> void drain(Q& p, const std::map<int, int>& m) {
+  REQUIRE(p.size() == m.size());
+  for (auto it = m.rbegin(); it != m.rend(); ++it) {
+    REQUIRE(p.top().first == it->first);
+    REQUIRE(p.top().second == it->second);
+    p.pop();
+  }
+  REQUIRE(p.empty());
+}
+
+TEST_CASE("bulk insertion", "[kvpq]") {
+  std::mt19937 gen(9);
+  std::uniform_int_distribution<int> key(0, 3000);
+  std::vector<std::pair<int, int>> items;
+  std::map<int, int> m;
+  for (int i = 0; i < 2000; ++i) { items.push_back({key(gen), i}); }
+  // Sorted runs sift every entry to the root if inserted one at a time
+  for (int i = 0; i < 500; ++i) { items.push_back({3001 + i, i}); }
+  for (auto [k, v] : items) { m.insert({k, v}); }
+
+  kvpq<int, int> p(items.begin(), items.end());
+  REQUIRE(p.capacity() >= m.size());
+  auto copy = p;
+  drain(p, m);
+
+  kvpq<int, int> q;
+  q.merge(copy);
+  REQUIRE(copy.size() == m.size());
+  auto moved = copy;
+  kvpq<int, int> r;
+  r.merge(std::move(moved));
+  REQUIRE(moved.empty());
+  drain(q, m);
+  drain(r, m);
+
+  // A few entries into a large heap are sifted up one at a time
+  p.assign(items.begin(), items.begin() + 1500);
+  std::map<int, int> n(m);
+  std::map<int, int> first;
+  for (auto it = items.begin(); it != items.begin() + 1500; ++it) {
+    first.insert(*it);
+  }
+  p.insert(items.begin() + 1500, items.end());
+  drain(p, n);
+
+  p.assign({{1, 10}, {3, 30}, {2, 20}, {3, 31}});
+  drain(p, {{1, 10}, {2, 20}, {3, 30}});
+  p.assign(first.begin(), first.end());
+  drain(p, first);
+
+  kvpq<int, int> l{{5, 50}, {4, 40}, {6, 60}, {5, 51}};
+  drain(l, {{4, 40}, {5, 50}, {6, 60}});
+}
+
+TEST_CASE("probe histogram", "[kvpq]") {
+  kvpq<int, int> p;
+  REQUIRE(p.probe_histogram().empty());
+  p.max_load_factor(20);
+  for (int i = 0; i < 10000; ++i) { p.insert({i * 7919 % 10007, i}); }
+  auto hist = p.probe_histogram();
+  REQUIRE(!hist.empty());
+  REQUIRE(hist.back() > 0);
+  size_t total = 0;
+  for (size_t count : hist) { total += count; }
+  REQUIRE(total == p.size());
+}
+
+TEST_CASE("random operations", "[kvpq]") {
+  std::mt19937 gen(42);
+  std::uniform_int_distribution<int> key(0, 2000), op(0, 9);
+  kvpq<int, int> p(2);
+  std::map<int, int> m;
+  for (int n = 0; n < 20000; ++n) {
+    int k = key(gen);
+    switch (op(gen)) {
+    case 0:
+    case 1:
+      REQUIRE(p.erase(k) == m.erase(k));
+      break;
+    case 2:
+      if (!m.empty()) {
+        REQUIRE(p.top().first == m.rbegin()->first);
+        REQUIRE(p.top().second == m.rbegin()->second);
+        p.pop();
+        m.erase(std::prev(m.end()));
+      }
+      break;
+    case 3: REQUIRE(p.contains(k) == m.count(k)); break;
+    default: REQUIRE(p.insert({k, n}).second == m.insert({k, n}).second);
+    }
+    REQUIRE(p.size() == m.size());
+  }
+  for (auto [k, v] : m) { REQUIRE(p.at(k) == v); }
+}
+
+// Hashes whose clusters span many groups of control bytes and wrap around the
+// table: equal for runs of 64 keys, or all with home bucket 0
+struct runs {
+  std::size_t operator()(int k) const { return k / 64; }
+};
+struct home_zero {
+  std::size_t operator()(int k) const { return std::size_t(k) << 40; }
+};
+
+template <typename HASH> void check_clusters() {
+  std::mt19937 gen(5);
+  std::uniform_int_distribution<int> key(0, 1000), op(0, 3);
+  kvpq<int, int, HASH> p;
+  std::map<int, int> m;
+  for (int n = 0; n < 5000; ++n) {
+    int k = key(gen);
+    switch (op(gen)) {
+    case 0: REQUIRE(p.erase(k) == m.erase(k)); break;
+    case 1: REQUIRE(p.contains(k) == m.count(k)); break;
+    default: REQUIRE(p.insert({k, n}).second == m.insert({k, n}).second);
+    }
+  }
+  for (auto [k, v] : m) { REQUIRE(p.at(k) == v); }
+}
+
+struct counted_equal {
+  bool operator()(int a, int b) const {
+    ++calls;
+    return a == b;
+  }
+  inline static int calls = 0;
+};
+
+TEST_CASE("long clusters", "[kvpq]") {
+  check_clusters<runs>();
+  check_clusters<home_zero>();
+
+  // Keys that share a home bucket still differ in their control bytes, which
+  // mix in the high bits of the hash, so a miss compares few keys
+  kvpq<int, int, home_zero, counted_equal> p;
+  for (int k = 0; k < 1000; ++k) { p.insert({k, k}); }
+  counted_equal::calls = 0;
+  REQUIRE(!p.contains(1000));
+  REQUIRE(counted_equal::calls < 50);
+}
+
+struct counted_hash {
+  std::size_t operator()(int k) const {
+    ++calls;
+    return std::hash<int>()(k);
+  }
+  inline static int calls = 0;
+};
+
+TEST_CASE("update", "[kvpq]") {
+  IntStringKvpq p;
+  for (int i = 0; i < 100; ++i) { p.insert({i * 2, std::to_string(i)}); }
+
+  auto [it, updated] = p.update(10, 201);
+  REQUIRE(updated);
+  REQUIRE(it == p.begin());
+  REQUIRE(it->second == "5");
+  REQUIRE(!p.contains(10));
+  REQUIRE(p.at(201) == "5");
+
+  REQUIRE(!p.update(12, 14).second);
+  REQUIRE(p.update(12, 14).first == p.find(14));
+  REQUIRE(p.at(12) == "6");
+  REQUIRE(p.update(13, 15).first == p.end());
+
+  it = p.decrease_key(p.begin(), -1).first;
+  REQUIRE(it->first == -1);
+  REQUIRE(p.top().first == 198);
+  it = p.increase_key(p.find(0), 199).first;
+  REQUIRE(it == p.begin());
+  REQUIRE(p.at(199) == "0");
+  it = p.increase_key(p.find(198), 198).first;
+  REQUIRE(it->second == "99");
+
+  std::vector<int> keys;
+  while (!p.empty()) {
+    keys.push_back(p.top().first);
+    p.pop();
+  }
+  REQUIRE(std::is_sorted(keys.rbegin(), keys.rend()));
+  REQUIRE(keys.size() == 100);
+  REQUIRE(keys.front() == 199);
+  REQUIRE(keys.back() == -1);
+
+  // The new key is hashed once
+  kvpq<int, int, counted_hash> q{{1, 1}, {2, 2}};
+  int calls = counted_hash::calls;
+  REQUIRE(q.update(q.begin(), 3).second);
+  REQUIRE(counted_hash::calls == calls + 1);
+}
+
+TEST_CASE("random updates", "[kvpq]") {
+  std::mt19937 gen(7);
+  std::uniform_int_distribution<int> key(0, 5000);
+  kvpq<int, int> p(2);
+  std::map<int, int> m;
+  for (int i = 0; i < 500; ++i) {
+    int k = key(gen);
+    p.insert({k, i});
+    m.insert({k, i});
+  }
+  for (int n = 0; n < 20000; ++n) {
+    auto it = std::next(m.begin(), gen() % m.size());
+    int k = key(gen);
+    bool fresh = !m.count(k);
+    REQUIRE(p.update(it->first, k).second == (fresh || k == it->first));
+    if (fresh) {
+      m.insert({k, it->second});
+      m.erase(it);
+    }
+    REQUIRE(p.top().first == m.rbegin()->first);
+  }
+  for (auto [k, v] : m) { REQUIRE(p.at(k) == v); }
+}
+
+template <std::size_t D> void check_arity() {
+  std::mt19937 gen(D);
+  std::uniform_int_distribution<int> key(0, 3000);
+  kvpq<int, int, std::hash<int>, std::equal_to<int>, std::less<int>, D> p;
+  std::map<int, int> m;
+  for (int n = 0; n < 10000; ++n) {
+    int k = key(gen);
+    if (n % 3 == 2 && !m.empty()) {
+      REQUIRE(p.top().first == m.rbegin()->first);
+      p.pop();
+      m.erase(std::prev(m.end()));
+    } else if (n % 7 == 3) {
+      REQUIRE(p.erase(k) == m.erase(k));
+    } else {
+      REQUIRE(p.insert({k, n}).second == m.insert({k, n}).second);
+    }
+  }
+  while (!m.empty()) {
+    REQUIRE(p.top().first == m.rbegin()->first);
+    REQUIRE(p.top().second == m.rbegin()->second);
+    p.pop();
+    m.erase(std::prev(m.end()));
+  }
+  REQUIRE(p.empty());
+}
+
+TEST_CASE("arity", "[kvpq]") {
+  check_arity<2>();
+  check_arity<3>();
+  check_arity<4>();
+  check_arity<8>();
+}
+
+// Drops the low bits of a key, so the full keys break ties
+struct coarse {
+  int operator()(int k) const { return k / 16; }
+};
+
+template <typename PR> void check_priority() {
+  std::mt19937 gen(11);
+  std::uniform_int_distribution<int> key(0, 3000);
+  kvpq<int, int, std::hash<int>, std::equal_to<int>, std::less<>, 2, PR> p;
+  std::map<int, int> m;
+  for (int n = 0; n < 10000; ++n) {
+    int k = key(gen);
+    if (n % 3 == 2 && !m.empty()) {
+      REQUIRE(p.top().first == m.rbegin()->first);
+      p.pop();
+      m.erase(std::prev(m.end()));
+    } else if (n % 5 == 1 && !m.empty()) {
+      auto it = std::next(m.begin(), gen() % m.size());
+      if (!m.count(k)) {
+        REQUIRE(p.update(it->first, k).second);
+        m.insert({k, it->second});
+        m.erase(it);
+      }
+    } else {
+      REQUIRE(p.insert({k, n}).second == m.insert({k, n}).second);
+    }
+  }
+  auto copy = p;
+  for (auto* q : {&p, &copy}) {
+    for (auto it = m.rbegin(); it != m.rend(); ++it) {
+      REQUIRE(q->top().first == it->first);
+      REQUIRE(q->top().second == it->second);
+      q->pop();
+    }
+    REQUIRE(q->empty());
+  }
+}
+
+TEST_CASE("inline priority", "[kvpq]") {
+  check_priority<ds::inline_key>();
+  check_priority<coarse>();
+  check_priority<void>();
+  // Small trivially copyable keys are cached by default
+  REQUIRE(std::is_same_v<ds::default_priority<int>, ds::inline_key>);
+  REQUIRE(std::is_same_v<kvpq<std::uint64_t, int>,
+                         kvpq<std::uint64_t, int, std::hash<std::uint64_t>,
+                              std::equal_to<std::uint64_t>,
+                              std::less<std::uint64_t>, 2, ds::inline_key>>);
+  REQUIRE(std::is_void_v<ds::default_priority<std::string>>);
+}
+
+// Counts the bytes of upstream it has outstanding
+struct counting_resource : std::pmr::memory_resource {
+  void* do_allocate(std::size_t bytes, std::size_t align) override {
+    outstanding += bytes;
+    ++allocations;
+    return std::pmr::new_delete_resource()->allocate(bytes, align);
+  }
+  void do_deallocate(void* p, std::size_t bytes, std::size_t align) override {
+    outstanding -= bytes;
+    std::pmr::new_delete_resource()->deallocate(p, bytes, align);
+  }
+  bool do_is_equal(const memory_resource& o) const noexcept override {
+    return this == &o;
+  }
+  std::size_t outstanding = 0, allocations = 0;
+};
+
+template <typename Q> void check_drain(Q& p, int n) {
+  REQUIRE(p.size() == std::size_t(n));
+  for (int k = n; k--;) {
+    REQUIRE(p.top().first == k);
+    REQUIRE(p.top().second == -k);
+    p.pop();
+  }
+  REQUIRE(p.empty());
+}
+
+TEST_CASE("statistics", "[kvpq]") {
+  using StatsKvpq =
+      kvpq<int, int, std::hash<int>, std::equal_to<int>, std::less<int>, 2,
+           ds::default_priority<int>, std::allocator<std::pair<int, int>>,
+           ds::kvpq_stats>;
+  static_assert(std::is_same_v<
+                kvpq<int, int>,
+                kvpq<int, int, std::hash<int>, std::equal_to<int>,
+                     std::less<int>, 2, ds::default_priority<int>,
+                     std::allocator<std::pair<int, int>>, ds::no_stats>>);
+
+  ds::kvpq_histogram hist;
+  for (int x : {0, 1, 2, 3, 4, 1000}) { hist.record(x); }
+  REQUIRE(hist.count() == 6);
+  REQUIRE(hist.sum == 1010);
+  REQUIRE(hist.counts[0] == 1);
+  REQUIRE(hist.counts[1] == 1);
+  REQUIRE(hist.counts[2] == 2);
+  REQUIRE(hist.counts[3] == 1);
+  REQUIRE(hist.counts[10] == 1);
+
+  // Each key is greater than the others, so it rises to the root
+  StatsKvpq p;
+  const int n = 1000;
+  std::uint64_t depths = 0;
+  for (int i = 0; i < n; ++i) {
+    REQUIRE(p.insert({i, i}).second);
+    for (int j = i; j; j = (j - 1) / 2) { ++depths; }
+  }
+  REQUIRE(!p.insert({0, 0}).second);
+  const ds::kvpq_stats& s = p.stats();
+  REQUIRE(s.emplace_probes.count() == n + 1);
+  REQUIRE(s.emplace_probes.sum >= n + 1);
+  REQUIRE(s.push_levels.count() == n);
+  REQUIRE(s.push_levels.sum == depths);
+  REQUIRE(s.resize_ns.count() > 0);
+  REQUIRE(s.find_probes.count() == 0);
+
+  for (int i = 0; i < 2 * n; ++i) { REQUIRE(p.contains(i) == (i < n)); }
+  REQUIRE(s.find_probes.count() == 2 * n);
+  REQUIRE(s.find_probes.counts[0] == 0);
+
+  // Copies start over and moves take the counts
+  StatsKvpq copy = p;
+  REQUIRE(copy.stats().push_levels.count() == 0);
+  StatsKvpq moved = std::move(p);
+  REQUIRE(moved.stats().push_levels.count() == n);
+  for (int i = 0; i < n / 2; ++i) { moved.pop(); }
+  std::vector<std::pair<int, int>> out;
+  moved.pop_k(n, std::back_inserter(out));
+  REQUIRE(moved.empty());
+  REQUIRE(moved.stats().pop_levels.count() == n);
+  REQUIRE(moved.stats().erase_shifts.count() == n);
+}
+
+TEST_CASE("allocator", "[kvpq]") {
+  using PmrKvpq = ds::pmr::kvpq<int, int>;
+  counting_resource r, s;
+  {
+    PmrKvpq p(&r);
+    REQUIRE(p.get_allocator().resource() == &r);
+    for (int k = 0; k < 5000; ++k) { p.insert({k, -k}); }
+    REQUIRE(r.allocations > 0);
+    REQUIRE(r.outstanding > 0);
+
+    // A copy uses the default resource and a move keeps the allocator
+    PmrKvpq copy = p;
+    REQUIRE(copy.get_allocator().resource() ==
+            std::pmr::get_default_resource());
+    check_drain(copy, 5000);
+    PmrKvpq moved = std::move(p);
+    REQUIRE(moved.get_allocator().resource() == &r);
+
+    // Moving to another resource moves the entries, and the source only frees
+    // a table it was migrating from
+    std::size_t held = r.outstanding;
+    PmrKvpq other(std::move(moved), &s);
+    REQUIRE(r.outstanding <= held);
+    REQUIRE(r.outstanding > 0);
+    REQUIRE(moved.empty());
+    REQUIRE(s.outstanding > 0);
+    // Assignment does not propagate polymorphic allocators
+    PmrKvpq assigned(&r);
+    assigned = other;
+    REQUIRE(assigned.get_allocator().resource() == &r);
+    check_drain(other, 5000);
+    check_drain(assigned, 5000);
+  }
+  REQUIRE(r.outstanding == 0);
+  REQUIRE(s.outstanding == 0);
+
+  // Entries that are not trivially copyable, moved in the middle of a rehash
+  {
+    ds::pmr::kvpq<int, std::string> p(&r);
+    int n = 0;
+    for (; n < 100 || !p.rehashing(); ++n) { p.insert({n, std::to_string(n)}); }
+    ds::pmr::kvpq<int, std::string> q(std::move(p), &s);
+    REQUIRE(p.empty());
+    REQUIRE(!q.rehashing());
+    p.insert({-1, "-1"});
+    REQUIRE(p.size() == 1);
+    REQUIRE(q.size() == std::size_t(n));
+    for (int k = n; k--;) {
+      REQUIRE(q.at(k) == std::to_string(k));
+      REQUIRE(q.top().first == k);
+      q.pop();
+    }
+  }
+  REQUIRE(r.outstanding == 0);
+  REQUIRE(s.outstanding == 0);
+
+  // Everything from an arena, released at once
+  std::pmr::monotonic_buffer_resource arena(&r);
+  {
+    PmrKvpq p(&arena);
+    for (int k = 0; k < 5000; ++k) { p.insert({k, -k}); }
+    check_drain(p, 5000);
+  }
+  REQUIRE(r.outstanding > 0);
+  arena.release();
+  REQUIRE(r.outstanding == 0);
+}
+
+// Maps each block a terabyte past the last, beyond the reach of 32-bit links
+struct distant_resource : std::pmr::memory_resource {
+  void* do_allocate(std::size_t bytes, std::size_t) override {
+    next += std::uintptr_t(1) << 40;
+    void* p = mmap(reinterpret_cast<void*>(next), bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) { throw std::bad_alloc(); }
+    distant += p == reinterpret_cast<void*>(next);
+    return p;
+  }
+  void do_deallocate(void* p, std::size_t bytes, std::size_t) override {
+    munmap(p, bytes);
+  }
+  bool do_is_equal(const memory_resource& o) const noexcept override {
+    return this == &o;
+  }
+  std::uintptr_t next = std::uintptr_t(1) << 45;
+  std::size_t distant = 0;
+};
+
+TEST_CASE("distant tables", "[kvpq]") {
+  // Each new table is out of reach of the old one, so the old one is
+  // migrated at once
+  distant_resource r;
+  ds::pmr::kvpq<int, int> p(&r);
+  for (int k = 0; k < 5000; ++k) {
+    p.insert({k, -k});
+    REQUIRE(p.find(k)->second == -k);
+    if (k % 7 == 0) { REQUIRE(p.erase(k / 2) == 1); }
+  }
+  REQUIRE(r.distant > 0);
+  for (int k = 0; k < 5000; ++k) {
+    if (!p.contains(k)) { p.insert({k, -k}); }
+  }
+  check_drain(p, 5000);
+}
+
+TEST_CASE("huge page allocator", "[kvpq]") {
+  using HugeKvpq =
+      kvpq<int, int, std::hash<int>, std::equal_to<int>, std::less<int>, 2,
+           void, ds::huge_page_allocator<std::pair<int, int>>>;
+  // Large enough for the tables and the heap to be mapped
+  HugeKvpq p;
+  p.reserve(1 << 17);
+  for (int k = 0; k < 1 << 17; ++k) { p.insert({k, -k}); }
+  HugeKvpq copy = p;
+  check_drain(p, 1 << 17);
+  check_drain(copy, 1 << 17);
+}
+
+// A key that counts how many are made
+struct tracked {
+  explicit tracked(int k) : k(k) { ++made; }
+  tracked(const tracked& o) : k(o.k) { ++made; }
+  bool operator<(const tracked& o) const { return k < o.k; }
+  int k;
+  inline static int made = 0;
+};
+struct tracked_hash {
+  using is_transparent = void;
+  std::size_t operator()(const tracked& t) const { return (*this)(t.k); }
+  std::size_t operator()(int k) const { return std::hash<int>()(k); }
+};
+struct tracked_equal {
+  using is_transparent = void;
+  template <typename A, typename B>
+  bool operator()(const A& a, const B& b) const {
+    return key(a) == key(b);
+  }
+  static int key(const tracked& t) { return t.k; }
+  static int key(int k) { return k; }
+};
+
+TEST_CASE("transparent lookup", "[kvpq]") {
+  kvpq<tracked, int, tracked_hash, tracked_equal> p;
+  for (int k = 0; k < 1000; ++k) { p.emplace(tracked(k), -k); }
+  // Lookups migrate entries while the queue is rehashing, which copies keys
+  // that cannot be moved, so it is finished first
+  while (p.rehashing()) { p.find(0); }
+  const auto& q = p;
+  int made = tracked::made;
+  for (int k = 0; k < 1000; ++k) {
+    REQUIRE(p.find(k)->second == -k);
+    REQUIRE(q.find(k)->first.k == k);
+    REQUIRE(p.at(k) == -k);
+    REQUIRE(q.at(k) == -k);
+    REQUIRE(p.contains(k));
+    REQUIRE(p.count(k) == 1);
+  }
+  REQUIRE(p.find(1000) == p.end());
+  REQUIRE(!p.contains(-1));
+  REQUIRE(p.count(-1) == 0);
+  REQUIRE_THROWS_AS(p.at(1000), std::out_of_range);
+  for (int k = 0; k < 1000; k += 2) { REQUIRE(p.erase(k) == 1); }
+  REQUIRE(p.erase(0) == 0);
+  REQUIRE(p.size() == 500);
+  REQUIRE(tracked::made == made);
+  // Lookups with a key still work
+  REQUIRE(p.find(tracked(1))->second == -1);
+  REQUIRE(p.erase(tracked(1)) == 1);
+  REQUIRE(p.top().first.k == 999);
+  // string_views find std::string keys
+  struct string_hash {
+    using is_transparent = void;
+    std::size_t operator()(std::string_view s) const {
+      return std::hash<std::string_view>()(s);
+    }
+  };
+  kvpq<std::string, int, string_hash, std::equal_to<>> r{
+      {"abc", 1}, {"a long key that is not stored inline", 2}};
+  REQUIRE(r.at(std::string_view("abc")) == 1);
+  REQUIRE(r.find("a long key that is not stored inline")->second == 2);
+  REQUIRE(r.at(std::string("abc")) == 1);
+}
+
+TEST_CASE("batch operations", "[kvpq]") {
+  kvpq<int, int> p;
+  std::map<int, int> m;
+  std::mt19937 gen(13);
+  std::uniform_int_distribution<int> key(0, 20000);
+  for (int round = 0; round < 20; ++round) {
+    std::vector<std::pair<int, int>> items(gen() % 600);
+    std::size_t fresh = 0;
+    for (auto& [k, v] : items) {
+      k = key(gen);
+      v = round;
+      fresh += m.insert({k, v}).second;
+    }
+    REQUIRE(p.insert_batch(items) == fresh);
+    REQUIRE(p.size() == m.size());
+
+    std::vector<int> keys(gen() % 600);
+    for (int& k : keys) { k = key(gen); }
+    std::vector<kvpq<int, int>::iterator> found(keys.size(), p.end());
+    p.find_batch(keys, found);
+    const auto& c = p;
+    std::vector<kvpq<int, int>::const_iterator> cfound(keys.size(), c.end());
+    c.find_batch(keys, cfound);
+    for (std::size_t i = 0; i < keys.size(); ++i) {
+      REQUIRE(found[i] == cfound[i]);
+      if (auto it = m.find(keys[i]); it == m.end()) {
+        REQUIRE(found[i] == p.end());
+      } else {
+        REQUIRE(found[i]->first == keys[i]);
+        REQUIRE(found[i]->second == it->second);
+      }
+    }
+
+    keys.resize(keys.size() / 2);
+    std::size_t erased = 0;
+    for (int k : keys) { erased += m.erase(k); }
+    REQUIRE(p.erase_batch(keys) == erased);
+    REQUIRE(p.size() == m.size());
+    REQUIRE(p.top().first == m.rbegin()->first);
+  }
+  while (!m.empty()) {
+    REQUIRE(p.top().first == m.rbegin()->first);
+    REQUIRE(p.top().second == m.rbegin()->second);
+    p.pop();
+    m.erase(std::prev(m.end()));
+  }
+}
+
+template <typename HP, typename C = std::less<int>,
+          typename ER = ds::eager_erase>
+using HeapKvpq =
+    kvpq<int, int, std::hash<int>, std::equal_to<int>, C, 2,
+         ds::default_priority<int>, std::allocator<std::pair<int, int>>,
+         ds::no_stats, HP, ER>;
+using LazyKvpq = HeapKvpq<ds::dary_heap, std::less<int>, ds::lazy_erase>;
+
+// Random operations of every kind against a map in the queue's order, whose
+// last entry is the top. Keys drift in the direction of the order, as times
+// in an event loop do, unless drift is 0.
+template <typename HP, typename C, typename ER = ds::eager_erase>
+void check_heap(int drift) {
+  std::mt19937 gen(17 + drift);
+  std::uniform_int_distribution<int> delta(-1000, 1000), op(0, 15);
+  HeapKvpq<HP, C, ER> p(2);
+  std::map<int, int, C> m;
+  int now = 0;
+  auto key = [&] { return now + delta(gen); };
+  for (int n = 0; n < 30000; ++n) {
+    switch (op(gen)) {
+    case 0:
+    case 1:
+    case 2:
+      if (!m.empty()) {
+        REQUIRE(p.top() == std::pair<int, int>(*m.rbegin()));
+        p.pop();
+        m.erase(std::prev(m.end()));
+        now -= drift;
+      }
+      break;
+    case 3: {
+      int k = key();
+      REQUIRE(p.erase(k) == m.erase(k));
+      break;
+    }
+    case 4:
+    case 5:
+      if (!m.empty()) {
+        auto it = std::next(m.begin(), gen() % m.size());
+        int k = key();
+        bool fresh = !m.count(k);
+        auto [e, updated] = p.update(it->first, k);
+        REQUIRE(updated == (fresh || k == it->first));
+        REQUIRE(e->first == k);
+        if (fresh) {
+          m.insert({k, it->second});
+          m.erase(it);
+        }
+      }
+      break;
+    case 6:
+      if (!m.empty()) {
+        auto it = std::next(m.begin(), gen() % m.size());
+        int k = it->first - (drift ? drift : 1) * int(gen() % 50);
+        if (!m.count(k) && C()(k, it->first)) {
+          // Keys below it->first in the order
+          REQUIRE(p.decrease_key(p.find(it->first), k).first->first == k);
+          m.insert({k, it->second});
+          m.erase(it);
+        }
+      }
+      break;
+    case 7:
+      if (!m.empty()) {
+        auto it = std::next(m.begin(), gen() % m.size());
+        int k = it->first + (drift ? drift : 1) * int(gen() % 50);
+        if (!m.count(k) && C()(it->first, k)) {
+          REQUIRE(p.increase_key(p.find(it->first), k).first->first == k);
+          m.insert({k, it->second});
+          m.erase(it);
+        }
+      }
+      break;
+    default: {
+      int k = key();
+      REQUIRE(p.insert({k, n}).second == m.insert({k, n}).second);
+    }
+    }
+    REQUIRE(p.size() == m.size());
+    if (!m.empty()) { REQUIRE(p.top().first == m.rbegin()->first); }
+    if constexpr (std::is_same_v<HP, ds::minmax_heap>) {
+      if (!m.empty()) {
+        REQUIRE(p.bottom() == std::pair<int, int>(*m.begin()));
+      }
+      if (!m.empty() && n % 16 == 0) {
+        REQUIRE(p.extract_bottom() == std::pair<int, int>(*m.begin()));
+        m.erase(m.begin());
+      } else if (!m.empty() && n % 8 == 0) {
+        p.pop_bottom();
+        m.erase(m.begin());
+      }
+    }
+  }
+  for (auto [k, v] : m) { REQUIRE(p.at(k) == v); }
+
+  std::vector<std::pair<int, int>> top(100), popped;
+  top.erase(p.top_k(100, top.begin()), top.end());
+  p.pop_k(100, std::back_inserter(popped));
+  REQUIRE(popped == top);
+  auto it = m.rbegin();
+  for (auto& e : top) { REQUIRE(e == std::pair<int, int>(*it++)); }
+  m.erase(std::prev(m.end(), top.size()), m.end());
+
+  HeapKvpq<HP, C, ER> copy = p;
+  copy.insert({now, -1});
+  m.insert({now, -1});
+  for (auto e = m.rbegin(); e != m.rend(); ++e) {
+    REQUIRE(copy.top() == std::pair<int, int>(*e));
+    copy.pop();
+  }
+  REQUIRE(copy.empty());
+}
+
+TEST_CASE("heap policies", "[kvpq]") {
+  static_assert(std::is_same_v<kvpq<int, int>, HeapKvpq<ds::dary_heap>>);
+  for (int drift : {0, 1, -1, 7}) {
+    check_heap<ds::radix_heap, std::less<int>>(drift);
+    check_heap<ds::radix_heap, std::greater<>>(-drift);
+    check_heap<ds::pairing_heap, std::less<int>>(drift);
+    check_heap<ds::pairing_heap, std::greater<int>>(-drift);
+    check_heap<ds::minmax_heap, std::less<int>>(drift);
+    check_heap<ds::minmax_heap, std::greater<int>>(-drift);
+    check_heap<ds::dary_heap, std::less<int>, ds::lazy_erase>(drift);
+    check_heap<ds::dary_heap, std::greater<int>, ds::lazy_erase>(-drift);
+  }
+
+  // Radix keys span the whole range of their type, and unsigned keys too
+  kvpq<std::int64_t, int, std::hash<std::int64_t>, std::equal_to<std::int64_t>,
+       std::less<std::int64_t>, 2, ds::inline_key,
+       std::allocator<std::pair<std::int64_t, int>>, ds::no_stats,
+       ds::radix_heap>
+      wide;
+  std::vector<std::int64_t> keys{std::numeric_limits<std::int64_t>::min(),
+                                 std::numeric_limits<std::int64_t>::max(),
+                                 -1, 0, 1, 1 << 20, -(1 << 20)};
+  for (std::int64_t k : keys) { wide.insert({k, 0}); }
+  std::sort(keys.rbegin(), keys.rend());
+  for (std::int64_t k : keys) {
+    REQUIRE(wide.top().first == k);
+    wide.pop();
+  }
+  kvpq<unsigned, int, std::hash<unsigned>, std::equal_to<unsigned>,
+       std::greater<unsigned>, 2, void,
+       std::allocator<std::pair<unsigned, int>>, ds::no_stats, ds::radix_heap>
+      times;
+  times.insert({{5u, 0}, {0u, 0}, {~0u, 0}, {3u, 0}});
+  for (unsigned k : {0u, 3u, 5u, ~0u}) {
+    REQUIRE(times.top().first == k);
+    times.pop();
+  }
+}
+
+// The entries of p in iteration order, checking that they are size() long
+// both ways
+template <typename Q> std::map<int, int> entries(const Q& p) {
+  REQUIRE(std::size_t(std::distance(p.begin(), p.end())) == p.size());
+  std::size_t back = 0;
+  for (auto it = p.end(); it != p.begin(); --it) { ++back; }
+  REQUIRE(back == p.size());
+  return std::map<int, int>(p.begin(), p.end());
+}
+
+TEST_CASE("lazy erase", "[kvpq]") {
+  static_assert(std::is_same_v<LazyKvpq::iterator::iterator_category,
+                               std::bidirectional_iterator_tag>);
+  // Dead entries below the top
+  LazyKvpq p(16);
+  std::map<int, int> m;
+  for (int k = 0; k < 1000; ++k) {
+    p.insert({k, -k});
+    m.insert({k, -k});
+  }
+  for (int k = 1; k < 900; k += 2) {
+    REQUIRE(p.erase(k) == 1);
+    m.erase(k);
+  }
+  REQUIRE(p.size() == m.size());
+  REQUIRE(entries(p) == m);
+  REQUIRE(p.end() - p.begin() == std::ptrdiff_t(m.size()));
+  // Iterator arithmetic steps over them too
+  {
+    LazyKvpq q;
+    for (int k = 0; k < 8; ++k) { q.insert({k, -k}); }
+    int third = (q.begin() + 2)->first;
+    q.erase(q.begin() + 1);
+    auto it = q.begin();
+    it += 1;
+    REQUIRE(it->first == third);
+    REQUIRE(it - q.begin() == 1);
+    REQUIRE(q.begin()[1] == *it);
+    REQUIRE(it - 1 == q.begin());
+    it -= 1;
+    REQUIRE(it == q.begin());
+    REQUIRE(q.begin() + 7 == q.end());
+    REQUIRE(q.end() - 7 == q.cbegin());
+    REQUIRE(q.begin() - q.end() == -7);
+  }
+  std::vector<std::pair<int, int>> top(300);
+  top.erase(p.top_k(300, top.begin()), top.end());
+  auto it = m.rbegin();
+  for (auto& e : top) { REQUIRE(e == std::pair<int, int>(*it++)); }
+
+  // Copies, moves to another allocator and images keep them
+  LazyKvpq copy = p;
+  REQUIRE(copy == p);
+  REQUIRE(entries(copy) == m);
+  auto path = std::filesystem::temp_directory_path() / "tests_kvpq.image";
+  p.save(path);
+  using eager = kvpq<int, int>;
+  REQUIRE_THROWS_AS(eager::open_mapped(path), std::runtime_error);
+  LazyKvpq mapped = LazyKvpq::open_mapped(path);
+  std::filesystem::remove(path);
+  REQUIRE(entries(mapped) == m);
+  using PmrLazyKvpq =
+      ds::pmr::kvpq<int, int, std::hash<int>, std::equal_to<int>,
+                    std::less<int>, 2, ds::inline_key, ds::no_stats,
+                    ds::dary_heap, ds::lazy_erase>;
+  counting_resource r, s;
+  {
+    PmrLazyKvpq q(&r);
+    q.insert(p.begin(), p.end());
+    for (int k = 0; k < 900; k += 4) { q.erase(k); }
+    PmrLazyKvpq other(std::move(q), &s);
+    std::map<int, int> n = m;
+    for (int k = 0; k < 900; k += 4) { n.erase(k); }
+    REQUIRE(entries(other) == n);
+    drain(other, n);
+  }
+  for (auto* q : {&p, &copy, &mapped}) { drain(*q, m); }
+
+  // Cancelling most entries before they reach the top, as timers are,
+  // compacts the heap
+  std::mt19937 gen(18);
+  std::uniform_int_distribution<int> key(0, 20000);
+  m.clear();
+  for (int n = 0; n < 5000; ++n) {
+    int k = key(gen);
+    if (m.insert({k, n}).second) { p.insert({k, n}); }
+  }
+  for (int n = 0; n < 30000; ++n) {
+    int k = key(gen);
+    if (n % 8 < 3) {
+      auto e = std::next(m.begin(), gen() % m.size());
+      REQUIRE(p.erase(e->first) == 1);
+      m.erase(e);
+    } else if (n % 8 == 3) {
+      REQUIRE(p.top() == std::pair<int, int>(*m.rbegin()));
+      p.pop();
+      m.erase(std::prev(m.end()));
+    } else if (n % 16 == 4) {
+      auto top = std::prev(m.end());
+      bool fresh = !m.count(k);
+      auto [e, updated] = p.update(p.begin(), k);
+      REQUIRE(updated == (fresh || k == top->first));
+      REQUIRE(e->first == k);
+      if (fresh) {
+        m.insert({k, top->second});
+        m.erase(top);
+      }
+    } else {
+      REQUIRE(p.insert({k, n}).second == m.insert({k, n}).second);
+    }
+    REQUIRE(p.size() == m.size());
+    REQUIRE(p.top().first == m.rbegin()->first);
+    if (n % 1000 == 0) { REQUIRE(entries(p) == m); }
+  }
+  p.shrink_to_fit();
+  REQUIRE(entries(p) == m);
+  drain(p, m);
+}
+
+template <typename Q> void check_pop_k(std::mt19937& gen) {
+  Q p;
+  std::map<int, int> m;
+  std::uniform_int_distribution<int> key(0, 100000);
+  for (int round = 0; round < 40; ++round) {
+    for (int i = gen() % 3000; i--;) {
+      int k = key(gen);
+      if (m.insert({k, -k}).second) { p.insert({k, -k}); }
+    }
+    std::size_t n = gen() % 2 ? gen() % 40 : gen() % 4000;
+
+    std::vector<std::pair<int, int>> top(n), popped;
+    top.erase(p.top_k(n, top.begin()), top.end());
+    REQUIRE(top.size() == std::min(n, m.size()));
+    auto it = m.rbegin();
+    for (auto& e : top) { REQUIRE(e == std::pair<int, int>(*it++)); }
+    REQUIRE(p.size() == m.size());
+
+    p.pop_k(n, std::back_inserter(popped));
+    REQUIRE(popped == top);
+    for (auto& [k, v] : popped) {
+      m.erase(k);
+      REQUIRE(!p.contains(k));
+    }
+    REQUIRE(p.size() == m.size());
+    if (!m.empty()) { REQUIRE(p.top().first == m.rbegin()->first); }
+  }
+  while (!m.empty()) {
+    REQUIRE(p.top().first == m.rbegin()->first);
+    REQUIRE(p.at(m.begin()->first) == m.begin()->second);
+    p.pop();
+    m.erase(std::prev(m.end()));
+  }
+  std::vector<std::pair<int, int>> none;
+  p.pop_k(5, std::back_inserter(none));
+  REQUIRE(none.empty());
+}
+
+TEST_CASE("pop_k and top_k", "[kvpq]") {
+  std::mt19937 gen(14);
+  check_pop_k<kvpq<int, int>>(gen);
+  check_pop_k<kvpq<int, int, std::hash<int>, std::equal_to<int>,
+                   std::less<int>, 5>>(gen);
+  check_pop_k<kvpq<int, int, std::hash<int>, std::equal_to<int>, std::less<>,
+                   2, ds::inline_key>>(gen);
+  check_pop_k<HeapKvpq<ds::radix_heap>>(gen);
+  check_pop_k<HeapKvpq<ds::pairing_heap>>(gen);
+  check_pop_k<HeapKvpq<ds::minmax_heap>>(gen);
+  check_pop_k<LazyKvpq>(gen);
+}
+
+// The bytes of the file at path
+std::string read_file(const std::filesystem::path& path) {
+  std::ifstream in(path, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(in), {});
+}
+
+template <typename Q> void check_image(std::mt19937& gen) {
+  auto path = std::filesystem::temp_directory_path() / "tests_kvpq.image";
+  Q p(16);
+  std::map<int, int> m;
+  std::uniform_int_distribution<int> key(0, 100000);
+  // Save in the middle of a rehash, with entries in both tables
+  while (!p.rehashing() || m.size() < 1000) {
+    int k = key(gen);
+    if (m.insert({k, -k}).second) { p.insert({k, -k}); }
+  }
+  p.save(path);
+  std::string saved = read_file(path);
+
+  Q q = Q::open_mapped(path);
+  REQUIRE(q.size() == m.size());
+  for (auto& [k, v] : m) { REQUIRE(q.at(k) == v); }
+
+  // Saving a mapped queue over its own image replaces the file without
+  // disturbing the pages the queue still reads from it
+  for (int i = 0; i < 10; ++i) {
+    int k = key(gen);
+    if (m.insert({k, -k}).second) { q.insert({k, -k}); }
+  }
+  q.save(path);
+  saved = read_file(path);
+  REQUIRE(q.size() == m.size());
+  for (auto& [k, v] : m) { REQUIRE(q.at(k) == v); }
+  {
+    Q r = Q::open_mapped(path);
+    REQUIRE(r == q);
+    for (auto& [k, v] : m) { REQUIRE(r.at(k) == v); }
+  }
+
+  // Changes to the mapped queue, including growing it out of the image, leave
+  // the file as it was
+  for (int i = 0; i < 3000; ++i) {
+    int k = key(gen);
+    if (gen() % 3) {
+      if (m.insert({k, -k}).second) { q.insert({k, -k}); }
+    } else {
+      REQUIRE(q.erase(k) == m.erase(k));
+    }
+  }
+  REQUIRE(read_file(path) == saved);
+  Q moved = std::move(q);
+  Q empty;
+  swap(moved, empty);
+  drain(empty, m);
+
+  // An empty queue round trips too
+  Q().save(path);
+  REQUIRE(Q::open_mapped(path).empty());
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("images", "[kvpq]") {
+  std::mt19937 gen(15);
+  check_image<kvpq<int, int>>(gen);
+  check_image<kvpq<int, int, std::hash<int>, std::equal_to<int>,
+                   std::less<int>, 4>>(gen);
+  check_image<kvpq<int, int, std::hash<int>, std::equal_to<int>, std::less<>,
+                   2, ds::inline_key>>(gen);
+  check_image<HeapKvpq<ds::radix_heap>>(gen);
+  check_image<HeapKvpq<ds::pairing_heap>>(gen);
+  check_image<HeapKvpq<ds::minmax_heap>>(gen);
+  check_image<LazyKvpq>(gen);
+
+  // Files that are not images of the queue's type are rejected
+  auto path = std::filesystem::temp_directory_path() / "tests_kvpq.image";
+  using narrow = kvpq<int, int>;
+  kvpq<int, long> wide;
+  wide.insert({1, 2});
+  wide.save(path);
+  REQUIRE_THROWS_AS(narrow::open_mapped(path), std::runtime_error);
+  REQUIRE(kvpq<int, long>::open_mapped(path).at(1) == 2);
+  std::ofstream(path, std::ios::binary) << "not an image";
+  REQUIRE_THROWS_AS(narrow::open_mapped(path), std::runtime_error);
+  std::ofstream(path, std::ios::binary).close();
+  REQUIRE_THROWS_AS(narrow::open_mapped(path), std::runtime_error);
+  std::filesystem::remove(path);
+  REQUIRE_THROWS_AS(narrow::open_mapped(path), std::system_error);
+}
+
+TEST_CASE("handles", "[kvpq]") {
+  using Q = kvpq<int, int, counted_hash>;
+  Q p(16);
+  std::vector<Q::handle> handles;
+  int n = 0;
+  for (; !p.rehashing(); ++n) {
+    handles.push_back(p.handle_of(p.insert({n, -n}).first));
+  }
+  // Handles outlive heap moves, growth and migration without hashing
+  int calls = counted_hash::calls;
+  for (int k = 0; k < n; ++k) {
+    REQUIRE(p.find(handles[k])->first == k);
+    REQUIRE(p.find(handles[k])->second == -k);
+    REQUIRE(p.contains(handles[k]));
+  }
+  REQUIRE(counted_hash::calls == calls);
+  int m = n;
+  for (; m < 2 * n || p.rehashing(); ++m) { p.insert({m, -m}); }
+  p.pop();
+  calls = counted_hash::calls;
+  const Q& q = p;
+  for (int k = 0; k < n; ++k) {
+    REQUIRE(q.find(handles[k])->first == k);
+    REQUIRE(p.erase(handles[k]) == 1);
+    REQUIRE(!p.contains(handles[k]));
+    REQUIRE(p.find(handles[k]) == p.end());
+    REQUIRE(p.erase(handles[k]) == 0);
+  }
+  REQUIRE(counted_hash::calls == calls);
+  REQUIRE(p.size() == size_t(m - n - 1));
+
+  // A stale handle does not find an entry inserted again with its key
+  auto five = p.insert({5, 6}).first;
+  REQUIRE(!p.contains(handles[5]));
+  REQUIRE(p.find(handles[5]) == p.end());
+  REQUIRE(p.erase(handles[5]) == 0);
+  REQUIRE(!p.update(handles[5], 7).second);
+  REQUIRE(p.contains(5));
+  auto h = p.handle_of(five);
+  auto [it, updated] = p.update(h, m);
+  REQUIRE(updated);
+  REQUIRE(p.top().first == m);
+  REQUIRE(p.top().second == 6);
+  REQUIRE(!p.contains(h));
+  // Nor once its entry is rekeyed, while a handle of the new key survives
+  // Robin Hood shifts, growth and migration
+  h = p.handle_of(it);
+  for (int k = m + 1; k < 4 * m; ++k) { p.insert({k, -k}); }
+  p.update(h, 5);
+  REQUIRE(!p.contains(h));
+  h = p.handle_of(p.find(5));
+  for (int k = 4 * m; k < 16 * m; ++k) { p.insert({k, -k}); }
+  REQUIRE(p.find(h)->second == 6);
+  REQUIRE(p.erase(h) == 1);
+  REQUIRE(!p.contains(5));
+  REQUIRE(!p.contains(m));
+}
@@ -1,6 +1,8 @@
 #include <catch2/catch.hpp>
+#include <cstdint>
 #include <iostream>
 #include <limits>
+#include <random>
 #include <variant>
 
 #define private public
@@ -86,3 +88,71 @@ TEST_CASE("static_load_factor", "[kvpq]") {
   REQUIRE(get_capacity(0.2, Mask(7)) == 1);
   REQUIRE(get_capacity(0.2, Mask(15)) == 2);
 }
+
+TEST_CASE("heap_capacity", "[kvpq]") {
+  IntStringKvpq p;
+  p.max_load_factor(0.2);
+  size_t reallocations = 0;
+  for (int i = 0; i < 1000; ++i) {
+    size_t heap_capacity = p.heap_capacity_;
+    p.insert({i, std::to_string(i)});
+    REQUIRE(p.heap_capacity_ >= p.size());
+    reallocations += p.heap_capacity_ != heap_capacity;
+  }
+  REQUIRE(reallocations <= 10);
+  REQUIRE(p.heap_capacity_ < 2 * p.size());
+  REQUIRE(p.heap_capacity_ < p.capacity() / 4);
+
+  for (int i = 0; i < 1000; i += 2) { p.erase(i); }
+  p.shrink_to_fit();
+  REQUIRE(p.heap_capacity_ == p.size());
+  REQUIRE(p.capacity() == size_t(get_bucket_mask(500, 0.2)) + 1);
+  for (int i = 0; i < 1000; ++i) { REQUIRE(p.contains(i) == bool(i % 2)); }
+
+  p.reserve(2000);
+  REQUIRE(p.heap_capacity_ == 2000);
+  REQUIRE(get_capacity(0.2, Mask(p.capacity() - 1)) >= 2000);
+}
+
+TEST_CASE("heap alignment", "[kvpq]") {
+  IntStringKvpq p;
+  REQUIRE(std::uintptr_t(p.heap_ + 1) % 64 == 0);
+  for (int i = 0; i < 100; ++i) { p.insert({i, ""}); }
+  REQUIRE(std::uintptr_t(p.heap_ + 1) % 64 == 0);
+  p.shrink_to_fit();
+  REQUIRE(std::uintptr_t(p.heap_ + 1) % 64 == 0);
+}
+
+// Each occupied slot after an occupied slot is at most one bucket further
+// from its home bucket, so every cluster is ordered by home bucket
+template <typename B> bool robin_hood_ordered(const B& b) {
+  for (size_t i = 0; i <= b.mask; ++i) {
+    size_t j = b.next(i);
+    if (!b.free(i) && !b.free(j) &&
+        b.distance(j, b.hash_at(j)) > b.distance(i, b.hash_at(i)) + 1) {
+      return false;
+    }
+  }
+  return true;
+}
+
+TEST_CASE("robin hood order", "[kvpq]") {
+  std::mt19937 gen(3);
+  std::uniform_int_distribution<int> key(0, 4000);
+  kvpq<int, int> p;
+  p.max_load_factor(20);
+  for (int n = 0; n < 20000; ++n) {
+    int k = key(gen);
+    if (n % 4 == 3) {
+      p.erase(k);
+    } else if (n % 4 == 2 && p.size()) {
+      p.update(p.begin(), k);
+    } else {
+      p.insert({k, n});
+    }
+    REQUIRE(robin_hood_ordered(p.buckets_));
+    if (p.migrating()) { REQUIRE(robin_hood_ordered(p.old_buckets_)); }
+  }
+  auto copy = p;
+  REQUIRE(robin_hood_ordered(copy.buckets_));
+}
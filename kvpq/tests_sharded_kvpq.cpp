@@ -0,0 +1,137 @@
+#include <algorithm>
+#include <atomic>
+#include <catch2/catch.hpp>
+#include <map>
+#include <random>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "sharded_kvpq.hpp"
+
+using IntIntSharded = ds::sharded_kvpq<int, int>;
+
+TEST_CASE("sharded operations", "[sharded_kvpq]") {
+  IntIntSharded p(8);
+  REQUIRE(p.shard_count() == 8);
+  REQUIRE(p.empty());
+  std::mt19937 gen(3);
+  std::uniform_int_distribution<int> key(0, 5000);
+  std::map<int, int> m;
+  for (int n = 0; n < 20000; ++n) {
+    int k = key(gen);
+    switch (n % 6) {
+    case 0: REQUIRE(p.erase(k) == m.erase(k)); break;
+    case 1:
+      if (!m.empty()) {
+        auto it = std::next(m.begin(), gen() % m.size());
+        bool moved = !m.count(k);
+        REQUIRE(p.update(it->first, k) == (moved || it->first == k));
+        if (moved) {
+          m[k] = it->second;
+          m.erase(it);
+        }
+      }
+      break;
+    case 2:
+      REQUIRE(p.insert_or_assign(k, n) == !m.count(k));
+      m[k] = n;
+      break;
+    case 3:
+      REQUIRE(p.visit(k, [](int& v) { ++v; }) == m.count(k));
+      if (m.count(k)) { ++m[k]; }
+      break;
+    default: REQUIRE(p.insert({k, n}) == m.insert({k, n}).second);
+    }
+    REQUIRE(p.size() == m.size());
+    REQUIRE(p.contains(k) == m.count(k));
+    REQUIRE(p.find(k) ==
+            (m.count(k) ? std::optional<int>(m[k]) : std::nullopt));
+  }
+
+  auto top = p.top(100);
+  REQUIRE(top.size() == 100);
+  auto it = m.rbegin();
+  for (auto& [k, v] : top) {
+    REQUIRE(k == it->first);
+    REQUIRE(v == it->second);
+    ++it;
+  }
+  REQUIRE(p.top(m.size() + 10).size() == m.size());
+
+  // Relaxed pops still return each entry once
+  std::size_t n = m.size();
+  for (; n; --n) {
+    auto e = p.try_pop();
+    REQUIRE(e);
+    REQUIRE(m.at(e->first) == e->second);
+    m.erase(e->first);
+  }
+  REQUIRE(!p.try_pop());
+  REQUIRE(p.empty());
+}
+
+TEST_CASE("sharded pop order", "[sharded_kvpq]") {
+  // One shard is an exact priority queue
+  IntIntSharded exact(1);
+  for (int k = 0; k < 1000; ++k) { exact.insert({k * 7919 % 1000, k}); }
+  for (int k = 1000; k--;) { REQUIRE(exact.try_pop()->first == k); }
+
+  // With more, a popped entry is near the top
+  IntIntSharded relaxed(16);
+  for (int k = 0; k < 100000; ++k) { relaxed.insert({k, k}); }
+  long error = 0;
+  for (int n = 0; n < 10000; ++n) {
+    auto top = relaxed.top(1)[0].first;
+    error += top - relaxed.try_pop()->first;
+  }
+  REQUIRE(error / 10000. < 16 * 4);
+  relaxed.clear();
+  REQUIRE(relaxed.empty());
+}
+
+TEST_CASE("sharded concurrency", "[sharded_kvpq]") {
+  constexpr int THREADS = 8, KEYS = 20000;
+  IntIntSharded p(4);
+  std::vector<std::thread> threads;
+  // Catch assertions are not thread-safe, so threads count their failures
+  std::atomic<int> failures{0};
+  // Each thread owns the keys equal to its index modulo THREADS
+  for (int t = 0; t < THREADS; ++t) {
+    threads.emplace_back([&p, &failures, t] {
+      for (int k = t; k < KEYS; k += THREADS) {
+        failures += !p.insert({k, -k});
+      }
+      for (int k = t; k < KEYS; k += 2 * THREADS) {
+        failures += p.erase(k) != 1;
+      }
+      for (int k = t + THREADS; k < KEYS; k += 2 * THREADS) {
+        failures += p.find(k) != std::optional<int>(-k);
+        failures += !p.update(k, k + KEYS);
+      }
+    });
+  }
+  for (auto& t : threads) { t.join(); }
+  threads.clear();
+  REQUIRE(failures == 0);
+  REQUIRE(p.size() == KEYS / 2);
+  for (int k = 0; k < KEYS; ++k) {
+    REQUIRE(!p.contains(k));
+    REQUIRE(p.contains(k + KEYS) == (k / THREADS % 2 == 1));
+  }
+
+  // Concurrent pops take every entry exactly once
+  std::vector<std::vector<int>> popped(THREADS);
+  for (int t = 0; t < THREADS; ++t) {
+    threads.emplace_back([&p, &popped, t] {
+      while (auto e = p.try_pop()) { popped[t].push_back(e->second); }
+    });
+  }
+  for (auto& t : threads) { t.join(); }
+  std::vector<int> all;
+  for (auto& v : popped) { all.insert(all.end(), v.begin(), v.end()); }
+  std::sort(all.begin(), all.end());
+  REQUIRE(all.size() == KEYS / 2);
+  REQUIRE(std::adjacent_find(all.begin(), all.end()) == all.end());
+  REQUIRE(p.empty());
+}
@@ -0,0 +1,108 @@
+#include <array>
+#include <atomic>
+#include <catch2/catch.hpp>
+#include <cstdint>
+#include <map>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "swmr_kvpq.hpp"
+
+using IntIntSwmr = ds::swmr_kvpq<int, int>;
+
+TEST_CASE("swmr operations", "[swmr_kvpq]") {
+  IntIntSwmr p;
+  REQUIRE(p.empty());
+  REQUIRE(!p.top());
+  REQUIRE(!p.pop());
+  std::mt19937 gen(5);
+  std::uniform_int_distribution<int> key(0, 2000);
+  std::map<int, int> m;
+  for (int n = 0; n < 10000; ++n) {
+    int k = key(gen);
+    switch (n % 5) {
+    case 0: REQUIRE(p.erase(k) == m.erase(k)); break;
+    case 1:
+      if (!m.empty()) {
+        REQUIRE(p.pop()->first == m.rbegin()->first);
+        m.erase(std::prev(m.end()));
+      }
+      break;
+    case 2:
+      REQUIRE(p.insert_or_assign(k, n) == !m.count(k));
+      m[k] = n;
+      break;
+    default: REQUIRE(p.insert({k, n}) == m.insert({k, n}).second);
+    }
+    REQUIRE(p.size() == m.size());
+    REQUIRE(p.contains(k) == m.count(k));
+    REQUIRE(p.find(k) ==
+            (m.count(k) ? std::optional<int>(m[k]) : std::nullopt));
+    if (!m.empty()) { REQUIRE(p.top()->first == m.rbegin()->first); }
+  }
+  REQUIRE_THROWS_AS(p.at(-1), std::out_of_range);
+
+  // A batch of changes is published at once
+  p.write([](IntIntSwmr::kvpq_type& q) {
+    for (int k = -10; k < 0; ++k) { q.insert({k, k}); }
+  });
+  REQUIRE(p.size() == m.size() + 10);
+  REQUIRE(p.at(-3) == -3);
+  p.clear();
+  REQUIRE(p.empty());
+}
+
+// A value whose words are all equal unless it was read while being written
+struct wide {
+  explicit wide(std::uint64_t x = 0) { w.fill(x); }
+  bool whole() const {
+    for (auto x : w) {
+      if (x != w[0]) { return false; }
+    }
+    return true;
+  }
+  std::array<std::uint64_t, 8> w;
+};
+
+TEST_CASE("swmr concurrent readers", "[swmr_kvpq]") {
+  constexpr int READERS = 4, KEYS = 20000;
+  ds::swmr_kvpq<int, wide> p(16, {}, {}, {}, {}, 2);
+  // Keys below inserted are in the queue unless they are multiples of 3 below
+  // erased, and those below erasing may have been erased
+  std::atomic<int> inserted{0}, erasing{0}, erased{0};
+  std::atomic<bool> done{false};
+  // Catch assertions are not thread-safe, so readers count their failures
+  std::atomic<int> failures{0};
+  std::vector<std::thread> readers;
+  for (int t = 0; t < READERS; ++t) {
+    readers.emplace_back([&, t] {
+      std::mt19937 gen(t);
+      while (!done) {
+        int e = erased, i = inserted;
+        if (!i) { continue; }
+        int k = gen() % i;
+        auto v = p.find(k);
+        failures += v && (!v->whole() || v->w[0] != std::uint64_t(k));
+        // Erased before the find started, or not yet erased after it ended
+        failures += v && k % 3 == 0 && k < e;
+        failures += !v && !(k % 3 == 0 && k < erasing);
+        if (auto top = p.top()) { failures += !top->second.whole(); }
+      }
+    });
+  }
+  for (int k = 0; k < KEYS; ++k) {
+    p.insert({k, wide(k)});
+    inserted = k + 1;
+    if (k % 2 && k / 2 % 3 == 0) {
+      erasing = k / 2 + 1;
+      p.erase(k / 2);
+      erased = k / 2 + 1;
+    }
+    if (k % 100 == 0) { p.insert_or_assign(k, wide(k)); }
+  }
+  done = true;
+  for (auto& r : readers) { r.join(); }
+  REQUIRE(failures == 0);
+  REQUIRE(p.size() == std::size_t(KEYS - (erased + 2) / 3));
+}